@@ -0,0 +1,147 @@
+#include <cerrno>
+#include <alloca.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "acquisition.hpp"
+
+namespace spectrometer {
+
+  void periodHistogram::print(std::ostream &os, bool with_bins) const
+  {
+    os << count << " periods, mean " << mean() / 1e3 << " us, sd " << stddev() / 1e3 << " us, min "
+       << minimum / 1e3 << " us, p50 " << percentile(0.5) / 1e3 << " us, p99 " << percentile(0.99) / 1e3
+       << " us, p99.9 " << percentile(0.999) / 1e3 << " us, max " << maximum / 1e3 << " us" << std::endl;
+    if (!with_bins) return;
+    for (size_t b = 0; b < bins.size(); ++b)
+      if (bins[b])
+	os << "  " << b * binWidth / 1e3 << ".." << (b + 1) * binWidth / 1e3 << " us: " << bins[b] << std::endl;
+  }
+
+  acquisitionThread::acquisitionThread(frameSource &src, frameSink frame_sink, const realtimeOptions &opts,
+				       int64_t bin_width_ns, size_t bin_count)
+    : source(src), sink(std::move(frame_sink)), options(opts), periods(bin_width_ns, bin_count)
+  {
+  }
+
+  acquisitionThread::~acquisitionThread(void)
+  {
+    stop();
+  }
+
+  void acquisitionThread::applyOptions(void)
+  {
+    std::vector<std::string> lines;
+
+    if (options.cpu >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(options.cpu, &set);
+      int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      lines.push_back("affinity to CPU " + std::to_string(options.cpu) + ": " +
+		      (ret == 0 ? std::string("applied") : std::string(strerror(ret))));
+    }
+
+    if (options.fifoPriority > 0) {
+      sched_param param;
+      param.sched_priority = std::min(options.fifoPriority, sched_get_priority_max(SCHED_FIFO));
+      int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+      lines.push_back("SCHED_FIFO priority " + std::to_string(param.sched_priority) + ": " +
+		      (ret == 0 ? std::string("applied") : std::string(strerror(ret))));
+    }
+
+    if (options.lockMemory) {
+      // freed memory stays mapped, and so locked, instead of faulting back in later
+      mallopt(M_TRIM_THRESHOLD, -1);
+      mallopt(M_MMAP_MAX, 0);
+      int ret = mlockall(MCL_CURRENT | MCL_FUTURE) == 0 ? 0 : errno;
+      lines.push_back(std::string("mlockall: ") + (ret == 0 ? "applied" : strerror(ret)));
+    }
+
+    if (options.prefaultStack > 0) {
+      // touch the pages the readout and the sink may grow the stack into
+      volatile uint8_t *stack = static_cast<uint8_t *>(alloca(options.prefaultStack));
+      for (size_t i = 0; i < options.prefaultStack; i += 4096) stack[i] = 0;
+      lines.push_back("stack prefault of " + std::to_string(options.prefaultStack / 1024) + " KiB: applied");
+    }
+
+    if (!options.prefaultBuffers.empty()) {
+      // without mlockall() these pages could still be unmapped; writing back what is read
+      // maps every one of them for writing and leaves a ring that is in use as it was
+      size_t total = 0;
+      for (const auto &buffer : options.prefaultBuffers) {
+	volatile uint8_t *bytes = static_cast<uint8_t *>(buffer.first);
+	for (size_t i = 0; i < buffer.second; i += 4096) bytes[i] = bytes[i];
+	if (buffer.second) bytes[buffer.second - 1] = bytes[buffer.second - 1];
+	total += buffer.second;
+      }
+      lines.push_back("buffer prefault of " + std::to_string(total / 1024) + " KiB in " +
+		      std::to_string(options.prefaultBuffers.size()) + " buffers: applied");
+    }
+
+    std::lock_guard<std::mutex> guard(statsLock);
+    report = std::move(lines);
+  }
+
+  void acquisitionThread::loop(uint64_t max_frames)
+  {
+    applyOptions();
+
+    frameMetadata meta;
+    const uint16_t *raw;
+    std::chrono::steady_clock::time_point last;
+    try {
+      for (uint64_t n = 0; !stopping && (max_frames == 0 || n < max_frames); ++n) {
+	if (!source.next(meta, raw)) break;
+	auto now = std::chrono::steady_clock::now();
+	if (n > 0) {
+	  std::lock_guard<std::mutex> guard(statsLock);
+	  periods.add(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count());
+	}
+	last = now;
+
+	sink(meta, raw);
+	frames.fetch_add(1, std::memory_order_relaxed);
+      }
+    } catch (const std::exception &e) {
+      error = e.what();
+    }
+    finished = true;
+  }
+
+  void acquisitionThread::start(uint64_t max_frames)
+  {
+    if (thread.joinable())
+      throw std::runtime_error("Acquisition is already running!");
+    stopping = false;
+    finished = false;
+    error.clear();
+    thread = std::thread(&acquisitionThread::loop, this, max_frames);
+  }
+
+  void acquisitionThread::stop(void)
+  {
+    stopping = true;
+    join();
+  }
+
+  void acquisitionThread::join(void)
+  {
+    if (thread.joinable()) thread.join();
+  }
+
+  periodHistogram acquisitionThread::getPeriods(void)
+  {
+    std::lock_guard<std::mutex> guard(statsLock);
+    return periods;
+  }
+
+  std::vector<std::string> acquisitionThread::getReport(void)
+  {
+    std::lock_guard<std::mutex> guard(statsLock);
+    return report;
+  }
+
+}
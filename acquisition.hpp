@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <utility>
+
+#include "spectrometer.hpp"
+
+namespace spectrometer {
+  struct realtimeOptions {
+    int cpu = -1;              // pin the thread to this CPU, -1 to leave it floating
+    int fifoPriority = 0;      // SCHED_FIFO priority 1..99, 0 to stay SCHED_OTHER
+    bool lockMemory = false;   // mlockall() current and future pages of the process, no malloc trimming
+    size_t prefaultStack = 256 * 1024; // bytes of stack touched before the first frame
+    // buffers the source and the sink write per frame, e.g. rings and frame arrays: every page
+    // is touched before the first frame, contents kept, whether or not mlockall() succeeds
+    std::vector<std::pair<void *, size_t>> prefaultBuffers;
+  };
+
+  /*
+    Histogram of inter-frame periods in fixed bins from 0, the last bin
+    collecting everything beyond. Exact minimum, maximum, mean and standard
+    deviation are kept besides the bins.
+  */
+  class periodHistogram {
+  private:
+    int64_t binWidth; // [ns]
+    std::vector<uint64_t> bins;
+    uint64_t count = 0;
+    int64_t minimum = 0, maximum = 0;
+    double sum = 0, squares = 0;
+
+  public:
+    periodHistogram(int64_t bin_width_ns=10000, size_t bin_count=1000)
+      : binWidth(bin_width_ns), bins(bin_count, 0) {}
+
+    void add(int64_t period) {
+      size_t b = period < 0 ? 0 : std::min<size_t>(period / binWidth, bins.size() - 1);
+      ++bins[b];
+      minimum = count ? std::min(minimum, period) : period;
+      maximum = count ? std::max(maximum, period) : period;
+      ++count;
+      sum += period;
+      squares += double(period) * period;
+    }
+
+    void clear(void) { std::fill(bins.begin(), bins.end(), 0); count = 0; sum = squares = 0; }
+
+    uint64_t size(void) const { return count; }
+    int64_t min(void) const { return minimum; }
+    int64_t max(void) const { return maximum; }
+    double mean(void) const { return count ? sum / count : 0; }
+    double stddev(void) const {
+      return count > 1 ? std::sqrt(std::max(0.0, (squares - sum * sum / count) / (count - 1))) : 0;
+    }
+    // Upper edge [ns] of the bin holding the p-th fraction of the periods
+    int64_t percentile(double p) const {
+      uint64_t target = std::ceil(p * count), seen = 0;
+      for (size_t b = 0; b < bins.size(); ++b)
+	if ((seen += bins[b]) >= target && seen) return (b + 1) * binWidth;
+      return maximum;
+    }
+
+    // Summary and the non-empty bins as "from..to us: count"
+    void print(std::ostream &os=std::cout, bool with_bins=false) const;
+  };
+
+  /*
+    Runs a frameSource on a dedicated thread and hands every frame to a sink
+    there, e.g. processingGraph::push() or shmPublisher::publish(), so the
+    readout is never delayed by processing.
+
+    Before the first frame the thread applies the realtimeOptions: CPU
+    affinity, SCHED_FIFO, mlockall() with malloc trimming off, and a prefault
+    of its stack and of the buffers the frames pass through. A step that fails, typically for lack of CAP_SYS_NICE or
+    RLIMIT_MEMLOCK, is reported by getReport() and skipped; acquisition goes on
+    with what could be applied. Inter-frame periods go into a histogram.
+  */
+  class acquisitionThread {
+  public:
+    typedef std::function<void(const frameMetadata &meta, const uint16_t *raw)> frameSink;
+
+  private:
+    frameSource &source;
+    frameSink sink;
+    realtimeOptions options;
+    std::thread thread;
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> finished{false};
+    std::atomic<uint64_t> frames{0};
+    std::string error;
+
+    std::mutex statsLock;
+    periodHistogram periods;
+    std::vector<std::string> report;
+
+    void applyOptions(void);
+    void loop(uint64_t max_frames);
+
+  public:
+    acquisitionThread(frameSource &src, frameSink frame_sink, const realtimeOptions &opts=realtimeOptions(),
+		      int64_t bin_width_ns=10000, size_t bin_count=1000);
+    virtual ~acquisitionThread(void);
+
+    acquisitionThread(const acquisitionThread &) = delete;
+    acquisitionThread& operator=(const acquisitionThread &) = delete;
+
+    // max_frames 0 runs until stop() or the end of the source
+    void start(uint64_t max_frames=0);
+    void stop(void);
+    // Waits for the source to end or max_frames
+    void join(void);
+
+    bool isRunning(void) const { return thread.joinable() && !finished; }
+    uint64_t getFrames(void) const { return frames; }
+    // What the source threw, if it ended acquisition
+    const std::string& getError(void) const { return error; }
+
+    periodHistogram getPeriods(void);
+    // One line per realtime option: applied, or why not
+    std::vector<std::string> getReport(void);
+  };
+}
@@ -0,0 +1,94 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "archive.hpp"
+
+namespace spectrometer {
+
+  static const char archiveMagic[8] = { 'U', '4', 'K', 'A', 'R', 'C', 'H', '1' };
+
+  archiveWriter::archiveWriter(const std::string &path, const float *wavelength_coeffs, const float *linearity_coeffs,
+			       const std::string &serial)
+  {
+    file = std::fopen(path.c_str(), "wb");
+    if (!file)
+      throw std::runtime_error("Failed to create the frame archive!");
+
+    archiveHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, archiveMagic, sizeof(archiveMagic));
+    header.pixelCount = usb4kPixelCount;
+    header.frameSize = sizeof(archivedFrame);
+    std::memcpy(header.wavelengthCoeffs, wavelength_coeffs, sizeof(header.wavelengthCoeffs));
+    std::memcpy(header.linearityCoeffs, linearity_coeffs, sizeof(header.linearityCoeffs));
+    std::strncpy(header.serialNumber, serial.c_str(), sizeof(header.serialNumber) - 1);
+
+    if (std::fwrite(&header, sizeof(header), 1, file) != 1) {
+      std::fclose(file);
+      throw std::runtime_error("Failed to write the archive header!");
+    }
+  }
+
+  archiveWriter::~archiveWriter(void)
+  {
+    if (file) std::fclose(file);
+  }
+
+  void archiveWriter::append(const frameMetadata &meta, const uint16_t *raw)
+  {
+    archivedFrame frame;
+    frame.meta = meta;
+    std::memcpy(frame.raw, raw, sizeof(frame.raw));
+    if (std::fwrite(&frame, sizeof(frame), 1, file) != 1)
+      throw std::runtime_error("Failed to append the frame to the archive!");
+    ++frames;
+  }
+
+  void archiveWriter::flush(void)
+  {
+    if (std::fflush(file) != 0)
+      throw std::runtime_error("Failed to flush the frame archive!");
+  }
+
+  archiveReader::archiveReader(const std::string &path)
+  {
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Failed to open the frame archive!");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(archiveHeader)) {
+      close(fd);
+      throw std::runtime_error("Frame archive is too short!");
+    }
+
+    mappedLength = st.st_size;
+    void *addr = mmap(NULL, mappedLength, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("Failed to map the frame archive!");
+    }
+    madvise(addr, mappedLength, MADV_SEQUENTIAL);
+
+    mapped = static_cast<const uint8_t *>(addr);
+    header = reinterpret_cast<const archiveHeader *>(mapped);
+    if (std::memcmp(header->magic, archiveMagic, sizeof(archiveMagic)) != 0 ||
+	header->pixelCount != usb4kPixelCount || header->frameSize != sizeof(archivedFrame)) {
+      munmap(addr, mappedLength);
+      close(fd);
+      throw std::runtime_error("Not a frame archive of this build!");
+    }
+
+    records = reinterpret_cast<const archivedFrame *>(mapped + sizeof(archiveHeader));
+    frames = (mappedLength - sizeof(archiveHeader)) / sizeof(archivedFrame);
+  }
+
+  archiveReader::~archiveReader(void)
+  {
+    if (mapped) munmap(const_cast<uint8_t *>(mapped), mappedLength);
+    if (fd >= 0) close(fd);
+  }
+
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdio>
+
+#include "spectrometer.hpp"
+
+namespace spectrometer {
+  struct archivedFrame {
+    frameMetadata meta;
+    uint16_t raw[usb4kPixelCount];
+  };
+
+  struct archiveHeader {
+    char magic[8];
+    uint32_t pixelCount;
+    uint32_t frameSize;
+    float wavelengthCoeffs[4];
+    float linearityCoeffs[8];
+    char serialNumber[32];
+  };
+
+  /*
+    Raw frame archive: an archiveHeader followed by fixed size archivedFrame
+    records in native byte order, so a reader can map it and index frames
+    directly. The calibration of the recording device travels in the header.
+  */
+  class archiveWriter {
+  private:
+    FILE *file = NULL;
+    uint64_t frames = 0;
+
+  public:
+    archiveWriter(const std::string &path, const float *wavelength_coeffs, const float *linearity_coeffs,
+		  const std::string &serial="");
+    archiveWriter(const std::string &path, const frameSource &spec)
+      : archiveWriter(path, spec.getWavelengthCoeffs(), spec.getLinearityCoeffs(), spec.getSerialNumber()) {}
+    virtual ~archiveWriter(void);
+
+    void append(const frameMetadata &meta, const uint16_t *raw);
+    void append(const archivedFrame &frame) { append(frame.meta, frame.raw); }
+    void flush(void);
+
+    uint64_t size(void) const { return frames; }
+  };
+
+  class archiveReader {
+  private:
+    int fd = -1;
+    const uint8_t *mapped = NULL;
+    size_t mappedLength = 0;
+    const archiveHeader *header = NULL;
+    const archivedFrame *records = NULL;
+    size_t frames = 0;
+
+  public:
+    archiveReader(const std::string &path);
+    virtual ~archiveReader(void);
+
+    archiveReader(const archiveReader &) = delete;
+    archiveReader& operator=(const archiveReader &) = delete;
+
+    size_t size(void) const { return frames; }
+    const archiveHeader& getHeader(void) const { return *header; }
+    const archivedFrame& operator[](size_t i) const { return records[i]; }
+    const archivedFrame* data(void) const { return records; }
+
+    void getWavelengths(std::array<float, usb4kPixelCount> &wavelengths) const {
+      wavelengthsFromCoeffs(header->wavelengthCoeffs, wavelengths);
+    }
+  };
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+#include "spectrometer.hpp"
+
+/*
+  C++20 coroutine front-end of the usb4k asynchronous transfers.
+
+    spectrometer::executor ex;
+    spectrometer::awaitableUsb4k spec(ex, dev);
+
+    spectrometer::task<void> script(spectrometer::awaitableUsb4k &spec) {
+      co_await spec.setIntegration(3800);
+      for (int i = 0; i < 10; ++i) {
+        auto &raw = co_await spec.acquire();
+        ...
+      }
+      float celsius = co_await spec.readPCBTemperature();
+      co_await spec.setTriggerMode(spectrometer::usb4k::SW_TRIGGER);
+    }
+
+    ex.spawn(script(spec));
+    ex.run();
+
+  Every suspended operation is resumed by the executor on the thread calling
+  run(), after spectrometer::handleEvents() has completed its transfers.
+*/
+namespace spectrometer {
+  template <typename T> class task;
+
+  namespace detail {
+    struct finalAwaiter {
+      bool await_ready(void) noexcept { return false; }
+      template <typename P>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+	if (h.promise().continuation) return h.promise().continuation;
+	return std::noop_coroutine();
+      }
+      void await_resume(void) noexcept {}
+    };
+
+    struct promiseBase {
+      std::coroutine_handle<> continuation;
+      std::exception_ptr exception;
+
+      std::suspend_always initial_suspend(void) noexcept { return {}; }
+      finalAwaiter final_suspend(void) noexcept { return {}; }
+      void unhandled_exception(void) { exception = std::current_exception(); }
+    };
+  }
+
+  template <typename T>
+  class task {
+  public:
+    struct promise_type : detail::promiseBase {
+      std::optional<T> value;
+      task get_return_object(void) { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+      template <typename U> void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+    };
+
+    task(task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    task& operator=(task &&other) noexcept {
+      if (this != &other) { if (handle) handle.destroy(); handle = std::exchange(other.handle, nullptr); }
+      return *this;
+    }
+    ~task(void) { if (handle) handle.destroy(); }
+
+    bool await_ready(void) const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+      handle.promise().continuation = awaiting;
+      return handle;
+    }
+    T await_resume(void) {
+      if (handle.promise().exception) std::rethrow_exception(handle.promise().exception);
+      return std::move(*handle.promise().value);
+    }
+
+  private:
+    explicit task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    std::coroutine_handle<promise_type> handle;
+  };
+
+  template <>
+  class task<void> {
+  public:
+    struct promise_type : detail::promiseBase {
+      task get_return_object(void) { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+      void return_void(void) {}
+    };
+
+    task(task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    task& operator=(task &&other) noexcept {
+      if (this != &other) { if (handle) handle.destroy(); handle = std::exchange(other.handle, nullptr); }
+      return *this;
+    }
+    ~task(void) { if (handle) handle.destroy(); }
+
+    bool await_ready(void) const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+      handle.promise().continuation = awaiting;
+      return handle;
+    }
+    void await_resume(void) {
+      if (handle.promise().exception) std::rethrow_exception(handle.promise().exception);
+    }
+
+  private:
+    friend class executor;
+    explicit task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    std::coroutine_handle<promise_type> handle;
+  };
+
+  class executor {
+  private:
+    std::deque<std::coroutine_handle<>> ready;
+    std::vector<task<void>> tasks;
+
+    bool finished(void) const {
+      for (auto &t : tasks) if (!t.handle.done()) return false;
+      return true;
+    }
+
+  public:
+    void schedule(std::coroutine_handle<> h) { ready.push_back(h); }
+
+    void spawn(task<void> t) {
+      ready.push_back(t.handle);
+      tasks.push_back(std::move(t));
+    }
+
+    // Drives the spawned tasks until all of them are done, sleeping in libusb's
+    // poll between completions. The first exception escaping a task is rethrown.
+    void run(int poll_ms=100) {
+      while (true) {
+	while (!ready.empty()) {
+	  std::coroutine_handle<> h = ready.front();
+	  ready.pop_front();
+	  h.resume();
+	}
+	if (finished()) break;
+	handleEvents(poll_ms);
+      }
+
+      std::vector<task<void>> done;
+      done.swap(tasks);
+      for (auto &t : done)
+	if (t.handle.promise().exception) std::rethrow_exception(t.handle.promise().exception);
+    }
+  };
+
+  class awaitableUsb4k {
+  private:
+    executor &exec;
+    usb4k &spec;
+
+    // Suspends until the submitted callback fires, then resumes on the executor.
+    template <typename Result, typename Submit>
+    class callbackAwaiter {
+    public:
+      callbackAwaiter(executor &ex, Submit s) : exec(ex), submit(std::move(s)) {}
+
+      bool await_ready(void) const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) {
+	submit([this, h](int s, Result r) {
+	    status = s;
+	    result = std::move(r);
+	    exec.schedule(h);
+	  });
+      }
+      Result await_resume(void) {
+	if (status != LIBUSB_TRANSFER_COMPLETED)
+	  throw std::runtime_error("Asynchronous transfer to the spectrometer is failed!");
+	return std::move(result);
+      }
+
+    private:
+      executor &exec;
+      Submit submit;
+      int status = LIBUSB_TRANSFER_ERROR;
+      Result result{};
+    };
+
+    template <typename Result, typename Submit>
+    callbackAwaiter<Result, Submit> await(Submit s) { return callbackAwaiter<Result, Submit>(exec, std::move(s)); }
+
+  public:
+    awaitableUsb4k(executor &ex, usb4k &s) : exec(ex), spec(s) {}
+
+    usb4k& device(void) { return spec; }
+
+    // The returned reference stays valid until the next acquire()
+    auto acquire(bool request=true) {
+      struct awaiter {
+	executor &exec;
+	usb4k &spec;
+	bool request;
+	int status = LIBUSB_TRANSFER_ERROR;
+	std::array<uint16_t, usb4kPixelCount> *spectrum = nullptr;
+
+	bool await_ready(void) const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> h) {
+	  spec.submitSpectrum([this, h](int s, std::array<uint16_t, usb4kPixelCount> &raw) {
+	      status = s;
+	      spectrum = &raw;
+	      exec.schedule(h);
+	    }, request);
+	}
+	std::array<uint16_t, usb4kPixelCount>& await_resume(void) {
+	  if (status != LIBUSB_TRANSFER_COMPLETED)
+	    throw std::runtime_error("Failed to acquire the spectrum asynchronously!");
+	  return *spectrum;
+	}
+      };
+      return awaiter{exec, spec, request};
+    }
+
+    auto setIntegration(int usec) {
+      return await<int>([this, usec](std::function<void(int, int)> done) {
+	  spec.submitIntegration(usec, [done, usec](int status, const uint8_t *, int) { done(status, usec); });
+	});
+    }
+
+    auto readPCBTemperature(void) {
+      return await<float>([this](std::function<void(int, float)> done) {
+	  spec.submitPCBTemperature(done);
+	});
+    }
+
+    auto setTriggerMode(int mode) {
+      return await<int>([this, mode](std::function<void(int, int)> done) {
+	  uint8_t cmd[3] = { 0x0a, uint8_t(mode & 0xff), uint8_t((mode >> 8) & 0xff) };
+	  spec.submitCommand(cmd, 3, 0, [done, mode](int status, const uint8_t *, int) { done(status, mode); });
+	});
+    }
+
+    auto setStrobeEnableStatus(bool enable) {
+      return await<int>([this, enable](std::function<void(int, int)> done) {
+	  uint8_t cmd[3] = { 0x03, uint8_t(enable ? 1 : 0), 0x00 };
+	  spec.submitCommand(cmd, 3, 0, [done](int status, const uint8_t *, int) { done(status, 0); });
+	});
+    }
+  };
+}
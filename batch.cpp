@@ -0,0 +1,123 @@
+#include <omp.h>
+#include <cmath>
+#include <iomanip>
+
+#include "batch.hpp"
+#include "kernels.hpp"
+
+namespace spectrometer {
+
+  batchProcessor::batchProcessor(const archiveReader &a, const batchConfig &c)
+    : archive(a), config(c)
+  {
+    if (config.average < 1 || config.chunkFrames < 1)
+      throw std::invalid_argument("Averaging and chunk size must be positive!");
+    std::memcpy(linearityCoeffs, archive.getHeader().linearityCoeffs, sizeof(linearityCoeffs));
+
+    if (config.resample) {
+      if (config.resampleStep <= 0 || config.resampleTo <= config.resampleFrom)
+	throw std::invalid_argument("Resampling range is empty!");
+
+      std::array<float, usb4kPixelCount> wavelengths;
+      archive.getWavelengths(wavelengths);
+
+      // extrapolating would make up data, so the grid has to stay within the calibration
+      if (config.resampleFrom < wavelengths[usb4kActivePixelBegin] ||
+	  config.resampleTo > wavelengths[usb4kActivePixelEnd - 1])
+	throw std::out_of_range("Resampling range beyond the calibrated wavelengths!");
+
+      // from + k*step, counted once rather than stepped, so the error does not add up over the
+      // grid; a to that is a whole number of steps away stays in despite the rounding of the step
+      const double step = config.resampleStep;
+      const int count = int(std::floor((double(config.resampleTo) - config.resampleFrom) / step + 1e-3)) + 1;
+
+      // linear interpolation between the active pixels bracketing every output wavelength
+      int i = usb4kActivePixelBegin;
+      for (int k = 0; k < count; ++k) {
+	const double nm = std::min(config.resampleFrom + k * step, double(config.resampleTo));
+	while (i < usb4kActivePixelEnd - 2 && wavelengths[i+1] < nm) ++i;
+	resampleIndices.push_back(i);
+	resampleWeights.push_back((nm - wavelengths[i]) / (wavelengths[i+1] - wavelengths[i]));
+      }
+    }
+  }
+
+  void batchProcessor::processFrame(const archivedFrame &frame, float *scratch, float *row) const
+  {
+    if (config.linearity) {
+      // only here: without linearity offsetCorrect() sums the edark pixels itself
+      const float edarkness = config.edark ?
+	kernels::scalar::offsetLevel(frame.raw, usb4kEdarkIndices.front(), usb4kEdarkIndices.size()) : 0.0f;
+      const float *c = linearityCoeffs;
+      for (int i = 0; i < usb4kPixelCount; ++i) {
+	float x = frame.raw[i] - edarkness;
+	float p = c[7];
+	for (int k = 6; k >= 0; --k) p = p*x + c[k];
+	scratch[i] = p != 0 ? x / p : x;
+      }
+    } else {
+      kernels::offsetCorrect(frame.raw, usb4kEdarkIndices.front(), config.edark ? usb4kEdarkIndices.size() : 0,
+			     scratch, usb4kPixelCount);
+    }
+
+    if (config.resample) {
+      int n = resampleIndices.size();
+      for (int k = 0; k < n; ++k) {
+	int i = resampleIndices[k];
+	row[k] += scratch[i] + resampleWeights[k]*(scratch[i+1] - scratch[i]);
+      }
+    } else {
+      kernels::accumulate(scratch, row, usb4kPixelCount);
+    }
+  }
+
+  double batchProcessor::run(std::vector<float> &out, int threads) const
+  {
+    const long rows = rowCount();
+    const int width = rowWidth();
+    const int average = config.average;
+    const long rowsPerChunk = std::max(1, config.chunkFrames / average);
+    const long chunks = (rows + rowsPerChunk - 1) / rowsPerChunk;
+    out.assign(rows * width, 0.0f);
+
+    auto start = std::chrono::steady_clock::now();
+#pragma omp parallel num_threads(threads > 0 ? threads : omp_get_max_threads())
+    {
+      std::vector<float> scratch(usb4kPixelCount);
+
+#pragma omp for schedule(dynamic, 1)
+      for (long chunk = 0; chunk < chunks; ++chunk) {
+	long last = std::min(rows, (chunk + 1) * rowsPerChunk);
+	for (long r = chunk * rowsPerChunk; r < last; ++r) {
+	  float *row = out.data() + r * width;
+	  for (int k = 0; k < average; ++k)
+	    processFrame(archive[r * average + k], scratch.data(), row);
+	  if (average > 1)
+	    for (int i = 0; i < width; ++i) row[i] /= average;
+	}
+      }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return elapsed.count();
+  }
+
+  void batchProcessor::reportScaling(int max_threads, std::ostream &os) const
+  {
+    std::vector<float> out;
+    run(out, 1); // page the archive in, so the first timing is not the disk's
+
+    double single = 0;
+    os << "threads  seconds  frames/s  speedup  efficiency\n";
+    for (int t = 1; t <= max_threads; ++t) {
+      double seconds = run(out, t);
+      if (t == 1) single = seconds;
+      double speedup = single / seconds;
+      os << std::setw(7) << t << std::setw(9) << std::setprecision(4) << seconds
+	 << std::setw(10) << std::setprecision(6) << (rowCount() * config.average / seconds)
+	 << std::setw(9) << std::setprecision(3) << speedup
+	 << std::setw(12) << std::setprecision(3) << speedup / t << "\n";
+    }
+  }
+
+}
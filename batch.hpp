@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+
+#include "archive.hpp"
+
+namespace spectrometer {
+  struct batchConfig {
+    bool edark = true;
+    bool linearity = true;
+    bool resample = false;
+    float resampleFrom = 0, resampleTo = 0, resampleStep = 1; // [nm], within the calibration
+    int average = 1;        // frames averaged into one output row
+    int chunkFrames = 32;   // input frames a thread handles in a row (~250 KB of raw data)
+  };
+
+  /*
+    Reprocesses a frame archive with the preprocessing chain
+      electric dark subtraction -> non-linearity correction -> resampling -> averaging
+    using the calibration stored in the archive header. Output rows are
+    independent, so chunks of them are spread over the OpenMP threads.
+  */
+  class batchProcessor {
+  private:
+    const archiveReader &archive;
+    batchConfig config;
+    float linearityCoeffs[8];
+    std::vector<int> resampleIndices;
+    std::vector<float> resampleWeights;
+
+    void processFrame(const archivedFrame &frame, float *scratch, float *row) const;
+
+  public:
+    batchProcessor(const archiveReader &a, const batchConfig &c);
+
+    int rowWidth(void) const { return config.resample ? int(resampleIndices.size()) : usb4kPixelCount; }
+    size_t rowCount(void) const { return archive.size() / config.average; }
+
+    // threads <= 0 leaves the OpenMP default; returns the elapsed seconds
+    double run(std::vector<float> &out, int threads=0) const;
+
+    // Times run() from 1 to max_threads threads and prints speedup and efficiency
+    void reportScaling(int max_threads, std::ostream &os=std::cout) const;
+  };
+}
@@ -0,0 +1,83 @@
+#include "codec.hpp"
+
+namespace spectrometer {
+
+  static const char compressedArchiveMagic[8] = { 'U', '4', 'K', 'A', 'R', 'C', 'Z', '1' };
+
+  compressedArchiveWriter::compressedArchiveWriter(const std::string &path, const float *wavelength_coeffs,
+						   const float *linearity_coeffs, const std::string &serial,
+						   int keyframe_interval)
+    : encoder(usb4kPixelCount, keyframe_interval), buffer(codec::maxEncodedSize(usb4kPixelCount))
+  {
+    file = std::fopen(path.c_str(), "wb");
+    if (!file)
+      throw std::runtime_error("Failed to create the compressed archive!");
+
+    archiveHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, compressedArchiveMagic, sizeof(compressedArchiveMagic));
+    header.pixelCount = usb4kPixelCount;
+    header.frameSize = 0; // variable
+    std::memcpy(header.wavelengthCoeffs, wavelength_coeffs, sizeof(header.wavelengthCoeffs));
+    std::memcpy(header.linearityCoeffs, linearity_coeffs, sizeof(header.linearityCoeffs));
+    std::strncpy(header.serialNumber, serial.c_str(), sizeof(header.serialNumber) - 1);
+
+    if (std::fwrite(&header, sizeof(header), 1, file) != 1) {
+      std::fclose(file);
+      throw std::runtime_error("Failed to write the archive header!");
+    }
+  }
+
+  compressedArchiveWriter::~compressedArchiveWriter(void)
+  {
+    if (file) std::fclose(file);
+  }
+
+  size_t compressedArchiveWriter::append(const frameMetadata &meta, const uint16_t *raw)
+  {
+    uint32_t size = encoder.encode(raw, buffer.data());
+    if (std::fwrite(&meta, sizeof(meta), 1, file) != 1 || std::fwrite(&size, sizeof(size), 1, file) != 1 ||
+	std::fwrite(buffer.data(), size, 1, file) != 1)
+      throw std::runtime_error("Failed to append the frame to the compressed archive!");
+    return size;
+  }
+
+  void compressedArchiveWriter::flush(void)
+  {
+    if (std::fflush(file) != 0)
+      throw std::runtime_error("Failed to flush the compressed archive!");
+  }
+
+  compressedArchiveReader::compressedArchiveReader(const std::string &path)
+    : buffer(codec::maxEncodedSize(usb4kPixelCount))
+  {
+    file = std::fopen(path.c_str(), "rb");
+    if (!file)
+      throw std::runtime_error("Failed to open the compressed archive!");
+
+    if (std::fread(&header, sizeof(header), 1, file) != 1 ||
+	std::memcmp(header.magic, compressedArchiveMagic, sizeof(compressedArchiveMagic)) != 0 ||
+	header.pixelCount != usb4kPixelCount) {
+      std::fclose(file);
+      throw std::runtime_error("Not a compressed archive of this build!");
+    }
+  }
+
+  compressedArchiveReader::~compressedArchiveReader(void)
+  {
+    if (file) std::fclose(file);
+  }
+
+  bool compressedArchiveReader::next(archivedFrame &frame)
+  {
+    uint32_t size;
+    if (std::fread(&frame.meta, sizeof(frame.meta), 1, file) != 1) return false;
+    if (std::fread(&size, sizeof(size), 1, file) != 1 || size > buffer.size() ||
+	std::fread(buffer.data(), size, 1, file) != 1)
+      throw std::runtime_error("Compressed archive is truncated!");
+
+    decoder.decode(buffer.data(), size, frame.raw);
+    return true;
+  }
+
+}
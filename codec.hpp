@@ -0,0 +1,431 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "kernels.hpp"
+#include "archive.hpp"
+
+/*
+  Lossless codec for 16-bit spectra.
+
+  A frame is cut into blocks of 256 pixels. Every block is predicted either
+  from its left neighbour (pixel delta) or from the same pixel of the
+  previous frame (frame delta), whichever needs fewer bits, the residuals are
+  zigzag encoded in 16-bit wrap-around arithmetic and bit-packed at the
+  block's width. The packing is vertical over 8 lanes (lane j holds pixels
+  j, j+8, ...), so a row of the block is 8 neighbouring pixels: one AVX2
+  register or two SSE4.1 ones, and the decoder undoes the pixel delta with
+  an in-register prefix sum per row.
+
+  Encoded frame:
+    uint8_t flags           bit0: keyframe (no frame delta)
+    uint8_t blocks[n]       bit7: frame delta, bits0-4: width (0..16)
+    uint32_t packed[...]    8*width words per block
+*/
+namespace spectrometer {
+  namespace codec {
+    constexpr int blockSize = 256;
+    constexpr int lanes = 8;
+    constexpr int rows = blockSize / lanes;
+    constexpr uint8_t keyframeFlag = 0x01;
+    constexpr uint8_t frameDeltaFlag = 0x80;
+
+    inline int blockCount(int pixels) { return (pixels + blockSize - 1) / blockSize; }
+    inline size_t maxEncodedSize(int pixels) { return 1 + blockCount(pixels) * (1 + 16*lanes*sizeof(uint32_t)); }
+
+    inline int bitWidth(uint32_t bits) { return bits ? 32 - __builtin_clz(bits) : 0; }
+
+    inline uint32_t zigzag(uint16_t x, uint16_t pred) {
+      int32_t d = int16_t(uint16_t(x - pred));
+      return uint16_t((d << 1) ^ (d >> 31));
+    }
+    inline uint16_t unzigzag(uint32_t z) { return uint16_t((z >> 1) ^ -(z & 1)); }
+
+    /*
+      The kernels take the block's pixels x and its prediction pred directly:
+      residualBits() is the OR of all zigzagged residuals (whose bit width is
+      the block's), pack() zigzags them on the fly, and unpack() reconstructs
+      the pixels p in place, adding the residuals to the previous frame (frame
+      delta) or summing them from left, the pixel before the block (pixel
+      delta). The SIMD variants keep the residuals in registers throughout.
+    */
+    namespace scalar {
+      inline uint32_t residualBits(const uint16_t *x, const uint16_t *pred) {
+	uint32_t all = 0;
+	for (int i = 0; i < blockSize; ++i) all |= zigzag(x[i], pred[i]);
+	return all;
+      }
+
+      inline void pack(const uint16_t *x, const uint16_t *pred, int b, uint32_t *out) {
+	uint32_t z[blockSize];
+	for (int i = 0; i < blockSize; ++i) z[i] = zigzag(x[i], pred[i]);
+	for (int j = 0; j < lanes; ++j) {
+	  uint32_t acc = 0;
+	  int bits = 0, m = 0;
+	  for (int k = 0; k < rows; ++k) {
+	    uint32_t v = z[k*lanes + j];
+	    acc |= v << bits;
+	    bits += b;
+	    if (bits >= 32) {
+	      out[m++*lanes + j] = acc;
+	      bits -= 32;
+	      acc = bits ? v >> (b - bits) : 0;
+	    }
+	  }
+	}
+      }
+
+      inline void unpack(const uint32_t *in, int b, bool frameDelta, uint16_t left, uint16_t *p) {
+	const uint32_t mask = (1u << b) - 1;
+	uint32_t z[blockSize];
+	for (int j = 0; j < lanes; ++j) {
+	  int bits = 0, m = 0;
+	  uint32_t w = in[j];
+	  for (int k = 0; k < rows; ++k) {
+	    uint32_t v = w >> bits;
+	    bits += b;
+	    if (bits >= 32) {
+	      bits -= 32;
+	      w = ++m < b ? in[m*lanes + j] : 0;
+	      if (bits) v |= w << (b - bits);
+	    }
+	    z[k*lanes + j] = v & mask;
+	  }
+	}
+	if (frameDelta) {
+	  for (int i = 0; i < blockSize; ++i) p[i] = uint16_t(p[i] + unzigzag(z[i]));
+	} else {
+	  for (int i = 0; i < blockSize; ++i) left = p[i] = uint16_t(left + unzigzag(z[i]));
+	}
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    // A row of 8 lanes is two registers here; the residuals are formed and applied in 16 bits
+    namespace sse {
+      SPECTROMETER_SSE
+      inline __m128i zigzag(const uint16_t *x, const uint16_t *pred) {
+	__m128i d = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(x)),
+				  _mm_loadu_si128(reinterpret_cast<const __m128i *>(pred)));
+	return _mm_xor_si128(_mm_slli_epi16(d, 1), _mm_srai_epi16(d, 15));
+      }
+
+      // Undoes the zigzag of 8 residuals and applies them to p; carry holds the last pixel in every lane
+      SPECTROMETER_SSE
+      inline void reconstruct(__m128i z, bool frameDelta, __m128i &carry, uint16_t *p) {
+	__m128i d = _mm_xor_si128(_mm_srli_epi16(z, 1), _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(z, _mm_set1_epi16(1))));
+	if (frameDelta) {
+	  d = _mm_add_epi16(d, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+	} else {
+	  d = _mm_add_epi16(d, _mm_slli_si128(d, 2));
+	  d = _mm_add_epi16(d, _mm_slli_si128(d, 4));
+	  d = _mm_add_epi16(d, _mm_slli_si128(d, 8));
+	  d = _mm_add_epi16(d, carry);
+	  carry = _mm_shuffle_epi8(d, _mm_set1_epi16(0x0f0e));
+	}
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(p), d);
+      }
+
+      SPECTROMETER_SSE
+      inline uint32_t residualBits(const uint16_t *x, const uint16_t *pred) {
+	__m128i all = _mm_setzero_si128();
+	for (int i = 0; i < blockSize; i += 8) all = _mm_or_si128(all, zigzag(x + i, pred + i));
+	all = _mm_or_si128(all, _mm_shuffle_epi32(all, 0x4e));
+	all = _mm_or_si128(all, _mm_shuffle_epi32(all, 0xb1));
+	uint32_t r = _mm_cvtsi128_si32(all);
+	return (r | r >> 16) & 0xffff;
+      }
+
+      SPECTROMETER_SSE
+      inline void pack(const uint16_t *x, const uint16_t *pred, int b, uint32_t *out) {
+	__m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+	int bits = 0, m = 0;
+	for (int k = 0; k < rows; ++k) {
+	  __m128i z = zigzag(x + k*lanes, pred + k*lanes);
+	  __m128i zl = _mm_cvtepu16_epi32(z), zh = _mm_cvtepu16_epi32(_mm_srli_si128(z, 8));
+	  __m128i s = _mm_cvtsi32_si128(bits);
+	  lo = _mm_or_si128(lo, _mm_sll_epi32(zl, s));
+	  hi = _mm_or_si128(hi, _mm_sll_epi32(zh, s));
+	  bits += b;
+	  if (bits >= 32) {
+	    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + m*lanes), lo);
+	    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + m*lanes + 4), hi);
+	    ++m;
+	    bits -= 32;
+	    s = _mm_cvtsi32_si128(b - bits);
+	    lo = bits ? _mm_srl_epi32(zl, s) : _mm_setzero_si128();
+	    hi = bits ? _mm_srl_epi32(zh, s) : _mm_setzero_si128();
+	  }
+	}
+      }
+
+      SPECTROMETER_SSE
+      inline void unpack(const uint32_t *in, int b, bool frameDelta, uint16_t left, uint16_t *p) {
+	const __m128i mask = _mm_set1_epi32((1u << b) - 1);
+	__m128i carry = _mm_set1_epi16(left);
+	int bits = 0, m = 0;
+	__m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+	__m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 4));
+	for (int k = 0; k < rows; ++k) {
+	  __m128i s = _mm_cvtsi32_si128(bits);
+	  __m128i vl = _mm_srl_epi32(lo, s), vh = _mm_srl_epi32(hi, s);
+	  bits += b;
+	  if (bits >= 32) {
+	    bits -= 32;
+	    if (++m < b) {
+	      lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + m*lanes));
+	      hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + m*lanes + 4));
+	    } else {
+	      lo = hi = _mm_setzero_si128();
+	    }
+	    if (bits) {
+	      s = _mm_cvtsi32_si128(b - bits);
+	      vl = _mm_or_si128(vl, _mm_sll_epi32(lo, s));
+	      vh = _mm_or_si128(vh, _mm_sll_epi32(hi, s));
+	    }
+	  }
+	  reconstruct(_mm_packus_epi32(_mm_and_si128(vl, mask), _mm_and_si128(vh, mask)), frameDelta, carry, p + k*lanes);
+	}
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2
+      inline uint32_t residualBits(const uint16_t *x, const uint16_t *pred) {
+	__m256i all = _mm256_setzero_si256();
+	for (int i = 0; i < blockSize; i += 16) {
+	  __m256i d = _mm256_sub_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i)),
+				       _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pred + i)));
+	  all = _mm256_or_si256(all, _mm256_xor_si256(_mm256_slli_epi16(d, 1), _mm256_srai_epi16(d, 15)));
+	}
+	__m128i r = _mm_or_si128(_mm256_castsi256_si128(all), _mm256_extracti128_si256(all, 1));
+	r = _mm_or_si128(r, _mm_shuffle_epi32(r, 0x4e));
+	r = _mm_or_si128(r, _mm_shuffle_epi32(r, 0xb1));
+	uint32_t bits = _mm_cvtsi128_si32(r);
+	return (bits | bits >> 16) & 0xffff;
+      }
+
+      SPECTROMETER_AVX2
+      inline void pack(const uint16_t *x, const uint16_t *pred, int b, uint32_t *out) {
+	__m256i acc = _mm256_setzero_si256();
+	int bits = 0, m = 0;
+	for (int k = 0; k < rows; ++k) {
+	  __m256i v = _mm256_cvtepu16_epi32(sse::zigzag(x + k*lanes, pred + k*lanes));
+	  acc = _mm256_or_si256(acc, _mm256_sll_epi32(v, _mm_cvtsi32_si128(bits)));
+	  bits += b;
+	  if (bits >= 32) {
+	    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + m++*lanes), acc);
+	    bits -= 32;
+	    acc = bits ? _mm256_srl_epi32(v, _mm_cvtsi32_si128(b - bits)) : _mm256_setzero_si256();
+	  }
+	}
+      }
+
+      SPECTROMETER_AVX2
+      inline void unpack(const uint32_t *in, int b, bool frameDelta, uint16_t left, uint16_t *p) {
+	const __m256i mask = _mm256_set1_epi32((1u << b) - 1);
+	__m128i carry = _mm_set1_epi16(left);
+	int bits = 0, m = 0;
+	__m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in));
+	for (int k = 0; k < rows; ++k) {
+	  __m256i v = _mm256_srl_epi32(w, _mm_cvtsi32_si128(bits));
+	  bits += b;
+	  if (bits >= 32) {
+	    bits -= 32;
+	    w = ++m < b ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + m*lanes)) : _mm256_setzero_si256();
+	    if (bits) v = _mm256_or_si256(v, _mm256_sll_epi32(w, _mm_cvtsi32_si128(b - bits)));
+	  }
+	  v = _mm256_and_si256(v, mask);
+	  sse::reconstruct(_mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)),
+			   frameDelta, carry, p + k*lanes);
+	}
+      }
+    }
+#endif
+
+    inline uint32_t residualBits(const uint16_t *x, const uint16_t *pred) {
+#ifdef SPECTROMETER_X86
+      switch (kernels::activeISA()) {
+      case kernels::AVX2: return avx2::residualBits(x, pred);
+      case kernels::SSE: return sse::residualBits(x, pred);
+      default: break;
+      }
+#endif
+      return scalar::residualBits(x, pred);
+    }
+
+    inline void pack(const uint16_t *x, const uint16_t *pred, int b, uint32_t *out) {
+      if (b == 0) return;
+#ifdef SPECTROMETER_X86
+      switch (kernels::activeISA()) {
+      case kernels::AVX2: return avx2::pack(x, pred, b, out);
+      case kernels::SSE: return sse::pack(x, pred, b, out);
+      default: break;
+      }
+#endif
+      scalar::pack(x, pred, b, out);
+    }
+
+    inline void unpack(const uint32_t *in, int b, bool frameDelta, uint16_t left, uint16_t *p) {
+      if (b == 0) {
+	if (!frameDelta) std::fill(p, p + blockSize, left);
+	return;
+      }
+#ifdef SPECTROMETER_X86
+      switch (kernels::activeISA()) {
+      case kernels::AVX2: return avx2::unpack(in, b, frameDelta, left, p);
+      case kernels::SSE: return sse::unpack(in, b, frameDelta, left, p);
+      default: break;
+      }
+#endif
+      scalar::unpack(in, b, frameDelta, left, p);
+    }
+  }
+
+  class spectrumEncoder {
+  private:
+    int pixels;
+    int keyframeInterval;
+    int sinceKeyframe = -1;
+    std::vector<uint16_t> previous; // padded to whole blocks
+
+  public:
+    // keyframe_interval: frames between keyframes, so a decoder can join or recover
+    spectrumEncoder(int pixel_count=usb4kPixelCount, int keyframe_interval=64)
+      : pixels(pixel_count), keyframeInterval(keyframe_interval),
+	previous(codec::blockCount(pixel_count) * codec::blockSize) {}
+
+    void reset(void) { sinceKeyframe = -1; }
+
+    // out must hold codec::maxEncodedSize(pixels) bytes; returns the encoded size
+    size_t encode(const uint16_t *raw, uint8_t *out) {
+      const int blocks = codec::blockCount(pixels);
+      bool keyframe = sinceKeyframe < 0 || sinceKeyframe + 1 >= keyframeInterval;
+      sinceKeyframe = keyframe ? 0 : sinceKeyframe + 1;
+
+      out[0] = keyframe ? codec::keyframeFlag : 0;
+      uint8_t *descriptors = out + 1;
+      uint32_t *packed = reinterpret_cast<uint32_t *>(out + 1 + blocks);
+      size_t words = 0;
+
+      alignas(32) uint16_t padded[codec::blockSize + 8];
+
+      for (int blk = 0; blk < blocks; ++blk) {
+	int begin = blk * codec::blockSize, count = std::min(codec::blockSize, pixels - begin);
+	// x[-1] is the left neighbour, 0 before the first block; whole blocks are read in place,
+	// the first and the last through a copy (the last padded with its last pixel)
+	const uint16_t *x = raw + begin;
+	if (begin == 0 || count < codec::blockSize) {
+	  padded[0] = begin ? raw[begin - 1] : 0;
+	  std::copy(raw + begin, raw + begin + count, padded + 1);
+	  std::fill(padded + 1 + count, padded + 1 + codec::blockSize, padded[count]);
+	  x = padded + 1;
+	}
+
+	int width = codec::bitWidth(codec::residualBits(x, x - 1));
+	const uint16_t *pred = x - 1;
+	uint8_t mode = 0;
+	if (!keyframe) {
+	  int frameWidth = codec::bitWidth(codec::residualBits(x, previous.data() + begin));
+	  if (frameWidth < width) { width = frameWidth; pred = previous.data() + begin; mode = codec::frameDeltaFlag; }
+	}
+
+	descriptors[blk] = mode | width;
+	// the packed words may be unaligned after the descriptors
+	alignas(32) uint32_t block[16 * codec::lanes];
+	codec::pack(x, pred, width, block);
+	std::memcpy(packed + words, block, width * codec::lanes * sizeof(uint32_t));
+	words += width * codec::lanes;
+
+	std::copy(x, x + codec::blockSize, previous.begin() + begin);
+      }
+
+      return 1 + blocks + words * sizeof(uint32_t);
+    }
+  };
+
+  class spectrumDecoder {
+  private:
+    int pixels;
+    bool synchronized = false;
+    std::vector<uint16_t> previous;
+
+  public:
+    spectrumDecoder(int pixel_count=usb4kPixelCount)
+      : pixels(pixel_count), previous(codec::blockCount(pixel_count) * codec::blockSize) {}
+
+    void reset(void) { synchronized = false; }
+
+    // Returns the bytes consumed; throws on a corrupt frame or a delta frame before any keyframe
+    size_t decode(const uint8_t *in, size_t len, uint16_t *raw) {
+      const int blocks = codec::blockCount(pixels);
+      if (len < size_t(1 + blocks))
+	throw std::runtime_error("Encoded spectrum is truncated!");
+      if (in[0] & codec::keyframeFlag) synchronized = true;
+      if (!synchronized)
+	throw std::runtime_error("Encoded spectrum depends on a frame not decoded!");
+
+      const uint8_t *descriptors = in + 1;
+      const uint8_t *packed = in + 1 + blocks;
+      size_t offset = 0;
+      uint16_t left = 0;
+
+      alignas(32) uint32_t block[16 * codec::lanes];
+      for (int blk = 0; blk < blocks; ++blk) {
+	int width = descriptors[blk] & 0x1f;
+	size_t bytes = width * codec::lanes * sizeof(uint32_t);
+	if (width > 16 || 1 + blocks + offset + bytes > len)
+	  throw std::runtime_error("Encoded spectrum is corrupted!");
+
+	std::memcpy(block, packed + offset, bytes);
+	offset += bytes;
+	uint16_t *p = previous.data() + blk * codec::blockSize;
+	codec::unpack(block, width, descriptors[blk] & codec::frameDeltaFlag, left, p);
+	left = p[codec::blockSize - 1];
+      }
+
+      std::copy(previous.begin(), previous.begin() + pixels, raw);
+      return 1 + blocks + offset;
+    }
+  };
+
+  /*
+    Compressed counterpart of archiveWriter: the same header (magic U4KARCZ1)
+    followed by records of frameMetadata, uint32_t size and the encoded frame.
+    Records vary in size, so the reader walks them in order.
+  */
+  class compressedArchiveWriter {
+  private:
+    FILE *file = NULL;
+    spectrumEncoder encoder;
+    std::vector<uint8_t> buffer;
+
+  public:
+    compressedArchiveWriter(const std::string &path, const float *wavelength_coeffs, const float *linearity_coeffs,
+			    const std::string &serial="", int keyframe_interval=64);
+    compressedArchiveWriter(const std::string &path, const frameSource &spec, int keyframe_interval=64)
+      : compressedArchiveWriter(path, spec.getWavelengthCoeffs(), spec.getLinearityCoeffs(),
+				spec.getSerialNumber(), keyframe_interval) {}
+    virtual ~compressedArchiveWriter(void);
+
+    // Returns the encoded size of the frame
+    size_t append(const frameMetadata &meta, const uint16_t *raw);
+    void flush(void);
+  };
+
+  class compressedArchiveReader {
+  private:
+    FILE *file = NULL;
+    archiveHeader header;
+    spectrumDecoder decoder;
+    std::vector<uint8_t> buffer;
+
+  public:
+    compressedArchiveReader(const std::string &path);
+    virtual ~compressedArchiveReader(void);
+
+    const archiveHeader& getHeader(void) const { return header; }
+    bool next(archivedFrame &frame);
+  };
+}
@@ -0,0 +1,70 @@
+#include <fstream>
+
+#include "darklibrary.hpp"
+
+namespace spectrometer {
+
+  static const char darkLibraryMagic[8] = { 'U', '4', 'K', 'D', 'A', 'R', 'K', '1' };
+
+  void darkLibrary::save(const std::string &path) const
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+      throw std::runtime_error("Failed to open the dark library for writing!");
+
+    int32_t pixels = usb4kPixelCount;
+    uint32_t count = size();
+    out.write(darkLibraryMagic, sizeof(darkLibraryMagic));
+    out.write(reinterpret_cast<const char *>(&pixels), sizeof(pixels));
+    out.write(reinterpret_cast<const char *>(&temperatureStep), sizeof(temperatureStep));
+    out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+
+    for (auto &row : entries) {
+      for (auto &col : row.second) {
+	int32_t usec = row.first, bin = col.first;
+	out.write(reinterpret_cast<const char *>(&usec), sizeof(usec));
+	out.write(reinterpret_cast<const char *>(&bin), sizeof(bin));
+	out.write(reinterpret_cast<const char *>(&col.second.count), sizeof(col.second.count));
+	out.write(reinterpret_cast<const char *>(col.second.mean.data()), sizeof(frame));
+      }
+    }
+
+    if (!out)
+      throw std::runtime_error("Failed to write the dark library!");
+  }
+
+  void darkLibrary::load(const std::string &path)
+  {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      throw std::runtime_error("Failed to open the dark library for reading!");
+
+    char magic[8];
+    int32_t pixels;
+    float step;
+    uint32_t count;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char *>(&pixels), sizeof(pixels));
+    in.read(reinterpret_cast<char *>(&step), sizeof(step));
+    in.read(reinterpret_cast<char *>(&count), sizeof(count));
+    if (!in || std::memcmp(magic, darkLibraryMagic, sizeof(magic)) != 0 || pixels != usb4kPixelCount || step <= 0)
+      throw std::runtime_error("Not a dark library of this spectrometer!");
+
+    std::map<int, std::map<int, entry>> loaded;
+    for (uint32_t i = 0; i < count; ++i) {
+      int32_t usec, bin;
+      in.read(reinterpret_cast<char *>(&usec), sizeof(usec));
+      in.read(reinterpret_cast<char *>(&bin), sizeof(bin));
+      entry &e = loaded[usec][bin];
+      in.read(reinterpret_cast<char *>(&e.count), sizeof(e.count));
+      in.read(reinterpret_cast<char *>(e.mean.data()), sizeof(frame));
+    }
+    if (!in)
+      throw std::runtime_error("Dark library is truncated!");
+
+    temperatureStep = step;
+    entries.swap(loaded);
+    cacheValid = false;
+  }
+
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <map>
+#include <cmath>
+
+#include "spectrometer.hpp"
+
+namespace spectrometer {
+  /*
+    Averaged dark frames indexed by integration time and PCB temperature.
+    Frames in between the recorded entries are linearly interpolated, first
+    over temperature within each integration time and then over integration
+    time; outside of the recorded range the nearest entry is used. The last
+    interpolated frame is cached: asking again for the same integration
+    time and temperature bin returns it at once, anything else (or any
+    frame added meanwhile) costs the map lookups and up to three passes
+    over the pixels.
+  */
+  class darkLibrary {
+  public:
+    typedef std::array<float, usb4kPixelCount> frame;
+
+  private:
+    struct entry {
+      uint32_t count = 0;
+      frame mean;
+    };
+
+    float temperatureStep;
+    std::map<int, std::map<int, entry>> entries; // [usec][temperature bin]
+
+    bool cacheValid = false;
+    int cachedIntegration = 0;
+    int cachedBin = 0;
+    frame cached;
+
+    int temperatureBin(float celsius) const { return int(std::lround(celsius / temperatureStep)); }
+
+    // Interpolates over the temperature bins recorded for one integration time
+    void interpolateTemperature(const std::map<int, entry> &row, int bin, frame &out) const {
+      auto hi = row.lower_bound(bin);
+      if (hi == row.end()) { out = std::prev(hi)->second.mean; return; }
+      if (hi->first == bin || hi == row.begin()) { out = hi->second.mean; return; }
+
+      auto lo = std::prev(hi);
+      float w = float(bin - lo->first) / float(hi->first - lo->first);
+      const frame &a = lo->second.mean, &b = hi->second.mean;
+      for (int i = 0; i < usb4kPixelCount; ++i) out[i] = a[i] + w*(b[i] - a[i]);
+    }
+
+  public:
+    darkLibrary(float temperature_step=0.5) : temperatureStep(temperature_step) {
+      if (temperature_step <= 0)
+	throw std::invalid_argument("Temperature step of the dark library must be positive!");
+    }
+
+    void addFrame(int usec, float celsius, const std::array<uint16_t, usb4kPixelCount> &raw) {
+      entry &e = entries[usec][temperatureBin(celsius)];
+      float inv = 1.0f / float(++e.count);
+      if (e.count == 1) std::copy(std::begin(raw), std::end(raw), std::begin(e.mean));
+      else for (int i = 0; i < usb4kPixelCount; ++i) e.mean[i] += (raw[i] - e.mean[i]) * inv;
+      cacheValid = false;
+    }
+
+    // The shutter has to be closed by the caller
+    void capture(usb4k &spec, int frames) {
+      int usec = spec.getIntegrationTime();
+      float celsius = spec.readPCBTemperature();
+      for (int i = 0; i < frames; ++i) addFrame(usec, celsius, spec.getRawSpectrum());
+    }
+
+    const frame& darkFrame(int usec, float celsius) {
+      if (entries.empty())
+	throw std::runtime_error("Dark library is empty!");
+
+      int bin = temperatureBin(celsius);
+      if (cacheValid && usec == cachedIntegration && bin == cachedBin) return cached;
+
+      auto hi = entries.lower_bound(usec);
+      if (hi == entries.end()) {
+	interpolateTemperature(std::prev(hi)->second, bin, cached);
+      } else if (hi->first == usec || hi == entries.begin()) {
+	interpolateTemperature(hi->second, bin, cached);
+      } else {
+	auto lo = std::prev(hi);
+	frame upper;
+	interpolateTemperature(lo->second, bin, cached);
+	interpolateTemperature(hi->second, bin, upper);
+	float w = float(usec - lo->first) / float(hi->first - lo->first);
+	for (int i = 0; i < usb4kPixelCount; ++i) cached[i] += w*(upper[i] - cached[i]);
+      }
+
+      cacheValid = true;
+      cachedIntegration = usec;
+      cachedBin = bin;
+      return cached;
+    }
+
+    void subtract(const std::array<uint16_t, usb4kPixelCount> &raw, int usec, float celsius,
+		  std::array<float, usb4kPixelCount> &out) {
+      const frame &dark = darkFrame(usec, celsius);
+      for (int i = 0; i < usb4kPixelCount; ++i) out[i] = raw[i] - dark[i];
+    }
+
+    size_t size(void) const {
+      size_t n = 0;
+      for (auto &row : entries) n += row.second.size();
+      return n;
+    }
+
+    void clear(void) { entries.clear(); cacheValid = false; }
+
+    void save(const std::string &path) const;
+    void load(const std::string &path);
+  };
+}
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "spectrometer.hpp"
+#include "kernels.hpp"
+
+namespace spectrometer {
+  namespace kernels {
+    /*
+      out[i] = sum_k c[k] * in[i + k - W/2] for i in [begin, end), which the
+      caller keeps at least W/2 away from both ends. The window is a template
+      argument so the tap loop is fully unrolled for the usual sizes; W = 0
+      falls back to the runtime width m.
+    */
+    namespace scalar {
+      inline float load(const float *p) { return *p; }
+      inline float load(const uint16_t *p) { return *p; }
+
+      template <int W, typename T>
+      inline void convolve(const T *in, const float *c, int m, float *out, int begin, int end) {
+	const int taps = W ? W : m, h = taps / 2;
+	for (int i = begin; i < end; ++i) {
+	  float acc = 0;
+	  for (int k = 0; k < taps; ++k) acc += c[k] * load(in + i + k - h);
+	  out[i] = acc;
+	}
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    namespace sse {
+      SPECTROMETER_SSE inline __m128 load4(const float *p) { return _mm_loadu_ps(p); }
+      SPECTROMETER_SSE inline __m128 load4(const uint16_t *p) {
+	return _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p))));
+      }
+
+      template <int W, typename T>
+      SPECTROMETER_SSE
+      inline void convolve(const T *in, const float *c, int m, float *out, int begin, int end) {
+	const int taps = W ? W : m, h = taps / 2;
+	int i = begin;
+	for (; i + 4 <= end; i += 4) {
+	  __m128 acc = _mm_setzero_ps();
+	  for (int k = 0; k < taps; ++k)
+	    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(c[k]), load4(in + i + k - h)));
+	  _mm_storeu_ps(out + i, acc);
+	}
+	scalar::convolve<W>(in, c, m, out, i, end);
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2 inline __m256 load8(const float *p) { return _mm256_loadu_ps(p); }
+      SPECTROMETER_AVX2 inline __m256 load8(const uint16_t *p) {
+	return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))));
+      }
+
+      template <int W, typename T>
+      SPECTROMETER_AVX2
+      inline void convolve(const T *in, const float *c, int m, float *out, int begin, int end) {
+	const int taps = W ? W : m, h = taps / 2;
+	int i = begin;
+	for (; i + 8 <= end; i += 8) {
+	  __m256 acc = _mm256_setzero_ps();
+	  for (int k = 0; k < taps; ++k)
+	    acc = _mm256_fmadd_ps(_mm256_set1_ps(c[k]), load8(in + i + k - h), acc);
+	  _mm256_storeu_ps(out + i, acc);
+	}
+	scalar::convolve<W>(in, c, m, out, i, end);
+      }
+    }
+#endif
+
+    template <int W, typename T>
+    inline void convolveFixed(const T *in, const float *c, int m, float *out, int begin, int end) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::convolve<W>(in, c, m, out, begin, end);
+      case SSE: return sse::convolve<W>(in, c, m, out, begin, end);
+      default: break;
+      }
+#endif
+      scalar::convolve<W>(in, c, m, out, begin, end);
+    }
+
+    template <typename T>
+    inline void convolve(const T *in, const float *c, int m, float *out, int begin, int end) {
+      switch (m) {
+      case 5: return convolveFixed<5>(in, c, m, out, begin, end);
+      case 7: return convolveFixed<7>(in, c, m, out, begin, end);
+      case 9: return convolveFixed<9>(in, c, m, out, begin, end);
+      case 11: return convolveFixed<11>(in, c, m, out, begin, end);
+      case 15: return convolveFixed<15>(in, c, m, out, begin, end);
+      case 21: return convolveFixed<21>(in, c, m, out, begin, end);
+      case 25: return convolveFixed<25>(in, c, m, out, begin, end);
+      default: return convolveFixed<0>(in, c, m, out, begin, end);
+      }
+    }
+  }
+
+  /*
+    FIR filter over a whole spectrum with precomputed edge handling: each of
+    the first and last m/2 outputs has its own row of m coefficients applied
+    to the first or last m pixels. Generic kernels get mirrored edges folded
+    into those rows; Savitzky-Golay filters get the true polynomial fit of
+    the edge window instead, so derivatives stay valid up to the last pixel.
+
+    The filter is linear, so for raw counts minus an electric dark offset and
+    a dark frame, filter(raw - offset - dark) = filter(raw) - offset*sum(c) -
+    filter(dark); with the dark frame filtered once by setDark(), apply()
+    reads the raw frame in a single pass.
+  */
+  class firFilter {
+  private:
+    int m;
+    std::vector<float> coeffs;   // m taps, centered
+    std::vector<float> edgeRows; // 2*(m/2) rows of m taps
+    std::vector<float> coeffsSum;// per output pixel, sum of the taps applied
+    std::vector<float> darkFiltered;
+
+    // least squares polynomial of the given order on x = 0..m-1, d-th derivative at x = t
+    static std::vector<float> savitzkyGolayRow(int m, int order, int derivative, int t) {
+      const int n = order + 1;
+      const double center = (m - 1) / 2.0;
+      std::vector<double> a(n * n, 0.0), y(n * m, 0.0);
+      for (int k = 0; k < m; ++k) {
+	double x = k - center, xj = 1;
+	std::vector<double> powers(2*n);
+	for (int j = 0; j < 2*n; ++j, xj *= x) powers[j] = xj;
+	for (int r = 0; r < n; ++r) {
+	  for (int c = 0; c < n; ++c) a[r*n + c] += powers[r + c];
+	  y[r*m + k] = powers[r];
+	}
+      }
+
+      // Gauss-Jordan: a^-1 * J^T
+      for (int col = 0; col < n; ++col) {
+	int pivot = col;
+	for (int r = col + 1; r < n; ++r) if (std::fabs(a[r*n + col]) > std::fabs(a[pivot*n + col])) pivot = r;
+	for (int c = 0; c < n; ++c) std::swap(a[col*n + c], a[pivot*n + c]);
+	for (int k = 0; k < m; ++k) std::swap(y[col*m + k], y[pivot*m + k]);
+	double inv = 1.0 / a[col*n + col];
+	for (int c = 0; c < n; ++c) a[col*n + c] *= inv;
+	for (int k = 0; k < m; ++k) y[col*m + k] *= inv;
+	for (int r = 0; r < n; ++r) {
+	  if (r == col) continue;
+	  double f = a[r*n + col];
+	  for (int c = 0; c < n; ++c) a[r*n + c] -= f * a[col*n + c];
+	  for (int k = 0; k < m; ++k) y[r*m + k] -= f * y[col*m + k];
+	}
+      }
+
+      std::vector<float> row(m);
+      double s = t - center;
+      for (int k = 0; k < m; ++k) {
+	double v = 0;
+	for (int j = derivative; j < n; ++j) {
+	  double factor = 1;
+	  for (int q = 0; q < derivative; ++q) factor *= j - q;
+	  v += y[j*m + k] * factor * std::pow(s, j - derivative);
+	}
+	row[k] = v;
+      }
+      return row;
+    }
+
+    void finish(void) {
+      coeffsSum.assign(usb4kPixelCount, 0.0f);
+      const int h = m / 2;
+      float sum = 0;
+      for (float c : coeffs) sum += c;
+      std::fill(coeffsSum.begin() + h, coeffsSum.end() - h, sum);
+      for (int r = 0; r < 2*h; ++r) {
+	float s = 0;
+	for (int k = 0; k < m; ++k) s += edgeRows[r*m + k];
+	coeffsSum[r < h ? r : usb4kPixelCount - 2*h + r] = s;
+      }
+    }
+
+    firFilter(int window) : m(window) {}
+
+    template <typename T>
+    void run(const T *in, float *out) const {
+      const int h = m / 2;
+      kernels::convolve(in, coeffs.data(), m, out, h, usb4kPixelCount - h);
+      for (int r = 0; r < h; ++r) {
+	float head = 0, tail = 0;
+	for (int k = 0; k < m; ++k) {
+	  head += edgeRows[r*m + k] * float(in[k]);
+	  tail += edgeRows[(h + r)*m + k] * float(in[usb4kPixelCount - m + k]);
+	}
+	out[r] = head;
+	out[usb4kPixelCount - h + r] = tail;
+      }
+    }
+
+  public:
+    // Generic kernel of odd length, mirrored at the edges
+    firFilter(const std::vector<float> &taps) : m(taps.size()), coeffs(taps) {
+      if (m % 2 == 0 || m > usb4kPixelCount / 2)
+	throw std::invalid_argument("FIR kernel length must be odd and shorter than half a spectrum!");
+      const int h = m / 2;
+      edgeRows.assign(2*h * m, 0.0f);
+      for (int r = 0; r < h; ++r) {
+	for (int k = 0; k < m; ++k) {
+	  // head: pixel r + k - h, mirrored around 0, within the first m pixels
+	  int p = std::abs(r + k - h);
+	  edgeRows[r*m + p] += coeffs[k];
+	  // tail: pixel n - h + r + k - h, mirrored around n - 1, relative to n - m
+	  int q = usb4kPixelCount - h + r + k - h;
+	  if (q >= usb4kPixelCount) q = 2*(usb4kPixelCount - 1) - q;
+	  edgeRows[(h + r)*m + q - (usb4kPixelCount - m)] += coeffs[k];
+	}
+      }
+      finish();
+    }
+
+    // Smoothing (derivative 0) or derivative per pixel of a Savitzky-Golay fit
+    static firFilter savitzkyGolay(int window, int order, int derivative=0) {
+      if (window % 2 == 0 || window < 3 || window > usb4kPixelCount / 2 || order >= window || derivative > order)
+	throw std::invalid_argument("Savitzky-Golay needs an odd window > order >= derivative!");
+      firFilter f(window);
+      const int h = window / 2;
+      f.coeffs = savitzkyGolayRow(window, order, derivative, h);
+      for (int r = 0; r < h; ++r) {
+	auto head = savitzkyGolayRow(window, order, derivative, r);
+	f.edgeRows.insert(f.edgeRows.end(), head.begin(), head.end());
+      }
+      for (int r = 0; r < h; ++r) {
+	auto tail = savitzkyGolayRow(window, order, derivative, h + 1 + r);
+	f.edgeRows.insert(f.edgeRows.end(), tail.begin(), tail.end());
+      }
+      f.finish();
+      return f;
+    }
+
+    int window(void) const { return m; }
+    const std::vector<float>& getCoeffs(void) const { return coeffs; }
+
+    void apply(const float *in, float *out) const { run(in, out); }
+    void apply(const std::array<float, usb4kPixelCount> &in, std::array<float, usb4kPixelCount> &out) const {
+      run(in.data(), out.data());
+    }
+
+    // Per-pixel dark frame for apply(raw, offset, out), NULL to drop it
+    void setDark(const float *dark) {
+      if (!dark) { darkFiltered.clear(); return; }
+      darkFiltered.resize(usb4kPixelCount);
+      run(dark, darkFiltered.data());
+    }
+
+    // filter(raw - offset - dark) reading the raw counts once
+    void apply(const uint16_t *raw, float offset, float *out) const {
+      run(raw, out);
+      const float *dark = darkFiltered.empty() ? NULL : darkFiltered.data();
+      for (int i = 0; i < usb4kPixelCount; ++i)
+	out[i] -= offset * coeffsSum[i] + (dark ? dark[i] : 0.0f);
+    }
+  };
+}
@@ -0,0 +1,296 @@
+#include <algorithm>
+
+#include "graph.hpp"
+
+namespace spectrometer {
+
+  // index of the worker running on this thread, -1 elsewhere
+  static thread_local int currentWorker = -1;
+
+  processingGraph::processingGraph(size_t frames_in_flight, int thread_count)
+  {
+    if (frames_in_flight < 1)
+      throw std::invalid_argument("At least one frame has to be in flight!");
+    if (thread_count <= 0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    for (size_t i = 0; i < frames_in_flight; ++i) {
+      frames.emplace_back(new graphFrame);
+      freeFrames.push_back(frames.back().get());
+    }
+    for (int i = 0; i < thread_count; ++i) workers.emplace_back(new worker);
+  }
+
+  processingGraph::~processingGraph(void)
+  {
+    stop();
+  }
+
+  int processingGraph::addStage(const std::string &name, stageFunction function, int parent, mode kind,
+				size_t queue_depth)
+  {
+    if (running)
+      throw std::runtime_error("Stages can not be added to a running graph!");
+    if (parent < -1 || parent >= int(stages.size()))
+      throw std::out_of_range("No such parent stage!");
+
+    stages.emplace_back(new stage);
+    stage &s = *stages.back();
+    s.name = name;
+    s.function = std::move(function);
+    s.kind = kind;
+    s.queueDepth = std::max<size_t>(queue_depth, 1);
+
+    int id = stages.size() - 1;
+    if (parent < 0) roots.push_back(id);
+    else stages[parent]->children.push_back(id);
+    return id;
+  }
+
+  void processingGraph::start(void)
+  {
+    if (running) return;
+    stopping = false;
+    running = true;
+    started = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < workers.size(); ++i)
+      threads.emplace_back(&processingGraph::workerLoop, this, int(i));
+  }
+
+  void processingGraph::stop(void)
+  {
+    if (!running) return;
+    drain();
+    {
+      std::lock_guard<std::mutex> guard(idleLock);
+      stopping = true;
+    }
+    idleWake.notify_all();
+    for (auto &t : threads) t.join();
+    threads.clear();
+    running = false;
+  }
+
+  void processingGraph::schedule(const task &t)
+  {
+    int w = currentWorker >= 0 ? currentWorker : nextVictim.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    {
+      std::lock_guard<std::mutex> guard(workers[w]->lock);
+      workers[w]->tasks.push_back(t);
+    }
+    pendingTasks.fetch_add(1);
+    if (sleepers.load() > 0) {
+      std::lock_guard<std::mutex> guard(idleLock);
+      idleWake.notify_one();
+    }
+  }
+
+  bool processingGraph::take(int self, task &t)
+  {
+    // own tasks newest first, for a warm cache
+    {
+      worker &w = *workers[self];
+      std::lock_guard<std::mutex> guard(w.lock);
+      if (!w.tasks.empty()) {
+	t = w.tasks.back();
+	w.tasks.pop_back();
+	pendingTasks.fetch_sub(1);
+	return true;
+      }
+    }
+    // then the oldest of someone else
+    const int n = workers.size();
+    for (int k = 1; k < n; ++k) {
+      worker &w = *workers[(self + k) % n];
+      std::lock_guard<std::mutex> guard(w.lock);
+      if (!w.tasks.empty()) {
+	t = w.tasks.front();
+	w.tasks.pop_front();
+	pendingTasks.fetch_sub(1);
+	return true;
+      }
+    }
+    return false;
+  }
+
+  void processingGraph::workerLoop(int self)
+  {
+    currentWorker = self;
+    task t;
+    while (true) {
+      if (take(self, t)) {
+	if (t.frame) execute(t.stage, t.frame, t.skip);
+	else drainStage(t.stage);
+	continue;
+      }
+
+      std::unique_lock<std::mutex> guard(idleLock);
+      sleepers.fetch_add(1);
+      idleWake.wait(guard, [this] { return pendingTasks.load() > 0 || stopping; });
+      sleepers.fetch_sub(1);
+      if (stopping && pendingTasks.load() == 0) break;
+    }
+    currentWorker = -1;
+  }
+
+  void processingGraph::deliver(int id, graphFrame *f, bool skip)
+  {
+    stage &s = *stages[id];
+    f->references.fetch_add(1, std::memory_order_relaxed);
+
+    size_t queued = s.queued.fetch_add(1) + 1;
+    size_t high = s.queueHighWater.load(std::memory_order_relaxed);
+    while (queued > high && !s.queueHighWater.compare_exchange_weak(high, queued, std::memory_order_relaxed));
+
+    if (s.kind == PARALLEL) {
+      schedule({ id, f, skip });
+      return;
+    }
+
+    bool wake;
+    {
+      std::lock_guard<std::mutex> guard(s.inboxLock);
+      s.inbox[f->sequence] = std::make_pair(f, skip);
+      wake = !s.active && (s.kind == SERIAL || s.inbox.begin()->first == s.nextSequence);
+      if (wake) s.active = true;
+    }
+    if (wake) schedule({ id, NULL, false });
+  }
+
+  void processingGraph::drainStage(int id)
+  {
+    stage &s = *stages[id];
+    // a bounded batch, then back to the deque so that other stages get a turn
+    for (int n = 0; n < 16; ++n) {
+      graphFrame *f;
+      bool skip;
+      {
+	std::lock_guard<std::mutex> guard(s.inboxLock);
+	if (s.inbox.empty() || (s.kind == ORDERED && s.inbox.begin()->first != s.nextSequence)) {
+	  s.active = false;
+	  return;
+	}
+	f = s.inbox.begin()->second.first;
+	skip = s.inbox.begin()->second.second;
+	s.inbox.erase(s.inbox.begin());
+	++s.nextSequence;
+      }
+      execute(id, f, skip);
+    }
+    schedule({ id, NULL, false });
+  }
+
+  void processingGraph::execute(int id, graphFrame *f, bool skip)
+  {
+    stage &s = *stages[id];
+    bool forward = false, failed = false;
+    auto begin = std::chrono::steady_clock::now();
+    if (!skip) {
+      try {
+	forward = s.function(*f);
+      } catch (const std::exception &) {
+	failed = true; // stops the frame like returning false
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    {
+      std::lock_guard<std::mutex> guard(s.statsLock);
+      if (skip) ++s.skipped;
+      else {
+	++s.frames;
+	if (failed) ++s.errors;
+	s.busy += std::chrono::duration<double>(end - begin).count();
+	double latency = std::chrono::duration<double>(end - f->entered).count();
+	s.latencySum += latency;
+	s.latencyMax = std::max(s.latencyMax, latency);
+      }
+    }
+
+    for (int c : s.children) deliver(c, f, !forward);
+    s.queued.fetch_sub(1);
+    release(f);
+  }
+
+  void processingGraph::release(graphFrame *f)
+  {
+    if (f->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      std::lock_guard<std::mutex> guard(poolLock);
+      freeFrames.push_back(f);
+    }
+    poolWake.notify_all();
+  }
+
+  bool processingGraph::congested(void) const
+  {
+    for (auto &s : stages)
+      if (s->queued.load(std::memory_order_relaxed) >= s->queueDepth) return true;
+    return false;
+  }
+
+  void processingGraph::push(const frameMetadata &meta, const uint16_t *raw)
+  {
+    if (!running)
+      throw std::runtime_error("The processing graph is not running!");
+
+    graphFrame *f;
+    auto begin = std::chrono::steady_clock::now();
+    {
+      std::unique_lock<std::mutex> guard(poolLock);
+      poolWake.wait(guard, [this] { return !freeFrames.empty() && !congested(); });
+      f = freeFrames.back();
+      freeFrames.pop_back();
+      f->sequence = pushed++;
+    }
+    f->entered = std::chrono::steady_clock::now();
+    sourceWait += std::chrono::duration<double>(f->entered - begin).count();
+
+    f->meta = meta;
+    std::memcpy(f->raw, raw, sizeof(f->raw));
+    f->values.clear();
+
+    // the source holds a reference until every root has its own
+    f->references.store(1, std::memory_order_relaxed);
+    for (int r : roots) deliver(r, f, false);
+    release(f);
+  }
+
+  uint64_t processingGraph::run(frameSource &source, uint64_t max_frames)
+  {
+    frameMetadata meta;
+    const uint16_t *raw;
+    uint64_t n = 0;
+    while ((max_frames == 0 || n < max_frames) && source.next(meta, raw)) {
+      push(meta, raw);
+      ++n;
+    }
+    return n;
+  }
+
+  void processingGraph::drain(void)
+  {
+    std::unique_lock<std::mutex> guard(poolLock);
+    poolWake.wait(guard, [this] { return freeFrames.size() == frames.size(); });
+  }
+
+  std::vector<stageStats> processingGraph::getStats(void)
+  {
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::vector<stageStats> result;
+    for (auto &s : stages) {
+      std::lock_guard<std::mutex> guard(s->statsLock);
+      stageStats st;
+      st.name = s->name;
+      st.frames = s->frames;
+      st.skipped = s->skipped;
+      st.errors = s->errors;
+      st.busy = s->busy;
+      st.throughput = elapsed > 0 ? s->frames / elapsed : 0;
+      st.meanLatency = s->frames ? s->latencySum / s->frames : 0;
+      st.maxLatency = s->latencyMax;
+      st.queueHighWater = s->queueHighWater.load(std::memory_order_relaxed);
+      result.push_back(st);
+    }
+    return result;
+  }
+
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "spectrometer.hpp"
+
+namespace spectrometer {
+  // A frame travelling through a processingGraph
+  struct graphFrame {
+    uint64_t sequence;   // order of push() into the graph
+    frameMetadata meta;
+    uint16_t raw[usb4kPixelCount];
+    std::array<float, usb4kPixelCount> spectrum; // working copy for the stages
+    std::vector<float> values;                   // stage products, e.g. band integrals
+    std::chrono::steady_clock::time_point entered;
+
+    std::atomic<int> references{0};
+  };
+
+  struct stageStats {
+    std::string name;
+    uint64_t frames;     // processed
+    uint64_t skipped;    // passed on unprocessed, an upstream stage stopped them
+    uint64_t errors;     // the stage function threw, which stops the frame as well
+    double busy;         // [s] spent in the stage function
+    double throughput;   // [frames/s] since start()
+    double meanLatency;  // [s] from push() to the end of this stage
+    double maxLatency;
+    size_t queueHighWater;
+  };
+
+  /*
+    Processing stages in a tree fed by push(): each stage takes the frames of
+    its parent (or of the source) and passes them on to its children.
+
+    Frames come from a pool of frames_in_flight buffers and are reference
+    counted: a frame is retained for every stage it is handed to and returns
+    to the pool when the last one is done with it. push() blocks while the
+    pool is empty or any stage holds more than its queue depth, which is the
+    backpressure on the source; nothing is ever dropped inside the graph.
+
+    Stages run on a pool of worker threads with one task deque each; a worker
+    pops its own newest task and steals the oldest from the others when out
+    of work. A PARALLEL stage may run on several frames at once, a SERIAL one
+    on one frame at a time and an ORDERED one in addition strictly in push()
+    order, holding back frames that overtook others upstream.
+
+    A stage function returning false stops the frame for its subtree: the
+    descendants see it as skipped, keeping the sequence of ORDERED stages
+    complete. Sibling stages get the same frame concurrently, so only a
+    stage without siblings should modify it.
+  */
+  class processingGraph {
+  public:
+    enum mode {
+      PARALLEL,
+      SERIAL,
+      ORDERED
+    };
+
+    typedef std::function<bool(graphFrame &frame)> stageFunction;
+
+  private:
+    struct task {
+      int stage;
+      graphFrame *frame; // NULL: drain the inbox of a SERIAL or ORDERED stage
+      bool skip;
+    };
+
+    struct stage {
+      std::string name;
+      stageFunction function;
+      mode kind;
+      size_t queueDepth;
+      std::vector<int> children;
+
+      std::atomic<size_t> queued{0}; // handed over, not yet processed
+      std::atomic<size_t> queueHighWater{0};
+
+      // SERIAL and ORDERED
+      std::mutex inboxLock;
+      std::map<uint64_t, std::pair<graphFrame *, bool>> inbox; // by sequence
+      bool active = false;
+      uint64_t nextSequence = 0;
+
+      std::mutex statsLock;
+      uint64_t frames = 0, skipped = 0, errors = 0;
+      double busy = 0, latencySum = 0, latencyMax = 0;
+    };
+
+    struct worker {
+      std::mutex lock;
+      std::deque<task> tasks;
+    };
+
+    std::vector<std::unique_ptr<stage>> stages;
+    std::vector<int> roots;
+
+    std::vector<std::unique_ptr<graphFrame>> frames;
+    std::vector<graphFrame *> freeFrames;
+    std::mutex poolLock;
+    std::condition_variable poolWake;
+    uint64_t pushed = 0;
+    double sourceWait = 0; // [s] blocked in push()
+
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> pendingTasks{0};
+    std::atomic<int> sleepers{0};
+    std::mutex idleLock;
+    std::condition_variable idleWake;
+    std::atomic<unsigned> nextVictim{0};
+    bool running = false, stopping = false;
+    std::chrono::steady_clock::time_point started;
+
+    void schedule(const task &t);
+    bool take(int self, task &t);
+    void deliver(int s, graphFrame *f, bool skip);
+    void execute(int s, graphFrame *f, bool skip);
+    void drainStage(int s);
+    void release(graphFrame *f);
+    bool congested(void) const;
+    void workerLoop(int self);
+
+  public:
+    // thread_count <= 0 uses every core
+    processingGraph(size_t frames_in_flight=64, int thread_count=0);
+    virtual ~processingGraph(void);
+
+    processingGraph(const processingGraph &) = delete;
+    processingGraph& operator=(const processingGraph &) = delete;
+
+    // parent -1 is the source; returns the stage id. Only before start().
+    int addStage(const std::string &name, stageFunction function, int parent=-1, mode kind=PARALLEL,
+		 size_t queue_depth=16);
+
+    void start(void);
+    // Waits for the frames in flight, then joins the workers
+    void stop(void);
+
+    // Copies the frame into a pooled buffer, blocking under backpressure
+    void push(const frameMetadata &meta, const uint16_t *raw);
+    // Pushes frames of a source until it ends or max_frames (0: no limit); returns the count
+    uint64_t run(frameSource &source, uint64_t max_frames=0);
+    // Waits until every pushed frame went through all stages
+    void drain(void);
+
+    std::vector<stageStats> getStats(void);
+    double getSourceWait(void) const { return sourceWait; }
+  };
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "spectrometer.hpp"
+#include "darklibrary.hpp"
+#include "kernels.hpp"
+
+namespace spectrometer {
+  /*
+    The fusion of hdrAcquisition on its own, for frames from anywhere: add()
+    every frame of a cycle, then result() in counts per millisecond. Each
+    pixel is the sum of its dark corrected counts over the frames where it
+    was not saturated, divided by the sum of their exposures; a pixel
+    saturated in every frame gets the shortest exposure's value, a lower
+    bound.
+  */
+  class hdrFusion {
+  private:
+    uint16_t saturationLevel;
+    int shortest = 0;
+    std::array<float, usb4kPixelCount> numerator;
+    std::array<float, usb4kPixelCount> denominator;
+    std::array<float, usb4kPixelCount> fallback;
+    std::array<float, usb4kPixelCount> spectrum;
+
+  public:
+    hdrFusion(uint16_t saturation=usb4kSaturationLevel) : saturationLevel(saturation) { clear(); }
+
+    void clear(void) {
+      numerator.fill(0);
+      denominator.fill(0);
+      shortest = 0;
+    }
+
+    // dark: per pixel or NULL, offset: subtracted from every pixel; returns the saturated pixels
+    int add(const uint16_t *raw, int usec, const float *dark, float offset) {
+      if (usec <= 0)
+	throw std::invalid_argument("HDR fusion needs positive integration times!");
+      int saturated = kernels::hdrAccumulate(raw, dark, offset, saturationLevel, usec / 1000.0f,
+					      numerator.data(), denominator.data(), usb4kPixelCount);
+      if (shortest == 0 || usec < shortest) {
+	shortest = usec;
+	float inv = 1000.0f / usec;
+	for (int i = 0; i < usb4kPixelCount; ++i)
+	  fallback[i] = (raw[i] - offset - (dark ? dark[i] : 0.0f)) * inv;
+      }
+      return saturated;
+    }
+
+    const std::array<float, usb4kPixelCount>& result(void) {
+      for (int i = 0; i < usb4kPixelCount; ++i)
+	spectrum[i] = denominator[i] > 0 ? numerator[i] / denominator[i] : fallback[i];
+      return spectrum;
+    }
+  };
+
+  /*
+    High dynamic range acquisition cycling through a list of integration times.
+
+    The frames of a cycle are fused by hdrFusion, which weights every frame by
+    its integration time. The result is in counts per millisecond.
+
+    The integration times are walked back and forth, so the one ending a cycle
+    starts the next without another EP1 command, and setIntegration() is never
+    verified (no 10 ms sleep). After every change settleFrames spectra are
+    dropped, since the detector may still deliver one integrated with the
+    previous setting in the normal trigger mode.
+  */
+  class hdrAcquisition {
+  private:
+    usb4k &spec;
+    std::vector<int> integrations;
+    int settleFrames;
+    darkLibrary *darks = NULL;
+    float temperature = 0;
+
+    bool ascending = true;
+    hdrFusion fusion;
+    std::vector<int> saturatedCounts;
+
+  public:
+    hdrAcquisition(usb4k &s, std::vector<int> integration_us, uint16_t saturation=usb4kSaturationLevel, int settle=1)
+      : spec(s), integrations(std::move(integration_us)), settleFrames(settle),
+	fusion(saturation) {
+      if (integrations.empty())
+	throw std::invalid_argument("HDR acquisition needs at least one integration time!");
+      std::sort(integrations.begin(), integrations.end());
+      saturatedCounts.resize(integrations.size());
+    }
+
+    // Per-pixel darks instead of the electric dark pixels; the temperature is
+    // the one used to look them up and should be refreshed by the caller.
+    void setDarkLibrary(darkLibrary *library, float celsius) { darks = library; temperature = celsius; }
+
+    const std::array<float, usb4kPixelCount>& acquire(void) {
+      fusion.clear();
+
+      int count = integrations.size();
+      for (int k = 0; k < count; ++k) {
+	int index = ascending ? k : count - 1 - k;
+	int usec = integrations[index];
+
+	if (usec != spec.getIntegrationTime()) {
+	  spec.setIntegration(usec);
+	  for (int s = 0; s < settleFrames; ++s) spec.getRawSpectrum();
+	}
+
+	std::array<uint16_t, usb4kPixelCount> &raw = spec.getRawSpectrum();
+	const float *dark = darks ? darks->darkFrame(usec, temperature).data() : NULL;
+	float offset = darks ? 0.0f :
+	  kernels::scalar::offsetLevel(raw.data(), usb4kEdarkIndices.front(), usb4kEdarkIndices.size());
+
+	saturatedCounts[index] = fusion.add(raw.data(), usec, dark, offset);
+      }
+      if (count > 1) ascending = !ascending;
+
+      return fusion.result();
+    }
+
+    // Saturated pixels per integration time (ascending) in the last cycle
+    const std::vector<int>& getSaturatedCounts(void) const { return saturatedCounts; }
+    const std::vector<int>& getIntegrations(void) const { return integrations; }
+  };
+}
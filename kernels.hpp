@@ -0,0 +1,1195 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define SPECTROMETER_X86 1
+# define SPECTROMETER_SSE __attribute__((target("sse4.1")))
+# define SPECTROMETER_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+/*
+  Vectorized kernels over spectrum-sized arrays.
+
+  Every kernel comes in a portable scalar form and, on x86, SSE4.1 and AVX2
+  forms compiled through target attributes, so one binary picks the widest
+  one the running CPU supports. The variants are kept callable one by one
+  for the golden tests in test_preprocess.cpp.
+*/
+namespace spectrometer {
+  namespace kernels {
+    enum isa {
+      SCALAR = 0,
+      SSE = 1,
+      AVX2 = 2
+    };
+
+    inline isa detectISA(void) {
+#ifdef SPECTROMETER_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return AVX2;
+      if (__builtin_cpu_supports("sse4.1")) return SSE;
+#endif
+      return SCALAR;
+    }
+
+    // May be lowered, e.g. to compare the variants, but never raised above detectISA()
+    inline isa& activeISA(void) {
+      static isa active = detectISA();
+      return active;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Local maxima: indices i in [1, n-1) with v[i-1] < v[i] >= v[i+1] and
+    // v[i] > threshold, written in ascending order. Returns their number.
+    namespace scalar {
+      inline int localMaxima(const float *v, float threshold, int *indices, int n) {
+	int found = 0;
+	for (int i = 1; i < n - 1; ++i)
+	  if (v[i] > threshold && v[i] > v[i-1] && v[i] >= v[i+1]) indices[found++] = i;
+	return found;
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    namespace sse {
+      SPECTROMETER_SSE
+      inline int localMaxima(const float *v, float threshold, int *indices, int n) {
+	int found = 0, i = 1;
+	const __m128 thr = _mm_set1_ps(threshold);
+	for (; i + 5 <= n; i += 4) {
+	  __m128 c = _mm_loadu_ps(v + i);
+	  __m128 m = _mm_and_ps(_mm_cmpgt_ps(c, thr),
+				_mm_and_ps(_mm_cmpgt_ps(c, _mm_loadu_ps(v + i - 1)),
+					   _mm_cmpge_ps(c, _mm_loadu_ps(v + i + 1))));
+	  for (unsigned bits = _mm_movemask_ps(m); bits; bits &= bits - 1)
+	    indices[found++] = i + __builtin_ctz(bits);
+	}
+	for (; i < n - 1; ++i)
+	  if (v[i] > threshold && v[i] > v[i-1] && v[i] >= v[i+1]) indices[found++] = i;
+	return found;
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2
+      inline int localMaxima(const float *v, float threshold, int *indices, int n) {
+	int found = 0, i = 1;
+	const __m256 thr = _mm256_set1_ps(threshold);
+	for (; i + 9 <= n; i += 8) {
+	  __m256 c = _mm256_loadu_ps(v + i);
+	  __m256 m = _mm256_and_ps(_mm256_cmp_ps(c, thr, _CMP_GT_OQ),
+				   _mm256_and_ps(_mm256_cmp_ps(c, _mm256_loadu_ps(v + i - 1), _CMP_GT_OQ),
+						 _mm256_cmp_ps(c, _mm256_loadu_ps(v + i + 1), _CMP_GE_OQ)));
+	  for (unsigned bits = _mm256_movemask_ps(m); bits; bits &= bits - 1)
+	    indices[found++] = i + __builtin_ctz(bits);
+	}
+	for (; i < n - 1; ++i)
+	  if (v[i] > threshold && v[i] > v[i-1] && v[i] >= v[i+1]) indices[found++] = i;
+	return found;
+      }
+    }
+#endif
+
+    inline int localMaxima(const float *v, float threshold, int *indices, int n) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::localMaxima(v, threshold, indices, n);
+      case SSE: return sse::localMaxima(v, threshold, indices, n);
+      default: break;
+      }
+#endif
+      return scalar::localMaxima(v, threshold, indices, n);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // HDR fusion: per pixel, sum of dark corrected counts and of exposure [ms]
+    // over the frames not saturated. Returns the number of saturated pixels.
+    namespace scalar {
+      inline int hdrAccumulate(const uint16_t *raw, const float *dark, float offset, uint16_t saturation,
+			       float ms, float *num, float *den, int n) {
+	int saturated = 0;
+	for (int i = 0; i < n; ++i) {
+	  if (raw[i] >= saturation) { ++saturated; continue; }
+	  num[i] += raw[i] - offset - (dark ? dark[i] : 0.0f);
+	  den[i] += ms;
+	}
+	return saturated;
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    namespace sse {
+      SPECTROMETER_SSE
+      inline int hdrAccumulate(const uint16_t *raw, const float *dark, float offset, uint16_t saturation,
+			       float ms, float *num, float *den, int n) {
+	int saturated = 0, i = 0;
+	const __m128i sat = _mm_set1_epi32(saturation);
+	const __m128 off = _mm_set1_ps(offset), t = _mm_set1_ps(ms);
+	for (; i + 4 <= n; i += 4) {
+	  __m128i v = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(raw + i)));
+	  __m128 valid = _mm_castsi128_ps(_mm_cmplt_epi32(v, sat));
+	  __m128 x = _mm_sub_ps(_mm_cvtepi32_ps(v), off);
+	  if (dark) x = _mm_sub_ps(x, _mm_loadu_ps(dark + i));
+	  _mm_storeu_ps(num + i, _mm_add_ps(_mm_loadu_ps(num + i), _mm_and_ps(valid, x)));
+	  _mm_storeu_ps(den + i, _mm_add_ps(_mm_loadu_ps(den + i), _mm_and_ps(valid, t)));
+	  saturated += 4 - __builtin_popcount(_mm_movemask_ps(valid));
+	}
+	return saturated + scalar::hdrAccumulate(raw + i, dark ? dark + i : NULL, offset, saturation,
+						 ms, num + i, den + i, n - i);
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2
+      inline int hdrAccumulate(const uint16_t *raw, const float *dark, float offset, uint16_t saturation,
+			       float ms, float *num, float *den, int n) {
+	int saturated = 0, i = 0;
+	const __m256i sat = _mm256_set1_epi32(saturation);
+	const __m256 off = _mm256_set1_ps(offset), t = _mm256_set1_ps(ms);
+	for (; i + 8 <= n; i += 8) {
+	  __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(raw + i)));
+	  __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(sat, v));
+	  __m256 x = _mm256_sub_ps(_mm256_cvtepi32_ps(v), off);
+	  if (dark) x = _mm256_sub_ps(x, _mm256_loadu_ps(dark + i));
+	  _mm256_storeu_ps(num + i, _mm256_add_ps(_mm256_loadu_ps(num + i), _mm256_and_ps(valid, x)));
+	  _mm256_storeu_ps(den + i, _mm256_add_ps(_mm256_loadu_ps(den + i), _mm256_and_ps(valid, t)));
+	  saturated += 8 - __builtin_popcount(_mm256_movemask_ps(valid));
+	}
+	return saturated + scalar::hdrAccumulate(raw + i, dark ? dark + i : NULL, offset, saturation,
+						 ms, num + i, den + i, n - i);
+      }
+    }
+#endif
+
+    inline int hdrAccumulate(const uint16_t *raw, const float *dark, float offset, uint16_t saturation,
+			     float ms, float *num, float *den, int n) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::hdrAccumulate(raw, dark, offset, saturation, ms, num, den, n);
+      case SSE: return sse::hdrAccumulate(raw, dark, offset, saturation, ms, num, den, n);
+      default: break;
+      }
+#endif
+      return scalar::hdrAccumulate(raw, dark, offset, saturation, ms, num, den, n);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Inclusive prefix sum in double: p[0] = 0, p[k+1] = p[k] + v[k] (n+1 outputs)
+    namespace scalar {
+      inline void prefixSum(const float *v, double *p, int n) {
+	double sum = 0;
+	p[0] = 0;
+	for (int i = 0; i < n; ++i) p[i+1] = sum += v[i];
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    namespace sse {
+      SPECTROMETER_SSE
+      inline void prefixSum(const float *v, double *p, int n) {
+	__m128d carry = _mm_setzero_pd();
+	int i = 0;
+	p[0] = 0;
+	for (; i + 2 <= n; i += 2) {
+	  __m128d x = _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double *>(v + i))));
+	  x = _mm_add_pd(x, _mm_castsi128_pd(_mm_slli_si128(_mm_castpd_si128(x), 8)));
+	  x = _mm_add_pd(x, carry);
+	  _mm_storeu_pd(p + i + 1, x);
+	  carry = _mm_unpackhi_pd(x, x);
+	}
+	double sum = _mm_cvtsd_f64(carry);
+	for (; i < n; ++i) p[i+1] = sum += v[i];
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2
+      inline void prefixSum(const float *v, double *p, int n) {
+	const __m256d zero = _mm256_setzero_pd();
+	__m256d carry = zero;
+	int i = 0;
+	p[0] = 0;
+	for (; i + 4 <= n; i += 4) {
+	  __m256d x = _mm256_cvtps_pd(_mm_loadu_ps(v + i));
+	  x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x1));
+	  x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x3));
+	  x = _mm256_add_pd(x, carry);
+	  _mm256_storeu_pd(p + i + 1, x);
+	  carry = _mm256_permute4x64_pd(x, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	double sum = _mm256_cvtsd_f64(carry);
+	for (; i < n; ++i) p[i+1] = sum += v[i];
+      }
+    }
+#endif
+
+    inline void prefixSum(const float *v, double *p, int n) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::prefixSum(v, p, n);
+      case SSE: return sse::prefixSum(v, p, n);
+      default: break;
+      }
+#endif
+      scalar::prefixSum(v, p, n);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Blocked dot products: out[r] = x . rows[r*stride ...] for the 4 rows of
+    // a block, so each chunk of x is loaded once for all of them.
+    namespace scalar {
+      inline void dot4(const float *x, const float *rows, size_t stride, int n, float *out) {
+	for (int r = 0; r < 4; ++r) {
+	  const float *row = rows + r * stride;
+	  float sum = 0;
+	  for (int i = 0; i < n; ++i) sum += x[i] * row[i];
+	  out[r] = sum;
+	}
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    namespace sse {
+      SPECTROMETER_SSE
+      inline void dot4(const float *x, const float *rows, size_t stride, int n, float *out) {
+	const float *r0 = rows, *r1 = rows + stride, *r2 = rows + 2*stride, *r3 = rows + 3*stride;
+	__m128 s0 = _mm_setzero_ps(), s1 = s0, s2 = s0, s3 = s0;
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+	  __m128 v = _mm_loadu_ps(x + i);
+	  s0 = _mm_add_ps(s0, _mm_mul_ps(v, _mm_loadu_ps(r0 + i)));
+	  s1 = _mm_add_ps(s1, _mm_mul_ps(v, _mm_loadu_ps(r1 + i)));
+	  s2 = _mm_add_ps(s2, _mm_mul_ps(v, _mm_loadu_ps(r2 + i)));
+	  s3 = _mm_add_ps(s3, _mm_mul_ps(v, _mm_loadu_ps(r3 + i)));
+	}
+	// transpose-add: lane r of the result is the sum of s_r
+	__m128 t01 = _mm_hadd_ps(s0, s1), t23 = _mm_hadd_ps(s2, s3);
+	_mm_storeu_ps(out, _mm_hadd_ps(t01, t23));
+	for (; i < n; ++i) {
+	  out[0] += x[i] * r0[i]; out[1] += x[i] * r1[i];
+	  out[2] += x[i] * r2[i]; out[3] += x[i] * r3[i];
+	}
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2
+      inline void dot4(const float *x, const float *rows, size_t stride, int n, float *out) {
+	const float *r0 = rows, *r1 = rows + stride, *r2 = rows + 2*stride, *r3 = rows + 3*stride;
+	__m256 s0 = _mm256_setzero_ps(), s1 = s0, s2 = s0, s3 = s0;
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+	  __m256 v = _mm256_loadu_ps(x + i);
+	  s0 = _mm256_fmadd_ps(v, _mm256_loadu_ps(r0 + i), s0);
+	  s1 = _mm256_fmadd_ps(v, _mm256_loadu_ps(r1 + i), s1);
+	  s2 = _mm256_fmadd_ps(v, _mm256_loadu_ps(r2 + i), s2);
+	  s3 = _mm256_fmadd_ps(v, _mm256_loadu_ps(r3 + i), s3);
+	}
+	__m256 t = _mm256_hadd_ps(_mm256_hadd_ps(s0, s1), _mm256_hadd_ps(s2, s3));
+	_mm_storeu_ps(out, _mm_add_ps(_mm256_castps256_ps128(t), _mm256_extractf128_ps(t, 1)));
+	for (; i < n; ++i) {
+	  out[0] += x[i] * r0[i]; out[1] += x[i] * r1[i];
+	  out[2] += x[i] * r2[i]; out[3] += x[i] * r3[i];
+	}
+      }
+    }
+#endif
+
+    inline void dot4(const float *x, const float *rows, size_t stride, int n, float *out) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::dot4(x, rows, stride, n, out);
+      case SSE: return sse::dot4(x, rows, stride, n, out);
+      default: break;
+      }
+#endif
+      scalar::dot4(x, rows, stride, n, out);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Ratio to a reference: t = max(raw - dark, floor) * inv_reference, written
+    // as is or as -log10(t). The logarithm splits off the exponent, folds the
+    // mantissa m into [sqrt(1/2), sqrt(2)) and evaluates ln(m) as
+    // x - x^2/2 + x^3 P(x) with x = m - 1 and P the degree 8 polynomial of
+    // Cephes' logf, without a division and exact to a few float ulps; every
+    // variant evaluates the same steps.
+    namespace scalar {
+      constexpr float logCoeffs[9] = {
+	7.0376836292e-2f, -1.1514610310e-1f, 1.1676998740e-1f, -1.2420140846e-1f, 1.4249322787e-1f,
+	-1.6668057665e-1f, 2.0000714765e-1f, -2.4999993993e-1f, 3.3333331174e-1f
+      };
+
+      inline float log10(float x) {
+	uint32_t bits;
+	std::memcpy(&bits, &x, sizeof(bits));
+	int e = int(bits >> 23) - 127;
+	bits = (bits & 0x7fffff) | 0x3f800000;
+	float m;
+	std::memcpy(&m, &bits, sizeof(m));
+	if (m > 1.41421356f) { m *= 0.5f; ++e; }
+	float u = m - 1.0f, u2 = u * u, p = logCoeffs[0];
+	for (int k = 1; k < 9; ++k) p = p * u + logCoeffs[k];
+	float ln = u + (u * u2 * p - 0.5f * u2);
+	return e * 0.30102999566f + ln * 0.43429448190f;
+      }
+
+      inline void ratio(const uint16_t *raw, const float *dark, const float *inv_reference, float floor,
+			bool absorbance, float *out, int n) {
+	for (int i = 0; i < n; ++i) {
+	  float t = std::max(raw[i] - dark[i], floor) * inv_reference[i];
+	  out[i] = absorbance ? -log10(t) : t;
+	}
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    namespace sse {
+      SPECTROMETER_SSE
+      inline __m128 log10(__m128 x) {
+	const __m128 one = _mm_set1_ps(1.0f);
+	__m128i bits = _mm_castps_si128(x);
+	__m128i e = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127));
+	__m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)), _mm_set1_epi32(0x3f800000)));
+	__m128 fold = _mm_cmpgt_ps(m, _mm_set1_ps(1.41421356f));
+	m = _mm_blendv_ps(m, _mm_mul_ps(m, _mm_set1_ps(0.5f)), fold);
+	e = _mm_sub_epi32(e, _mm_castps_si128(fold)); // true lanes are -1
+	__m128 u = _mm_sub_ps(m, one), u2 = _mm_mul_ps(u, u), p = _mm_set1_ps(scalar::logCoeffs[0]);
+	for (int k = 1; k < 9; ++k) p = _mm_add_ps(_mm_mul_ps(p, u), _mm_set1_ps(scalar::logCoeffs[k]));
+	__m128 ln = _mm_add_ps(u, _mm_sub_ps(_mm_mul_ps(_mm_mul_ps(u, u2), p), _mm_mul_ps(_mm_set1_ps(0.5f), u2)));
+	return _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(e), _mm_set1_ps(0.30102999566f)),
+			  _mm_mul_ps(ln, _mm_set1_ps(0.43429448190f)));
+      }
+
+      SPECTROMETER_SSE
+      inline void ratio(const uint16_t *raw, const float *dark, const float *inv_reference, float floor,
+			bool absorbance, float *out, int n) {
+	const __m128 lo = _mm_set1_ps(floor), sign = _mm_set1_ps(-0.0f);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+	  __m128 x = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(raw + i))));
+	  __m128 t = _mm_mul_ps(_mm_max_ps(_mm_sub_ps(x, _mm_loadu_ps(dark + i)), lo), _mm_loadu_ps(inv_reference + i));
+	  _mm_storeu_ps(out + i, absorbance ? _mm_xor_ps(log10(t), sign) : t);
+	}
+	scalar::ratio(raw + i, dark + i, inv_reference + i, floor, absorbance, out + i, n - i);
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2
+      inline __m256 log10(__m256 x) {
+	const __m256 one = _mm256_set1_ps(1.0f);
+	__m256i bits = _mm256_castps_si256(x);
+	__m256i e = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127));
+	__m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x7fffff)),
+						       _mm256_set1_epi32(0x3f800000)));
+	__m256 fold = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+	m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), fold);
+	e = _mm256_sub_epi32(e, _mm256_castps_si256(fold)); // true lanes are -1
+	// mul + add rather than fma, to round like the other variants
+	__m256 u = _mm256_sub_ps(m, one), u2 = _mm256_mul_ps(u, u), p = _mm256_set1_ps(scalar::logCoeffs[0]);
+	for (int k = 1; k < 9; ++k) p = _mm256_add_ps(_mm256_mul_ps(p, u), _mm256_set1_ps(scalar::logCoeffs[k]));
+	__m256 ln = _mm256_add_ps(u, _mm256_sub_ps(_mm256_mul_ps(_mm256_mul_ps(u, u2), p),
+						   _mm256_mul_ps(_mm256_set1_ps(0.5f), u2)));
+	return _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(e), _mm256_set1_ps(0.30102999566f)),
+			     _mm256_mul_ps(ln, _mm256_set1_ps(0.43429448190f)));
+      }
+
+      SPECTROMETER_AVX2
+      inline void ratio(const uint16_t *raw, const float *dark, const float *inv_reference, float floor,
+			bool absorbance, float *out, int n) {
+	const __m256 lo = _mm256_set1_ps(floor), sign = _mm256_set1_ps(-0.0f);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+	  __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(raw + i))));
+	  __m256 t = _mm256_mul_ps(_mm256_max_ps(_mm256_sub_ps(x, _mm256_loadu_ps(dark + i)), lo),
+				   _mm256_loadu_ps(inv_reference + i));
+	  _mm256_storeu_ps(out + i, absorbance ? _mm256_xor_ps(log10(t), sign) : t);
+	}
+	scalar::ratio(raw + i, dark + i, inv_reference + i, floor, absorbance, out + i, n - i);
+      }
+    }
+#endif
+
+    inline void ratio(const uint16_t *raw, const float *dark, const float *inv_reference, float floor,
+		      bool absorbance, float *out, int n) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::ratio(raw, dark, inv_reference, floor, absorbance, out, n);
+      case SSE: return sse::ratio(raw, dark, inv_reference, floor, absorbance, out, n);
+      default: break;
+      }
+#endif
+      scalar::ratio(raw, dark, inv_reference, floor, absorbance, out, n);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Welford update of per-pixel statistics with the count-th frame, given as
+    // inv_count = 1/count: mean += d/count, m2 += d (x - mean) with d = x - mean
+    // before, in double, plus the minimum, maximum and the frames at or above
+    // saturation. AVX2 uses fused multiply-adds, so it differs from the others
+    // in the last bits.
+    namespace scalar {
+      inline void welford(const uint16_t *raw, double inv_count, uint16_t saturation, double *mean, double *m2,
+			  uint16_t *lo, uint16_t *hi, uint32_t *saturated, int n) {
+	for (int i = 0; i < n; ++i) {
+	  double x = raw[i], d = x - mean[i];
+	  mean[i] += d * inv_count;
+	  m2[i] += d * (x - mean[i]);
+	  lo[i] = std::min(lo[i], raw[i]);
+	  hi[i] = std::max(hi[i], raw[i]);
+	  saturated[i] += raw[i] >= saturation;
+	}
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    namespace sse {
+      SPECTROMETER_SSE
+      inline void welfordStep(__m128d x, __m128d inv, double *mean, double *m2) {
+	__m128d m = _mm_loadu_pd(mean), d = _mm_sub_pd(x, m);
+	m = _mm_add_pd(m, _mm_mul_pd(d, inv));
+	_mm_storeu_pd(mean, m);
+	_mm_storeu_pd(m2, _mm_add_pd(_mm_loadu_pd(m2), _mm_mul_pd(d, _mm_sub_pd(x, m))));
+      }
+
+      SPECTROMETER_SSE
+      inline void welford(const uint16_t *raw, double inv_count, uint16_t saturation, double *mean, double *m2,
+			  uint16_t *lo, uint16_t *hi, uint32_t *saturated, int n) {
+	int i = 0;
+	const __m128d inv = _mm_set1_pd(inv_count);
+	const __m128i sat = _mm_set1_epi16(short(saturation));
+	for (; i + 8 <= n; i += 8) {
+	  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(raw + i));
+	  __m128i *l = reinterpret_cast<__m128i *>(lo + i), *h = reinterpret_cast<__m128i *>(hi + i);
+	  _mm_storeu_si128(l, _mm_min_epu16(_mm_loadu_si128(l), v));
+	  _mm_storeu_si128(h, _mm_max_epu16(_mm_loadu_si128(h), v));
+
+	  // -1 where raw >= saturation, subtracted from the counts
+	  __m128i over = _mm_cmpeq_epi16(_mm_max_epu16(v, sat), v);
+	  __m128i *c = reinterpret_cast<__m128i *>(saturated + i);
+	  _mm_storeu_si128(c, _mm_sub_epi32(_mm_loadu_si128(c), _mm_cvtepi16_epi32(over)));
+	  _mm_storeu_si128(c + 1, _mm_sub_epi32(_mm_loadu_si128(c + 1), _mm_cvtepi16_epi32(_mm_srli_si128(over, 8))));
+
+	  __m128i a = _mm_cvtepu16_epi32(v), b = _mm_cvtepu16_epi32(_mm_srli_si128(v, 8));
+	  welfordStep(_mm_cvtepi32_pd(a), inv, mean + i, m2 + i);
+	  welfordStep(_mm_cvtepi32_pd(_mm_srli_si128(a, 8)), inv, mean + i + 2, m2 + i + 2);
+	  welfordStep(_mm_cvtepi32_pd(b), inv, mean + i + 4, m2 + i + 4);
+	  welfordStep(_mm_cvtepi32_pd(_mm_srli_si128(b, 8)), inv, mean + i + 6, m2 + i + 6);
+	}
+	scalar::welford(raw + i, inv_count, saturation, mean + i, m2 + i, lo + i, hi + i, saturated + i, n - i);
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2
+      inline void welfordStep(__m256d x, __m256d inv, double *mean, double *m2) {
+	__m256d m = _mm256_loadu_pd(mean), d = _mm256_sub_pd(x, m);
+	m = _mm256_fmadd_pd(d, inv, m);
+	_mm256_storeu_pd(mean, m);
+	_mm256_storeu_pd(m2, _mm256_fmadd_pd(d, _mm256_sub_pd(x, m), _mm256_loadu_pd(m2)));
+      }
+
+      SPECTROMETER_AVX2
+      inline void welford(const uint16_t *raw, double inv_count, uint16_t saturation, double *mean, double *m2,
+			  uint16_t *lo, uint16_t *hi, uint32_t *saturated, int n) {
+	int i = 0;
+	const __m256d inv = _mm256_set1_pd(inv_count);
+	const __m128i sat = _mm_set1_epi16(short(saturation));
+	for (; i + 8 <= n; i += 8) {
+	  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(raw + i));
+	  __m128i *l = reinterpret_cast<__m128i *>(lo + i), *h = reinterpret_cast<__m128i *>(hi + i);
+	  _mm_storeu_si128(l, _mm_min_epu16(_mm_loadu_si128(l), v));
+	  _mm_storeu_si128(h, _mm_max_epu16(_mm_loadu_si128(h), v));
+
+	  __m128i over = _mm_cmpeq_epi16(_mm_max_epu16(v, sat), v);
+	  __m256i *c = reinterpret_cast<__m256i *>(saturated + i);
+	  _mm256_storeu_si256(c, _mm256_sub_epi32(_mm256_loadu_si256(c), _mm256_cvtepi16_epi32(over)));
+
+	  __m256i w = _mm256_cvtepu16_epi32(v);
+	  welfordStep(_mm256_cvtepi32_pd(_mm256_castsi256_si128(w)), inv, mean + i, m2 + i);
+	  welfordStep(_mm256_cvtepi32_pd(_mm256_extracti128_si256(w, 1)), inv, mean + i + 4, m2 + i + 4);
+	}
+	scalar::welford(raw + i, inv_count, saturation, mean + i, m2 + i, lo + i, hi + i, saturated + i, n - i);
+      }
+    }
+#endif
+
+    inline void welford(const uint16_t *raw, double inv_count, uint16_t saturation, double *mean, double *m2,
+			uint16_t *lo, uint16_t *hi, uint32_t *saturated, int n) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::welford(raw, inv_count, saturation, mean, m2, lo, hi, saturated, n);
+      case SSE: return sse::welford(raw, inv_count, saturation, mean, m2, lo, hi, saturated, n);
+      default: break;
+      }
+#endif
+      scalar::welford(raw, inv_count, saturation, mean, m2, lo, hi, saturated, n);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Min/max envelope: lo = min(lo, raw) and hi = max(hi, raw) per pixel, then
+    // the reduction of the envelope over column c = [edges[c], edges[c+1]).
+    // decimateMinMax reads lo and hi in whole vectors, up to 15 elements
+    // beyond edges[columns].
+    namespace scalar {
+      inline void minMaxAccumulate(const uint16_t *raw, uint16_t *lo, uint16_t *hi, int n) {
+	for (int i = 0; i < n; ++i) {
+	  lo[i] = std::min(lo[i], raw[i]);
+	  hi[i] = std::max(hi[i], raw[i]);
+	}
+      }
+
+      inline void decimateMinMax(const uint16_t *lo, const uint16_t *hi, const int *edges, int columns,
+				 uint16_t *out_lo, uint16_t *out_hi) {
+	for (int c = 0; c < columns; ++c) {
+	  out_lo[c] = *std::min_element(lo + edges[c], lo + edges[c+1]);
+	  out_hi[c] = *std::max_element(hi + edges[c], hi + edges[c+1]);
+	}
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    namespace sse {
+      SPECTROMETER_SSE
+      inline void minMaxAccumulate(const uint16_t *raw, uint16_t *lo, uint16_t *hi, int n) {
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+	  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(raw + i));
+	  __m128i *l = reinterpret_cast<__m128i *>(lo + i), *h = reinterpret_cast<__m128i *>(hi + i);
+	  _mm_storeu_si128(l, _mm_min_epu16(_mm_loadu_si128(l), v));
+	  _mm_storeu_si128(h, _mm_max_epu16(_mm_loadu_si128(h), v));
+	}
+	scalar::minMaxAccumulate(raw + i, lo + i, hi + i, n - i);
+      }
+
+      // phminposuw reduces 8 lanes at once; the maximum is the minimum of the complements
+      SPECTROMETER_SSE
+      inline void decimateMinMax(const uint16_t *lo, const uint16_t *hi, const int *edges, int columns,
+				 uint16_t *out_lo, uint16_t *out_hi) {
+	const __m128i ones = _mm_set1_epi16(-1), lanes = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+	for (int c = 0; c < columns; ++c) {
+	  __m128i mn = ones, mx = _mm_setzero_si128();
+	  int j = edges[c];
+	  for (; j + 8 <= edges[c+1]; j += 8) {
+	    mn = _mm_min_epu16(mn, _mm_loadu_si128(reinterpret_cast<const __m128i *>(lo + j)));
+	    mx = _mm_max_epu16(mx, _mm_loadu_si128(reinterpret_cast<const __m128i *>(hi + j)));
+	  }
+	  if (j < edges[c+1]) {
+	    __m128i keep = _mm_cmpgt_epi16(_mm_set1_epi16(short(edges[c+1] - j)), lanes);
+	    mn = _mm_min_epu16(mn, _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(lo + j)),
+						 _mm_andnot_si128(keep, ones)));
+	    mx = _mm_max_epu16(mx, _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(hi + j)), keep));
+	  }
+	  out_lo[c] = _mm_cvtsi128_si32(_mm_minpos_epu16(mn));
+	  out_hi[c] = ~_mm_cvtsi128_si32(_mm_minpos_epu16(_mm_xor_si128(mx, ones)));
+	}
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2
+      inline void minMaxAccumulate(const uint16_t *raw, uint16_t *lo, uint16_t *hi, int n) {
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+	  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(raw + i));
+	  __m256i *l = reinterpret_cast<__m256i *>(lo + i), *h = reinterpret_cast<__m256i *>(hi + i);
+	  _mm256_storeu_si256(l, _mm256_min_epu16(_mm256_loadu_si256(l), v));
+	  _mm256_storeu_si256(h, _mm256_max_epu16(_mm256_loadu_si256(h), v));
+	}
+	sse::minMaxAccumulate(raw + i, lo + i, hi + i, n - i);
+      }
+
+      SPECTROMETER_AVX2
+      inline void decimateMinMax(const uint16_t *lo, const uint16_t *hi, const int *edges, int columns,
+				 uint16_t *out_lo, uint16_t *out_hi) {
+	const __m256i ones = _mm256_set1_epi16(-1);
+	const __m256i lanes = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	for (int c = 0; c < columns; ++c) {
+	  __m256i mn = ones, mx = _mm256_setzero_si256();
+	  int j = edges[c];
+	  for (; j + 16 <= edges[c+1]; j += 16) {
+	    mn = _mm256_min_epu16(mn, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(lo + j)));
+	    mx = _mm256_max_epu16(mx, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(hi + j)));
+	  }
+	  if (j < edges[c+1]) {
+	    __m256i keep = _mm256_cmpgt_epi16(_mm256_set1_epi16(short(edges[c+1] - j)), lanes);
+	    mn = _mm256_min_epu16(mn, _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(lo + j)),
+						       _mm256_andnot_si256(keep, ones)));
+	    mx = _mm256_max_epu16(mx, _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(hi + j)), keep));
+	  }
+	  __m128i mn8 = _mm_min_epu16(_mm256_castsi256_si128(mn), _mm256_extracti128_si256(mn, 1));
+	  __m128i mx8 = _mm_max_epu16(_mm256_castsi256_si128(mx), _mm256_extracti128_si256(mx, 1));
+	  out_lo[c] = _mm_cvtsi128_si32(_mm_minpos_epu16(mn8));
+	  out_hi[c] = ~_mm_cvtsi128_si32(_mm_minpos_epu16(_mm_xor_si128(mx8, _mm_set1_epi16(-1))));
+	}
+      }
+    }
+#endif
+
+    inline void minMaxAccumulate(const uint16_t *raw, uint16_t *lo, uint16_t *hi, int n) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::minMaxAccumulate(raw, lo, hi, n);
+      case SSE: return sse::minMaxAccumulate(raw, lo, hi, n);
+      default: break;
+      }
+#endif
+      scalar::minMaxAccumulate(raw, lo, hi, n);
+    }
+
+    inline void decimateMinMax(const uint16_t *lo, const uint16_t *hi, const int *edges, int columns,
+			       uint16_t *out_lo, uint16_t *out_hi) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::decimateMinMax(lo, hi, edges, columns, out_lo, out_hi);
+      case SSE: return sse::decimateMinMax(lo, hi, edges, columns, out_lo, out_hi);
+      default: break;
+      }
+#endif
+      scalar::decimateMinMax(lo, hi, edges, columns, out_lo, out_hi);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Display kernels. resampleLinear: out[c] = in[k] + f (in[k+1] - in[k]) with
+    // k = index[c], f = fraction[c], so index[c] + 1 has to be in range.
+    // colorize: level k = (v - offset) * scale truncated to [0, 255], NaN to 0,
+    // and the 3 bytes of lut[k] (byte 0 first, BGR for OpenCV) per value; the
+    // vector forms store whole registers and never write past bgr + 3n.
+    namespace scalar {
+      inline void resampleLinear(const float *in, const int *index, const float *fraction, int n, float *out) {
+	for (int c = 0; c < n; ++c) {
+	  float a = in[index[c]], b = in[index[c] + 1];
+	  out[c] = a + fraction[c] * (b - a);
+	}
+      }
+
+      inline void colorize(const float *v, float offset, float scale, const uint32_t *lut, uint8_t *bgr, int n) {
+	for (int i = 0; i < n; ++i) {
+	  float x = (v[i] - offset) * scale;
+	  uint32_t c = lut[x > 0 ? (x < 255 ? int(x) : 255) : 0];
+	  bgr[3*i] = c;
+	  bgr[3*i + 1] = c >> 8;
+	  bgr[3*i + 2] = c >> 16;
+	}
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    namespace sse {
+      SPECTROMETER_SSE
+      inline void resampleLinear(const float *in, const int *index, const float *fraction, int n, float *out) {
+	int c = 0;
+	for (; c + 4 <= n; c += 4) {
+	  const int *k = index + c;
+	  __m128 a = _mm_setr_ps(in[k[0]], in[k[1]], in[k[2]], in[k[3]]);
+	  __m128 b = _mm_setr_ps(in[k[0] + 1], in[k[1] + 1], in[k[2] + 1], in[k[3] + 1]);
+	  _mm_storeu_ps(out + c, _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(fraction + c), _mm_sub_ps(b, a))));
+	}
+	scalar::resampleLinear(in, index + c, fraction + c, n - c, out + c);
+      }
+
+      SPECTROMETER_SSE
+      inline void colorize(const float *v, float offset, float scale, const uint32_t *lut, uint8_t *bgr, int n) {
+	const __m128 off = _mm_set1_ps(offset), s = _mm_set1_ps(scale), top = _mm_set1_ps(255.0f);
+	const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	int i = 0;
+	// 12 bytes a step, stored as 16
+	for (; i + 6 <= n; i += 4) {
+	  __m128 x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(v + i), off), s);
+	  __m128i k = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(x, _mm_setzero_ps()), top));
+	  __m128i c = _mm_setr_epi32(lut[_mm_cvtsi128_si32(k)], lut[_mm_extract_epi32(k, 1)],
+				     lut[_mm_extract_epi32(k, 2)], lut[_mm_extract_epi32(k, 3)]);
+	  _mm_storeu_si128(reinterpret_cast<__m128i *>(bgr + 3*i), _mm_shuffle_epi8(c, pack));
+	}
+	scalar::colorize(v + i, offset, scale, lut, bgr + 3*i, n - i);
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2
+      inline void resampleLinear(const float *in, const int *index, const float *fraction, int n, float *out) {
+	int c = 0;
+	for (; c + 8 <= n; c += 8) {
+	  __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index + c));
+	  __m256 a = _mm256_i32gather_ps(in, k, 4), b = _mm256_i32gather_ps(in + 1, k, 4);
+	  _mm256_storeu_ps(out + c, _mm256_fmadd_ps(_mm256_loadu_ps(fraction + c), _mm256_sub_ps(b, a), a));
+	}
+	scalar::resampleLinear(in, index + c, fraction + c, n - c, out + c);
+      }
+
+      SPECTROMETER_AVX2
+      inline void colorize(const float *v, float offset, float scale, const uint32_t *lut, uint8_t *bgr, int n) {
+	const __m256 off = _mm256_set1_ps(offset), s = _mm256_set1_ps(scale), top = _mm256_set1_ps(255.0f);
+	const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+					      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	int i = 0;
+	// 24 bytes a step, stored as two overlapping 16
+	for (; i + 10 <= n; i += 8) {
+	  __m256 x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(v + i), off), s);
+	  __m256i k = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(x, _mm256_setzero_ps()), top));
+	  __m256i c = _mm256_shuffle_epi8(_mm256_i32gather_epi32(reinterpret_cast<const int *>(lut), k, 4), pack);
+	  _mm_storeu_si128(reinterpret_cast<__m128i *>(bgr + 3*i), _mm256_castsi256_si128(c));
+	  _mm_storeu_si128(reinterpret_cast<__m128i *>(bgr + 3*i + 12), _mm256_extracti128_si256(c, 1));
+	}
+	scalar::colorize(v + i, offset, scale, lut, bgr + 3*i, n - i);
+      }
+    }
+#endif
+
+    inline void resampleLinear(const float *in, const int *index, const float *fraction, int n, float *out) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::resampleLinear(in, index, fraction, n, out);
+      case SSE: return sse::resampleLinear(in, index, fraction, n, out);
+      default: break;
+      }
+#endif
+      scalar::resampleLinear(in, index, fraction, n, out);
+    }
+
+    inline void colorize(const float *v, float offset, float scale, const uint32_t *lut, uint8_t *bgr, int n) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::colorize(v, offset, scale, lut, bgr, n);
+      case SSE: return sse::colorize(v, offset, scale, lut, bgr, n);
+      default: break;
+      }
+#endif
+      scalar::colorize(v, offset, scale, lut, bgr, n);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Preprocessing of every frame. offsetCorrect: the mean of raw[first,
+    // first+count) (e.g. the electric dark pixels, 0 if count is 0) subtracted
+    // from every pixel, returned. argmax: index of the first maximum, NaN never
+    // being one (0 if all are), and its value. accumulate: acc += v.
+    namespace scalar {
+      inline float offsetLevel(const uint16_t *raw, int first, int count) {
+	uint32_t sum = 0;
+	for (int k = first; k < first + count; ++k) sum += raw[k];
+	return count > 0 ? (float)sum / count : 0.0f;
+      }
+
+      inline float offsetCorrect(const uint16_t *raw, int first, int count, float *out, int n) {
+	const float level = offsetLevel(raw, first, count);
+	for (int i = 0; i < n; ++i) out[i] = raw[i] - level;
+	return level;
+      }
+
+      inline int argmax(const float *v, int n, float &max) {
+	int index = 0;
+	float best = -INFINITY;
+	for (int i = 0; i < n; ++i)
+	  if (v[i] > best) { best = v[i]; index = i; }
+	max = best;
+	return index;
+      }
+
+      inline void accumulate(const float *v, float *acc, int n) {
+	for (int i = 0; i < n; ++i) acc[i] += v[i];
+      }
+
+      // the lanes' maxima with their first indices, then the tail; ties go to the lower index
+      inline int argmaxReduce(const float *best, const int *indices, int lanes, const float *v, int from, int n,
+			      float &max) {
+	int index = 0;
+	float m = -INFINITY;
+	for (int l = 0; l < lanes; ++l)
+	  if (best[l] > m || (best[l] == m && indices[l] < index)) { m = best[l]; index = indices[l]; }
+	for (int i = from; i < n; ++i)
+	  if (v[i] > m) { m = v[i]; index = i; }
+	max = m;
+	return index;
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    namespace sse {
+      SPECTROMETER_SSE
+      inline float offsetCorrect(const uint16_t *raw, int first, int count, float *out, int n) {
+	const float level = scalar::offsetLevel(raw, first, count);
+	const __m128 l = _mm_set1_ps(level);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+	  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(raw + i));
+	  _mm_storeu_ps(out + i, _mm_sub_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(v)), l));
+	  _mm_storeu_ps(out + i + 4, _mm_sub_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8))), l));
+	}
+	for (; i < n; ++i) out[i] = raw[i] - level;
+	return level;
+      }
+
+      SPECTROMETER_SSE
+      inline int argmax(const float *v, int n, float &max) {
+	__m128 best = _mm_set1_ps(-INFINITY);
+	__m128i indices = _mm_setzero_si128(), index = _mm_setr_epi32(0, 1, 2, 3);
+	const __m128i step = _mm_set1_epi32(4);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+	  __m128 x = _mm_loadu_ps(v + i), greater = _mm_cmpgt_ps(x, best);
+	  best = _mm_blendv_ps(best, x, greater);
+	  indices = _mm_blendv_epi8(indices, index, _mm_castps_si128(greater));
+	  index = _mm_add_epi32(index, step);
+	}
+	alignas(16) float b[4];
+	alignas(16) int k[4];
+	_mm_store_ps(b, best);
+	_mm_store_si128(reinterpret_cast<__m128i *>(k), indices);
+	return scalar::argmaxReduce(b, k, 4, v, i, n, max);
+      }
+
+      SPECTROMETER_SSE
+      inline void accumulate(const float *v, float *acc, int n) {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_loadu_ps(v + i)));
+	scalar::accumulate(v + i, acc + i, n - i);
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2
+      inline float offsetCorrect(const uint16_t *raw, int first, int count, float *out, int n) {
+	const float level = scalar::offsetLevel(raw, first, count);
+	const __m256 l = _mm256_set1_ps(level);
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+	  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(raw + i));
+	  __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)));
+	  __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)));
+	  _mm256_storeu_ps(out + i, _mm256_sub_ps(lo, l));
+	  _mm256_storeu_ps(out + i + 8, _mm256_sub_ps(hi, l));
+	}
+	for (; i < n; ++i) out[i] = raw[i] - level;
+	return level;
+      }
+
+      SPECTROMETER_AVX2
+      inline int argmax(const float *v, int n, float &max) {
+	__m256 best = _mm256_set1_ps(-INFINITY);
+	__m256i indices = _mm256_setzero_si256(), index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i step = _mm256_set1_epi32(8);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+	  __m256 x = _mm256_loadu_ps(v + i), greater = _mm256_cmp_ps(x, best, _CMP_GT_OQ);
+	  best = _mm256_blendv_ps(best, x, greater);
+	  indices = _mm256_blendv_epi8(indices, index, _mm256_castps_si256(greater));
+	  index = _mm256_add_epi32(index, step);
+	}
+	alignas(32) float b[8];
+	alignas(32) int k[8];
+	_mm256_store_ps(b, best);
+	_mm256_store_si256(reinterpret_cast<__m256i *>(k), indices);
+	return scalar::argmaxReduce(b, k, 8, v, i, n, max);
+      }
+
+      SPECTROMETER_AVX2
+      inline void accumulate(const float *v, float *acc, int n) {
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	  _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i), _mm256_loadu_ps(v + i)));
+	scalar::accumulate(v + i, acc + i, n - i);
+      }
+    }
+#endif
+
+    inline float offsetCorrect(const uint16_t *raw, int first, int count, float *out, int n) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::offsetCorrect(raw, first, count, out, n);
+      case SSE: return sse::offsetCorrect(raw, first, count, out, n);
+      default: break;
+      }
+#endif
+      return scalar::offsetCorrect(raw, first, count, out, n);
+    }
+
+    inline int argmax(const float *v, int n, float &max) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::argmax(v, n, max);
+      case SSE: return sse::argmax(v, n, max);
+      default: break;
+      }
+#endif
+      return scalar::argmax(v, n, max);
+    }
+
+    inline void accumulate(const float *v, float *acc, int n) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::accumulate(v, acc, n);
+      case SSE: return sse::accumulate(v, acc, n);
+      default: break;
+      }
+#endif
+      scalar::accumulate(v, acc, n);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Incremental PCA. center: u = x - mean, then mean += weight u, returns
+    // |u|^2. dot: x . y. scaleAdd: v = a v + b u, returns |v|^2 and u . v of
+    // the new v. deflate: w = v inv and u -= d w. The vector forms sum in
+    // lanes, so they differ from the scalar one in the last bits.
+    namespace scalar {
+      inline float center(const float *x, float *mean, float weight, float *u, int n) {
+	float sum = 0;
+	for (int i = 0; i < n; ++i) {
+	  u[i] = x[i] - mean[i];
+	  mean[i] += weight * u[i];
+	  sum += u[i] * u[i];
+	}
+	return sum;
+      }
+
+      inline float dot(const float *x, const float *y, int n) {
+	float sum = 0;
+	for (int i = 0; i < n; ++i) sum += x[i] * y[i];
+	return sum;
+      }
+
+      inline void scaleAdd(float a, float *v, float b, const float *u, int n, float &vv, float &uv) {
+	vv = uv = 0;
+	for (int i = 0; i < n; ++i) {
+	  v[i] = a * v[i] + b * u[i];
+	  vv += v[i] * v[i];
+	  uv += u[i] * v[i];
+	}
+      }
+
+      inline void deflate(const float *v, float inv, float d, float *w, float *u, int n) {
+	for (int i = 0; i < n; ++i) {
+	  w[i] = v[i] * inv;
+	  u[i] -= d * w[i];
+	}
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    namespace sse {
+      SPECTROMETER_SSE
+      inline float sum(__m128 s) {
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+      }
+
+      SPECTROMETER_SSE
+      inline float center(const float *x, float *mean, float weight, float *u, int n) {
+	const __m128 w = _mm_set1_ps(weight);
+	__m128 s = _mm_setzero_ps();
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+	  __m128 m = _mm_loadu_ps(mean + i), d = _mm_sub_ps(_mm_loadu_ps(x + i), m);
+	  _mm_storeu_ps(u + i, d);
+	  _mm_storeu_ps(mean + i, _mm_add_ps(m, _mm_mul_ps(w, d)));
+	  s = _mm_add_ps(s, _mm_mul_ps(d, d));
+	}
+	return sum(s) + scalar::center(x + i, mean + i, weight, u + i, n - i);
+      }
+
+      SPECTROMETER_SSE
+      inline float dot(const float *x, const float *y, int n) {
+	__m128 s = _mm_setzero_ps();
+	int i = 0;
+	for (; i + 4 <= n; i += 4) s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+	return sum(s) + scalar::dot(x + i, y + i, n - i);
+      }
+
+      SPECTROMETER_SSE
+      inline void scaleAdd(float a, float *v, float b, const float *u, int n, float &vv, float &uv) {
+	const __m128 va = _mm_set1_ps(a), vb = _mm_set1_ps(b);
+	__m128 sv = _mm_setzero_ps(), su = sv;
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+	  __m128 x = _mm_loadu_ps(u + i);
+	  __m128 y = _mm_add_ps(_mm_mul_ps(va, _mm_loadu_ps(v + i)), _mm_mul_ps(vb, x));
+	  _mm_storeu_ps(v + i, y);
+	  sv = _mm_add_ps(sv, _mm_mul_ps(y, y));
+	  su = _mm_add_ps(su, _mm_mul_ps(x, y));
+	}
+	scalar::scaleAdd(a, v + i, b, u + i, n - i, vv, uv);
+	vv += sum(sv);
+	uv += sum(su);
+      }
+
+      SPECTROMETER_SSE
+      inline void deflate(const float *v, float inv, float d, float *w, float *u, int n) {
+	const __m128 vi = _mm_set1_ps(inv), vd = _mm_set1_ps(d);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+	  __m128 y = _mm_mul_ps(_mm_loadu_ps(v + i), vi);
+	  _mm_storeu_ps(w + i, y);
+	  _mm_storeu_ps(u + i, _mm_sub_ps(_mm_loadu_ps(u + i), _mm_mul_ps(vd, y)));
+	}
+	scalar::deflate(v + i, inv, d, w + i, u + i, n - i);
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2
+      inline float sum(__m256 s) {
+	return sse::sum(_mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1)));
+      }
+
+      SPECTROMETER_AVX2
+      inline float center(const float *x, float *mean, float weight, float *u, int n) {
+	const __m256 w = _mm256_set1_ps(weight);
+	__m256 s = _mm256_setzero_ps();
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+	  __m256 m = _mm256_loadu_ps(mean + i), d = _mm256_sub_ps(_mm256_loadu_ps(x + i), m);
+	  _mm256_storeu_ps(u + i, d);
+	  _mm256_storeu_ps(mean + i, _mm256_fmadd_ps(w, d, m));
+	  s = _mm256_fmadd_ps(d, d, s);
+	}
+	return sum(s) + scalar::center(x + i, mean + i, weight, u + i, n - i);
+      }
+
+      SPECTROMETER_AVX2
+      inline float dot(const float *x, const float *y, int n) {
+	__m256 s = _mm256_setzero_ps();
+	int i = 0;
+	for (; i + 8 <= n; i += 8) s = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), s);
+	return sum(s) + scalar::dot(x + i, y + i, n - i);
+      }
+
+      SPECTROMETER_AVX2
+      inline void scaleAdd(float a, float *v, float b, const float *u, int n, float &vv, float &uv) {
+	const __m256 va = _mm256_set1_ps(a), vb = _mm256_set1_ps(b);
+	__m256 sv = _mm256_setzero_ps(), su = sv;
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+	  __m256 x = _mm256_loadu_ps(u + i);
+	  __m256 y = _mm256_fmadd_ps(va, _mm256_loadu_ps(v + i), _mm256_mul_ps(vb, x));
+	  _mm256_storeu_ps(v + i, y);
+	  sv = _mm256_fmadd_ps(y, y, sv);
+	  su = _mm256_fmadd_ps(x, y, su);
+	}
+	scalar::scaleAdd(a, v + i, b, u + i, n - i, vv, uv);
+	vv += sum(sv);
+	uv += sum(su);
+      }
+
+      SPECTROMETER_AVX2
+      inline void deflate(const float *v, float inv, float d, float *w, float *u, int n) {
+	const __m256 vi = _mm256_set1_ps(inv), vd = _mm256_set1_ps(d);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+	  __m256 y = _mm256_mul_ps(_mm256_loadu_ps(v + i), vi);
+	  _mm256_storeu_ps(w + i, y);
+	  _mm256_storeu_ps(u + i, _mm256_fnmadd_ps(vd, y, _mm256_loadu_ps(u + i)));
+	}
+	scalar::deflate(v + i, inv, d, w + i, u + i, n - i);
+      }
+    }
+#endif
+
+    inline float center(const float *x, float *mean, float weight, float *u, int n) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::center(x, mean, weight, u, n);
+      case SSE: return sse::center(x, mean, weight, u, n);
+      default: break;
+      }
+#endif
+      return scalar::center(x, mean, weight, u, n);
+    }
+
+    inline float dot(const float *x, const float *y, int n) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::dot(x, y, n);
+      case SSE: return sse::dot(x, y, n);
+      default: break;
+      }
+#endif
+      return scalar::dot(x, y, n);
+    }
+
+    inline void scaleAdd(float a, float *v, float b, const float *u, int n, float &vv, float &uv) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::scaleAdd(a, v, b, u, n, vv, uv);
+      case SSE: return sse::scaleAdd(a, v, b, u, n, vv, uv);
+      default: break;
+      }
+#endif
+      scalar::scaleAdd(a, v, b, u, n, vv, uv);
+    }
+
+    inline void deflate(const float *v, float inv, float d, float *w, float *u, int n) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::deflate(v, inv, d, w, u, n);
+      case SSE: return sse::deflate(v, inv, d, w, u, n);
+      default: break;
+      }
+#endif
+      scalar::deflate(v, inv, d, w, u, n);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Blending of resampled spectra: out[j] += scale (wa[j] in[k] + wb[j] in[k+1])
+    // with k = index[j], i.e. linear interpolation with the weights of the
+    // blend folded into wa and wb.
+    namespace scalar {
+      inline void blendLinear(const float *in, const int *index, const float *wa, const float *wb, float scale,
+			      int n, float *out) {
+	for (int j = 0; j < n; ++j)
+	  out[j] += scale * (wa[j] * in[index[j]] + wb[j] * in[index[j] + 1]);
+      }
+    }
+
+#ifdef SPECTROMETER_X86
+    namespace sse {
+      SPECTROMETER_SSE
+      inline void blendLinear(const float *in, const int *index, const float *wa, const float *wb, float scale,
+			      int n, float *out) {
+	const __m128 s = _mm_set1_ps(scale);
+	int j = 0;
+	for (; j + 4 <= n; j += 4) {
+	  const int *k = index + j;
+	  __m128 a = _mm_setr_ps(in[k[0]], in[k[1]], in[k[2]], in[k[3]]);
+	  __m128 b = _mm_setr_ps(in[k[0] + 1], in[k[1] + 1], in[k[2] + 1], in[k[3] + 1]);
+	  __m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(wa + j), a), _mm_mul_ps(_mm_loadu_ps(wb + j), b));
+	  _mm_storeu_ps(out + j, _mm_add_ps(_mm_loadu_ps(out + j), _mm_mul_ps(s, v)));
+	}
+	scalar::blendLinear(in, index + j, wa + j, wb + j, scale, n - j, out + j);
+      }
+    }
+
+    namespace avx2 {
+      SPECTROMETER_AVX2
+      inline void blendLinear(const float *in, const int *index, const float *wa, const float *wb, float scale,
+			      int n, float *out) {
+	const __m256 s = _mm256_set1_ps(scale);
+	int j = 0;
+	for (; j + 8 <= n; j += 8) {
+	  __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index + j));
+	  __m256 a = _mm256_i32gather_ps(in, k, 4), b = _mm256_i32gather_ps(in + 1, k, 4);
+	  __m256 v = _mm256_fmadd_ps(_mm256_loadu_ps(wb + j), b, _mm256_mul_ps(_mm256_loadu_ps(wa + j), a));
+	  _mm256_storeu_ps(out + j, _mm256_fmadd_ps(s, v, _mm256_loadu_ps(out + j)));
+	}
+	scalar::blendLinear(in, index + j, wa + j, wb + j, scale, n - j, out + j);
+      }
+    }
+#endif
+
+    inline void blendLinear(const float *in, const int *index, const float *wa, const float *wb, float scale,
+			    int n, float *out) {
+#ifdef SPECTROMETER_X86
+      switch (activeISA()) {
+      case AVX2: return avx2::blendLinear(in, index, wa, wb, scale, n, out);
+      case SSE: return sse::blendLinear(in, index, wa, wb, scale, n, out);
+      default: break;
+      }
+#endif
+      scalar::blendLinear(in, index, wa, wb, scale, n, out);
+    }
+  }
+}
@@ -3,6 +3,8 @@
 #include <vector>
 
 #include "spectrometer.hpp"
+#include "graph.hpp"
+#include "kernels.hpp"
 
 int main(void)
 {
@@ -18,53 +20,52 @@ int main(void)
   spec->setTriggerMode(spectrometer::usb4k::NORMAL_TRIGGER);
   
   try {
-    std::vector<std::array<uint16_t, spectrometer::usb4kPixelCount>> stack_spec(100);
-    std::array<float, spectrometer::usb4kPixelCount> dark_correct;
     std::array<float, spectrometer::usb4kPixelCount> accumulator;
-
     std::fill(std::begin(accumulator), std::end(accumulator), 0);
     //accumulator.fill(0);
-    
-    for (int i = 0; i < 100; ++i) {
-      //auto raw_data = spec->getRawSpectrum();
-      std::array<uint16_t, spectrometer::usb4kPixelCount> &raw_data = spec->getRawSpectrum();
-    
-      // Optical Black Correction by electric dark pixels
-      uint32_t sum = 0;
-      for (int j : spectrometer::usb4kEdarkIndices) sum += raw_data[j];
-      float edarkness = (float)sum / spectrometer::usb4kEdarkIndices.size();
-      std::cout << "electric darkness: " << edarkness;
-      
-      std::transform(std::begin(raw_data), std::end(raw_data), std::begin(dark_correct),
-		     [edarkness](uint16_t v) -> float { return v - edarkness; });
 
-      // To see a value in peak of raw_data
-      float max_value = *std::max_element(std::begin(dark_correct) + spectrometer::usb4kActivePixelBegin,
-					  std::begin(dark_correct) + spectrometer::usb4kActivePixelEnd);
-      std::cout << ", peak value: " << max_value;
+    spectrometer::processingGraph graph(16);
+
+    // Optical Black Correction by electric dark pixels
+    int edark = graph.addStage("edark", [](spectrometer::graphFrame &frame) {
+	float edarkness = spectrometer::kernels::offsetCorrect(frame.raw, spectrometer::usb4kEdarkIndices.front(),
+							       spectrometer::usb4kEdarkIndices.size(),
+							       frame.spectrum.data(), spectrometer::usb4kPixelCount);
+	frame.values.push_back(edarkness);
+	return true;
+      });
+
+    // Accumulating and reporting, in acquisition order
+    graph.addStage("report", [&accumulator](spectrometer::graphFrame &frame) {
+	std::cout << "electric darkness: " << frame.values[0];
+
+	// To see a value in peak of raw_data
+	const int active = spectrometer::usb4kActivePixelEnd - spectrometer::usb4kActivePixelBegin;
+	float max_value;
+	spectrometer::kernels::argmax(frame.spectrum.data() + spectrometer::usb4kActivePixelBegin, active, max_value);
+	std::cout << ", peak value: " << max_value;
+
+	spectrometer::kernels::accumulate(frame.spectrum.data(), accumulator.data(), spectrometer::usb4kPixelCount);
+
+	// To see a value in peak of accumulator
+	spectrometer::kernels::argmax(accumulator.data() + spectrometer::usb4kActivePixelBegin, active, max_value);
+	std::cout << ", peak value in total: " << max_value;
 
-      // Accumulating raw_data
-      std::transform(std::begin(accumulator), std::end(accumulator),
-		     std::begin(dark_correct), std::begin(accumulator),
-		     std::plus<float>()); //[](float a, float b) -> float { return a + b; });
+	if (spectrometer::findDevice(spectrometer::usb4kVID, spectrometer::usb4kPID, 0)) {
+	  std::cout << ", connection on" << std::endl;
+	} else {
+	  std::cout << ", connection off" << std::endl;
+	}
+	return true;
+      }, edark, spectrometer::processingGraph::ORDERED);
 
-      // To see a value in peak of accumulator
-      max_value = *std::max_element(std::begin(accumulator) + spectrometer::usb4kActivePixelBegin,
-				    std::begin(accumulator) + spectrometer::usb4kActivePixelEnd);
-      std::cout << ", peak value in total: " << max_value;
+    graph.start();
+    graph.run(*spec, 100);
+    graph.stop();
 
-      /* Immutability check
-      stack_spec[i] = raw_data;
-      stack_spec[i][0] = 0;
-      std::cout << stack_spec[i][0] << "vs. " <<  raw_data[0] << std::endl;
-      */
-      if (spectrometer::findDevice(spectrometer::usb4kVID, spectrometer::usb4kPID, 0)) {
-	std::cout << ", connection on" << std::endl;
-      } else {
-	std::cout << ", connection off" << std::endl;
-      }
-      
-    }
+    for (auto &stats : graph.getStats())
+      std::cout << stats.name << ": " << stats.throughput << " frames/s, latency " << stats.meanLatency * 1e3
+		<< " ms mean, " << stats.maxLatency * 1e3 << " ms max" << std::endl;
   } catch (std::runtime_error &e) {
     std::cerr << e.what() << std::endl;
   }
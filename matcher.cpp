@@ -0,0 +1,198 @@
+#include <cmath>
+#include <random>
+#include <chrono>
+#include <algorithm>
+
+#include <omp.h>
+
+#include "matcher.hpp"
+#include "kernels.hpp"
+
+namespace spectrometer {
+
+  spectralMatcher::spectralMatcher(metric m, int from, int to)
+    : kind(m), from(from), n(to - from)
+  {
+    if (from < 0 || to > usb4kPixelCount || n < 2)
+      throw std::out_of_range("Matching range is out of the detector!");
+    stride = (n + 7) / 8 * 8;
+    query.assign(stride, 0.0f);
+  }
+
+  bool spectralMatcher::normalize(const float *spectrum, float *out) const
+  {
+    double mean = 0;
+    if (kind == CORRELATION) {
+      for (int i = 0; i < n; ++i) mean += spectrum[from + i];
+      mean /= n;
+    }
+    double norm = 0;
+    for (int i = 0; i < n; ++i) {
+      double x = spectrum[from + i] - mean;
+      norm += x * x;
+    }
+    if (norm <= 0) return false;
+
+    const double scale = 1.0 / std::sqrt(norm);
+    for (int i = 0; i < n; ++i) out[i] = (spectrum[from + i] - mean) * scale;
+    std::fill(out + n, out + stride, 0.0f);
+    return true;
+  }
+
+  int spectralMatcher::add(const std::string &name, const float *spectrum)
+  {
+    if (entries % 4 == 0) library.resize((entries + 4) * stride, 0.0f);
+    if (!normalize(spectrum, library.data() + entries * stride))
+      throw std::invalid_argument("Reference spectrum is flat!");
+    names.push_back(name);
+    components = 0;
+    return entries++;
+  }
+
+  void spectralMatcher::buildPrefilter(int k, int iterations, int threads)
+  {
+    components = 0;
+    if (k <= 0) return;
+    if (size_t(k) > entries)
+      throw std::invalid_argument("More prefilter components than library entries!");
+    if (k > n)
+      throw std::invalid_argument("More prefilter components than pixels in the matching range!");
+    if (threads <= 0) threads = omp_get_max_threads();
+
+    const int rows = (k + 3) / 4 * 4;
+    basis.assign(rows * stride, 0.0f);
+    std::mt19937 rng(1);
+    std::normal_distribution<float> gauss;
+    for (int c = 0; c < k; ++c)
+      for (int i = 0; i < n; ++i) basis[c * stride + i] = gauss(rng);
+
+    std::vector<float> w(entries * rows);
+    std::vector<double> next(size_t(k) * stride);
+    for (int it = 0; it <= iterations; ++it) {
+      // Gram-Schmidt on the current directions, done twice for orthogonality to
+      // working precision; a direction outside the span of the library is dropped
+      for (int c = 0; c < k; ++c) {
+	double *v = &next[c * stride];
+	if (it == 0) for (int i = 0; i < n; ++i) v[i] = basis[c * stride + i];
+	double before = 0;
+	for (int i = 0; i < n; ++i) before += v[i] * v[i];
+	for (int pass = 0; pass < 2; ++pass)
+	  for (int p = 0; p < c; ++p) {
+	    const double *u = &next[p * stride];
+	    double d = 0;
+	    for (int i = 0; i < n; ++i) d += v[i] * u[i];
+	    for (int i = 0; i < n; ++i) v[i] -= d * u[i];
+	  }
+	double norm = 0;
+	for (int i = 0; i < n; ++i) norm += v[i] * v[i];
+	const double scale = norm > 1e-12 * before ? 1.0 / std::sqrt(norm) : 0.0;
+	for (int i = 0; i < n; ++i) basis[c * stride + i] = v[i] *= scale;
+      }
+      if (it == iterations) break;
+
+      // w = L V^T, then V = w^T L
+#pragma omp parallel for num_threads(threads) schedule(static)
+      for (size_t e = 0; e < entries; ++e)
+	for (int c = 0; c < rows; c += 4)
+	  kernels::dot4(library.data() + e * stride, basis.data() + c * stride, stride, n, &w[e * rows + c]);
+
+#pragma omp parallel for num_threads(threads) schedule(static)
+      for (int i0 = 0; i0 < n; i0 += 64) {
+	const int i1 = std::min(n, i0 + 64);
+	for (int c = 0; c < k; ++c) std::fill(&next[c * stride + i0], &next[c * stride + i1], 0.0);
+	for (size_t e = 0; e < entries; ++e) {
+	  const float *row = library.data() + e * stride;
+	  for (int c = 0; c < k; ++c) {
+	    const double we = w[e * rows + c];
+	    double *v = &next[c * stride];
+	    for (int i = i0; i < i1; ++i) v[i] += we * row[i];
+	  }
+	}
+      }
+    }
+
+    reduced.assign(entries * k, 0.0f);
+    residual.assign(entries, 0.0f);
+    std::vector<float> dots(rows);
+    for (size_t e = 0; e < entries; ++e) {
+      for (int c = 0; c < rows; c += 4)
+	kernels::dot4(library.data() + e * stride, basis.data() + c * stride, stride, n, &dots[c]);
+      double captured = 0;
+      for (int c = 0; c < k; ++c) {
+	reduced[e * k + c] = dots[c];
+	captured += double(dots[c]) * dots[c];
+      }
+      // rounding margin, the bound has to stay conservative
+      residual[e] = std::sqrt(std::max(0.0, 1.0 - captured)) + 1e-3f;
+    }
+    components = k;
+  }
+
+  void spectralMatcher::scoreBlocks(int threads, bool all)
+  {
+    const int blockCount = (entries + 3) / 4;
+    scores.resize(blockCount * 4);
+#pragma omp parallel for num_threads(threads) schedule(static)
+    for (int b = 0; b < blockCount; ++b)
+      if (all || blocks[b])
+	kernels::dot4(query.data(), library.data() + size_t(b) * 4 * stride, stride, n, &scores[b * 4]);
+  }
+
+  std::vector<libraryMatch> spectralMatcher::find(const float *spectrum, int k, int threads)
+  {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<libraryMatch> best;
+    k = std::min<int>(k, entries);
+    if (k <= 0 || !normalize(spectrum, query.data())) {
+      stats.latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      stats.candidates = 0;
+      return best;
+    }
+    if (threads <= 0) threads = omp_get_max_threads();
+
+    const int blockCount = (entries + 3) / 4;
+    blocks.assign(blockCount, 0);
+    if (components > 0) {
+      const int rows = (components + 3) / 4 * 4;
+      std::vector<float> q(rows);
+      for (int c = 0; c < rows; c += 4)
+	kernels::dot4(query.data(), basis.data() + c * stride, stride, n, &q[c]);
+      double captured = 0;
+      for (int c = 0; c < components; ++c) captured += double(q[c]) * q[c];
+      const float rq = std::sqrt(std::max(0.0, 1.0 - captured)) + 1e-3f;
+
+      lower.resize(entries);
+      upper.resize(entries);
+      for (size_t e = 0; e < entries; ++e) {
+	const float *r = &reduced[e * components];
+	float d = 0;
+	for (int c = 0; c < components; ++c) d += r[c] * q[c];
+	lower[e] = d - rq * residual[e];
+	upper[e] = d + rq * residual[e];
+      }
+      // the k-th best lower bound; anything that can not beat it is out
+      sorted.assign(lower.begin(), lower.end());
+      std::nth_element(sorted.begin(), sorted.begin() + (k - 1), sorted.end(), std::greater<float>());
+      const float threshold = sorted[k - 1];
+      for (size_t e = 0; e < entries; ++e)
+	if (upper[e] >= threshold) blocks[e / 4] = 1;
+      scoreBlocks(threads, false);
+    } else {
+      scoreBlocks(threads, true);
+    }
+
+    for (size_t e = 0; e < entries; ++e)
+      if (blocks[e / 4] || components == 0) best.push_back({ int(e), scores[e] });
+    stats.candidates = best.size();
+
+    std::partial_sort(best.begin(), best.begin() + k, best.end(),
+		      [](const libraryMatch &a, const libraryMatch &b) { return a.score > b.score; });
+    best.resize(k);
+    if (kind == SAM)
+      for (auto &m : best) m.score = std::acos(std::max(-1.0f, std::min(1.0f, m.score)));
+
+    stats.latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return best;
+  }
+
+}
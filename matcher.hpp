@@ -0,0 +1,115 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <new>
+
+#include "spectrometer.hpp"
+
+namespace spectrometer {
+  // Cache line aligned storage, so that library rows start on a vector boundary
+  template <typename T>
+  struct alignedAllocator {
+    typedef T value_type;
+    alignedAllocator(void) = default;
+    template <typename U> alignedAllocator(const alignedAllocator<U>&) {}
+    T* allocate(size_t n) {
+      void *p = std::aligned_alloc(64, (n * sizeof(T) + 63) / 64 * 64);
+      if (!p) throw std::bad_alloc();
+      return static_cast<T *>(p);
+    }
+    void deallocate(T *p, size_t) { std::free(p); }
+    template <typename U> bool operator==(const alignedAllocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const alignedAllocator<U>&) const { return false; }
+  };
+
+  struct libraryMatch {
+    int index;
+    float score; // cosine or correlation (higher is better), or SAM angle in radians (lower is better)
+  };
+
+  struct matchStats {
+    double latency;    // [s] of the last find()
+    size_t candidates; // library entries scored in full
+  };
+
+  /*
+    Matches spectra against a library of references over the pixels [from, to).
+
+    Entries are normalized once when added (unit norm, and zero mean for the
+    correlation) and kept as one aligned row each, padded to a multiple of 8
+    floats, in blocks of 4 rows. Per frame the query gets the same
+    normalization and every score is a dot product, computed 4 rows at a time
+    by kernels::dot4 with the blocks spread over the OpenMP threads. SAM is the
+    arc cosine of the cosine, so all metrics rank by the same dot product.
+
+    The rows stay row-major rather than interleaved pixel by pixel
+    (structure of arrays): dot4 already loads each chunk of the query once
+    for the 4 rows of a block and streams them as 4 sequential runs, so
+    interleaving would save no loads, while whole rows are what add()
+    appends in place, what the prefilter projects one at a time, and what
+    the same kernel reads for the components of streamingPCA.
+
+    buildPrefilter() projects the library on its leading principal directions.
+    With unit rows, |dot - reduced dot| <= |query residual| * |entry residual|,
+    so the reduced scores give bounds that prune entries which can not reach
+    the top k without changing the result; only blocks holding a surviving
+    entry are scored in full.
+  */
+  class spectralMatcher {
+  public:
+    enum metric {
+      COSINE,
+      CORRELATION,
+      SAM
+    };
+
+  private:
+    typedef std::vector<float, alignedAllocator<float>> alignedVector;
+
+    metric kind;
+    int from, n;
+    size_t stride;
+    size_t entries = 0;
+    alignedVector library; // entries rounded up to 4 rows of stride floats
+    std::vector<std::string> names;
+
+    int components = 0;
+    alignedVector basis;           // components rounded up to 4 rows of stride floats
+    std::vector<float> reduced;    // entries x components
+    std::vector<float> residual;   // per entry
+    alignedVector query;
+    std::vector<float> scores;
+    std::vector<float> lower, upper, sorted; // reduced score bounds
+    std::vector<char> blocks;
+    matchStats stats = { 0, 0 };
+
+    bool normalize(const float *spectrum, float *out) const;
+    void scoreBlocks(int threads, bool all);
+
+  public:
+    spectralMatcher(metric m=COSINE, int from=usb4kActivePixelBegin, int to=usb4kActivePixelEnd);
+
+    // Returns the index of the entry; invalidates the prefilter
+    int add(const std::string &name, const float *spectrum);
+    int add(const std::string &name, const std::array<float, usb4kPixelCount> &spectrum) {
+      return add(name, spectrum.data());
+    }
+
+    size_t size(void) const { return entries; }
+    const std::string& getName(int index) const { return names.at(index); }
+
+    // Subspace iteration for the leading principal directions; 0 disables the prefilter
+    void buildPrefilter(int components, int iterations=20, int threads=0);
+    int prefilterComponents(void) const { return components; }
+
+    // Best k matches, best first; threads <= 0 leaves the OpenMP default
+    std::vector<libraryMatch> find(const float *spectrum, int k, int threads=0);
+    std::vector<libraryMatch> find(const std::array<float, usb4kPixelCount> &spectrum, int k, int threads=0) {
+      return find(spectrum.data(), k, threads);
+    }
+
+    const matchStats& getLastStats(void) const { return stats; }
+  };
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include "spectrometer.hpp"
+#include "kernels.hpp"
+#include "matcher.hpp"
+
+namespace spectrometer {
+  constexpr int pcaMaxComponents = 16;
+
+  // One frame reduced to its scores on the principal components
+  struct pcaScores {
+    uint64_t index;       // of the frame
+    int64_t timestamp;    // of the frame
+    uint32_t components;
+    float residual;       // squared distance to the component subspace (Q statistic)
+    float t2;             // Hotelling's T^2, the scores over the component variances
+    float scores[pcaMaxComponents];
+  };
+
+  /*
+    Principal components of a spectrum stream, learned while it runs, by
+    candid covariance-free incremental PCA (CCIPCA, Weng et al. 2003) over
+    the pixels [from, to).
+
+    Per frame the mean is updated, the centered frame is scored on the
+    current components, 4 at a time by kernels::dot4, and only then learned:
+    component i moves towards the frame's residual after components 0..i-1
+    (kernels::dot, scaleAdd and deflate) and is kept orthogonal to them, so
+    the components converge to the leading eigenvectors of the covariance,
+    in order, with their variances as the lengths. Nothing of size pixels x
+    pixels is ever formed; a frame costs a few passes over the pixels per
+    component.
+
+    The mean and the components average over all frames until 1/forgetting
+    frames are seen and from then on forget exponentially with that weight,
+    so they follow drift. The sign of a component is arbitrary but stays.
+
+    The scores are the low-bandwidth output: push() returns them, and they
+    go into a ring of slots that readers on other threads drain with next(),
+    each with its own cursor. The producer never waits; a reader that falls
+    more than the ring behind loses the overwritten scores, as with shm.hpp.
+  */
+  class streamingPCA {
+  private:
+    typedef std::vector<float, alignedAllocator<float>> alignedVector;
+
+    struct alignas(64) slot {
+      // seqlock: odd while the slot is being written, 2*(n+1) once scores n are complete
+      std::atomic<uint64_t> sequence{0};
+      pcaScores scores;
+    };
+
+    int from, n, k, rows;
+    size_t stride;
+    float forgetting;
+    uint64_t count = 0;
+    float variance = 0;         // total, of the centered frames
+    alignedVector mean, centered;
+    alignedVector vectors;      // k rows of stride floats, the unnormalized components
+    alignedVector basis;        // rows (k rounded up to 4) of stride floats, the unit components
+    std::vector<float> lengths; // of vectors, the component variances
+    std::vector<float> projection;
+    pcaScores current;
+
+    std::unique_ptr<slot[]> ring;
+    uint32_t slotCount;
+    std::atomic<uint64_t> published{0};
+
+    // CCIPCA step with the samples-th centered frame; component c gets its first sample at c+1
+    void learn(uint64_t samples) {
+      for (int c = 0; c < k && uint64_t(c) < samples; ++c) {
+	float *v = &vectors[c * stride], *w = &basis[c * stride];
+	float a, b;
+	if (samples > uint64_t(c) + 1) {
+	  const float rate = std::max(1.0f / (samples - c), forgetting);
+	  a = 1 - rate;
+	  b = rate * kernels::dot(centered.data(), w, n);
+	} else {
+	  // the first sample starts the component, scaled as if by its own score
+	  a = 0;
+	  b = std::sqrt(kernels::dot(centered.data(), centered.data(), n));
+	}
+	float vv, uv, ignored;
+	kernels::scaleAdd(a, v, b, centered.data(), n, vv, uv);
+	// Gram-Schmidt against the components before, which the weaker ones drift towards
+	// otherwise; the residual is orthogonal to them already, so uv stays
+	for (int j = 0; j < c; ++j) {
+	  const float *u = &basis[j * stride];
+	  kernels::scaleAdd(1, v, -kernels::dot(v, u, n), u, n, vv, ignored);
+	}
+	if (!(vv > 0)) continue;
+	const float length = std::sqrt(vv);
+	lengths[c] = length;
+	kernels::deflate(v, 1 / length, uv / length, w, centered.data(), n);
+      }
+    }
+
+    void publish(void) {
+      uint64_t p = published.load(std::memory_order_relaxed);
+      slot &s = ring[p % slotCount];
+      s.sequence.store(2*p + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      s.scores = current;
+      s.sequence.store(2*p + 2, std::memory_order_release);
+      published.store(p + 1, std::memory_order_release);
+    }
+
+  public:
+    streamingPCA(int components=4, float forgetting_weight=1e-3f, int pixel_from=usb4kActivePixelBegin,
+		 int pixel_to=usb4kActivePixelEnd, uint32_t slot_count=1024)
+      : from(pixel_from), n(pixel_to - pixel_from), k(components), forgetting(forgetting_weight),
+	slotCount(slot_count) {
+      if (pixel_from < 0 || pixel_to > usb4kPixelCount || pixel_from >= pixel_to)
+	throw std::out_of_range("PCA pixel range Out of range!");
+      if (components < 1 || components > pcaMaxComponents || components > n)
+	throw std::invalid_argument("PCA needs between one and pcaMaxComponents components!");
+      if (!(forgetting_weight > 0 && forgetting_weight <= 1))
+	throw std::invalid_argument("PCA forgetting weight must be in (0, 1]!");
+      if (slot_count < 1)
+	throw std::invalid_argument("PCA needs at least one slot for the scores!");
+
+      rows = (k + 3) / 4 * 4;
+      stride = (n + 7) / 8 * 8;
+      mean.resize(stride);
+      centered.resize(stride);
+      vectors.resize(k * stride);
+      basis.resize(rows * stride);
+      lengths.resize(k);
+      projection.resize(rows);
+      ring.reset(new slot[slotCount]);
+      clear();
+    }
+
+    // Forgets everything learned; the scores published so far stay readable
+    void clear(void) {
+      count = 0;
+      variance = 0;
+      std::fill(mean.begin(), mean.end(), 0.0f);
+      std::fill(vectors.begin(), vectors.end(), 0.0f);
+      std::fill(basis.begin(), basis.end(), 0.0f);
+      std::fill(lengths.begin(), lengths.end(), 0.0f);
+    }
+
+    // spectrum: all usb4kPixelCount pixels, e.g. dark corrected
+    const pcaScores& push(const frameMetadata &meta, const float *spectrum) {
+      ++count;
+      const float weight = std::max(1.0f / count, forgetting);
+      const float uu = kernels::center(spectrum + from, mean.data(), weight, centered.data(), n);
+
+      current.index = meta.index;
+      current.timestamp = meta.timestamp;
+      current.components = k;
+      current.residual = current.t2 = 0;
+      std::fill(current.scores, current.scores + pcaMaxComponents, 0.0f);
+
+      // the first frame only sets the mean
+      if (count > 1) {
+	variance += weight * (uu - variance);
+	for (int c = 0; c < rows; c += 4)
+	  kernels::dot4(centered.data(), basis.data() + c * stride, stride, n, &projection[c]);
+	float captured = 0;
+	for (int c = 0; c < k; ++c) {
+	  current.scores[c] = projection[c];
+	  captured += projection[c] * projection[c];
+	  if (lengths[c] > 0) current.t2 += projection[c] * projection[c] / lengths[c];
+	}
+	current.residual = std::max(0.0f, uu - captured);
+	learn(count - 1);
+      }
+      publish();
+      return current;
+    }
+
+    /*
+      Copies the scores at cursor and advances it, false if there are none yet.
+      A cursor lapped by the producer jumps to the oldest scores still in the
+      ring; out.index shows the gap. Start at 0, or at getPublished() to skip
+      what came before.
+    */
+    bool next(uint64_t &cursor, pcaScores &out) const {
+      while (true) {
+	uint64_t head = published.load(std::memory_order_acquire);
+	if (cursor >= head) return false;
+	if (head - cursor > slotCount) cursor = head - slotCount;
+	const slot &s = ring[cursor % slotCount];
+	uint64_t before = s.sequence.load(std::memory_order_acquire);
+	if (before == 2*cursor + 2) {
+	  out = s.scores;
+	  std::atomic_thread_fence(std::memory_order_acquire);
+	  if (s.sequence.load(std::memory_order_relaxed) == before) { ++cursor; return true; }
+	}
+	++cursor; // overwritten meanwhile
+      }
+    }
+
+    uint64_t getPublished(void) const { return published.load(std::memory_order_relaxed); }
+    uint64_t size(void) const { return count; }
+    int getComponents(void) const { return k; }
+    int getPixelFrom(void) const { return from; }
+    int getPixelTo(void) const { return from + n; }
+    // to - from values each
+    const float* getMean(void) const { return mean.data(); }
+    const float* getComponent(int c) const { return basis.data() + c * stride; }
+    // Variance along each component [counts^2]
+    const float* getVariances(void) const { return lengths.data(); }
+    // Fraction of the total variance along the components
+    float explained(void) const {
+      float sum = 0;
+      for (float l : lengths) sum += l;
+      return variance > 0 ? std::min(1.0f, sum / variance) : 0.0f;
+    }
+  };
+}
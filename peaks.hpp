@@ -0,0 +1,168 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "spectrometer.hpp"
+#include "kernels.hpp"
+
+namespace spectrometer {
+  struct peak {
+    float pixel;      // sub-pixel position
+    float wavelength; // [nm]
+    float height;
+    float prominence;
+  };
+
+  /*
+    Peak search over a corrected spectrum within [begin, end).
+
+    Candidates are the local maxima above the threshold, found with the
+    vectorized kernel: a pixel above its left neighbour and not below its
+    right one, so a flat top (a saturated line) counts once, at its first
+    pixel. Each one is then kept if it rises at least `prominence`
+    above the higher of its two bases, the minima reached walking outwards
+    until a higher sample or `window` pixels. The position is refined to a
+    sub-pixel one and mapped to nm on the device calibration.
+  */
+  class peakFinder {
+  public:
+    enum fit_method {
+      CENTROID = 0,
+      PARABOLIC = 1,
+      GAUSSIAN = 2
+    };
+
+  private:
+    const std::array<float, usb4kPixelCount> &wavelengths;
+    float threshold;
+    float prominence;
+    int window;
+    fit_method method;
+    int begin, end;
+
+    std::vector<int> candidates;
+    std::vector<peak> peaks;
+
+    // i is a local maximum of v[0, n), so both of its neighbours exist
+    float refine(const float *v, int i, int n) const {
+      float a = v[i-1], b = v[i], c = v[i+1];
+      switch (method) {
+      case GAUSSIAN:
+	if (a > 0 && b > 0 && c > 0) {
+	  a = std::log(a), b = std::log(b), c = std::log(c);
+	} else break;
+	// fall through
+      case PARABOLIC: {
+	float denom = a - 2*b + c;
+	return denom < 0 ? i + 0.5f*(a - c)/denom : float(i);
+      }
+      case CENTROID: {
+	int lo = std::max(0, i - 2), hi = std::min(n - 1, i + 2);
+	float base = *std::min_element(v + lo, v + hi + 1);
+	float sum = 0, moment = 0;
+	for (int j = lo; j <= hi; ++j) { sum += v[j] - base; moment += j*(v[j] - base); }
+	return sum > 0 ? moment / sum : float(i);
+      }
+      }
+
+      float denom = v[i-1] - 2*v[i] + v[i+1];
+      return denom < 0 ? i + 0.5f*(v[i-1] - v[i+1])/denom : float(i);
+    }
+
+    float toWavelength(float pixel) const {
+      int i = std::min(std::max(int(pixel), 0), usb4kPixelCount - 2);
+      float frac = pixel - i;
+      return wavelengths[i] + frac*(wavelengths[i+1] - wavelengths[i]);
+    }
+
+  public:
+    peakFinder(const std::array<float, usb4kPixelCount> &wl, float thr, float prom, int win=16,
+	       fit_method fit=PARABOLIC, int from=usb4kActivePixelBegin, int to=usb4kActivePixelEnd)
+      : wavelengths(wl), threshold(thr), prominence(prom), window(win), method(fit), begin(from), end(to) {
+      if (begin < 0 || end > usb4kPixelCount || end - begin < 3)
+	throw std::out_of_range("Peak search range Out of the pixels!");
+      candidates.resize(end - begin);
+      peaks.reserve(256);
+    }
+
+    const std::vector<peak>& find(const float *spectrum) {
+      const float *v = spectrum + begin;
+      int n = end - begin;
+      int count = kernels::localMaxima(v, threshold, candidates.data(), n);
+
+      peaks.clear();
+      for (int k = 0; k < count; ++k) {
+	int i = candidates[k];
+	float height = v[i];
+
+	float left = height;
+	for (int j = i - 1; j >= 0 && j >= i - window && v[j] <= height; --j) left = std::min(left, v[j]);
+	float right = height;
+	for (int j = i + 1; j < n && j <= i + window && v[j] <= height; ++j) right = std::min(right, v[j]);
+
+	float prom = height - std::max(left, right);
+	if (prom < prominence) continue;
+
+	float pixel = begin + refine(v, i, n);
+	peaks.push_back(peak{ pixel, toWavelength(pixel), height, prom });
+      }
+
+      return peaks;
+    }
+
+    const std::vector<peak>& find(const std::array<float, usb4kPixelCount> &spectrum) { return find(spectrum.data()); }
+  };
+
+  /*
+    Follows known emission lines from frame to frame: every line takes the
+    nearest peak within `tolerance` nm of where it was last seen.
+  */
+  class lineTracker {
+  public:
+    struct line {
+      float nominal;    // [nm]
+      float wavelength; // last position [nm]
+      float height;
+      int missed;       // consecutive frames without a match
+    };
+
+  private:
+    float tolerance;
+    std::vector<line> lines;
+
+  public:
+    lineTracker(float tol) : tolerance(tol) {}
+
+    void addLine(float nm) {
+      lines.push_back(line{ nm, nm, 0, 0 });
+    }
+
+    // peaks must be in ascending wavelength, as peakFinder returns them
+    void update(const std::vector<peak> &peaks) {
+      for (auto &l : lines) {
+	auto it = std::lower_bound(peaks.begin(), peaks.end(), l.wavelength,
+				   [](const peak &p, float nm) { return p.wavelength < nm; });
+	const peak *best = NULL;
+	float distance = tolerance;
+	if (it != peaks.end() && std::fabs(it->wavelength - l.wavelength) <= distance) {
+	  best = &*it;
+	  distance = std::fabs(it->wavelength - l.wavelength);
+	}
+	if (it != peaks.begin() && std::fabs(std::prev(it)->wavelength - l.wavelength) <= distance)
+	  best = &*std::prev(it);
+
+	if (best) {
+	  l.wavelength = best->wavelength;
+	  l.height = best->height;
+	  l.missed = 0;
+	} else {
+	  ++l.missed;
+	}
+      }
+    }
+
+    const std::vector<line>& getLines(void) const { return lines; }
+  };
+}
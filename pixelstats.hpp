@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "spectrometer.hpp"
+#include "kernels.hpp"
+
+namespace spectrometer {
+  /*
+    Streaming per-pixel statistics of raw frames for detector characterization:
+    mean and variance by Welford's update in double, minimum, maximum and the
+    number of frames at or above saturation. Memory is fixed whatever the
+    frame count, and a frame costs one kernels::welford pass over the pixels,
+    so one instance per device keeps pace with the full frame rate. Instances
+    fed from different threads or devices are combined with merge().
+
+    The derived maps are computed on demand. Their reference levels are robust
+    (median, and 1.4826 times the median absolute deviation) over the active
+    pixels, so a few defects do not shift them:
+     - defectMask() flags HOT pixels whose mean lies sigma deviations above
+       the others, NOISY ones whose temporal deviation does so, and pixels
+       SATURATED in any frame.
+     - fixedPattern() is each pixel's mean minus the median of the means, the
+       fixed pattern noise map of dark frames, and fixedPatternNoise() its
+       spread.
+  */
+  class pixelStatistics {
+  public:
+    enum defect : uint8_t {
+      HOT = 1,
+      NOISY = 2,
+      SATURATED = 4
+    };
+
+  private:
+    uint16_t saturationLevel;
+    uint64_t count = 0;
+    std::array<double, usb4kPixelCount> mean;
+    std::array<double, usb4kPixelCount> m2;
+    std::array<uint16_t, usb4kPixelCount> minimum;
+    std::array<uint16_t, usb4kPixelCount> maximum;
+    std::array<uint32_t, usb4kPixelCount> saturated;
+
+    // median and MAD based standard deviation of the active pixels
+    static void robust(const double *values, double &median, double &sigma) {
+      std::vector<double> v(values + usb4kActivePixelBegin, values + usb4kActivePixelEnd);
+      auto middle = v.begin() + v.size() / 2;
+      std::nth_element(v.begin(), middle, v.end());
+      median = *middle;
+      for (double &x : v) x = std::fabs(x - median);
+      std::nth_element(v.begin(), middle, v.end());
+      sigma = 1.4826 * *middle;
+    }
+
+  public:
+    pixelStatistics(uint16_t saturation=usb4kSaturationLevel) : saturationLevel(saturation) { clear(); }
+
+    void clear(void) {
+      count = 0;
+      mean.fill(0);
+      m2.fill(0);
+      minimum.fill(0xffff);
+      maximum.fill(0);
+      saturated.fill(0);
+    }
+
+    void add(const uint16_t *raw) {
+      ++count;
+      kernels::welford(raw, 1.0 / count, saturationLevel, mean.data(), m2.data(),
+		       minimum.data(), maximum.data(), saturated.data(), usb4kPixelCount);
+    }
+    // As the sink of an acquisitionThread or a processingGraph stage
+    void add(const frameMetadata &meta, const uint16_t *raw) { add(raw); }
+
+    // Chan et al.'s pairwise combination, as if every frame of other had been added here
+    void merge(const pixelStatistics &other) {
+      if (other.count == 0) return;
+      if (count == 0) { *this = other; return; }
+      const double n = count + other.count, weight = other.count / n, cross = double(count) * other.count / n;
+      for (int i = 0; i < usb4kPixelCount; ++i) {
+	double d = other.mean[i] - mean[i];
+	mean[i] += d * weight;
+	m2[i] += other.m2[i] + d * d * cross;
+	minimum[i] = std::min(minimum[i], other.minimum[i]);
+	maximum[i] = std::max(maximum[i], other.maximum[i]);
+	saturated[i] += other.saturated[i];
+      }
+      count += other.count;
+    }
+
+    uint64_t size(void) const { return count; }
+    const double* getMean(void) const { return mean.data(); }
+    const uint16_t* getMinimum(void) const { return minimum.data(); }
+    const uint16_t* getMaximum(void) const { return maximum.data(); }
+    const uint32_t* getSaturated(void) const { return saturated.data(); }
+
+    // Sample variance [counts^2], 0 below two frames
+    double variance(int pixel) const { return count > 1 ? m2[pixel] / (count - 1) : 0.0; }
+    void getVariance(double *out) const {
+      for (int i = 0; i < usb4kPixelCount; ++i) out[i] = variance(i);
+    }
+    void getDeviation(double *out) const {
+      for (int i = 0; i < usb4kPixelCount; ++i) out[i] = std::sqrt(variance(i));
+    }
+
+    std::vector<uint8_t> defectMask(double sigma=6.0) const {
+      if (count < 2)
+	throw std::runtime_error("Defects need the statistics of at least two frames!");
+      std::vector<double> deviation(usb4kPixelCount);
+      getDeviation(deviation.data());
+      double meanLevel, meanSpread, noiseLevel, noiseSpread;
+      robust(mean.data(), meanLevel, meanSpread);
+      robust(deviation.data(), noiseLevel, noiseSpread);
+
+      std::vector<uint8_t> mask(usb4kPixelCount, 0);
+      for (int i = 0; i < usb4kPixelCount; ++i) {
+	if (mean[i] > meanLevel + sigma * meanSpread) mask[i] |= HOT;
+	if (deviation[i] > noiseLevel + sigma * noiseSpread) mask[i] |= NOISY;
+	if (saturated[i]) mask[i] |= SATURATED;
+      }
+      return mask;
+    }
+
+    void fixedPattern(float *out) const {
+      double level, spread;
+      robust(mean.data(), level, spread);
+      for (int i = 0; i < usb4kPixelCount; ++i) out[i] = mean[i] - level;
+    }
+    // Robust standard deviation of the means over the active pixels [counts]
+    double fixedPatternNoise(void) const {
+      double level, spread;
+      robust(mean.data(), level, spread);
+      return spread;
+    }
+    // Median of the temporal deviations of the active pixels [counts]
+    double temporalNoise(void) const {
+      std::vector<double> deviation(usb4kPixelCount);
+      getDeviation(deviation.data());
+      double level, spread;
+      robust(deviation.data(), level, spread);
+      return level;
+    }
+  };
+}
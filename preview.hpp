@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#include "spectrometer.hpp"
+#include "kernels.hpp"
+#include "timing.hpp"
+
+namespace spectrometer {
+  // A min/max envelope of the frames since the previous preview, one pair per column
+  struct previewFrame {
+    uint64_t firstIndex, lastIndex; // of the frames aggregated
+    int64_t timestamp;              // of the last frame
+    uint32_t frames;                // aggregated
+    std::vector<uint16_t> low, high;
+  };
+
+  /*
+    Preview tap on a frame stream for displays: columns min/max pairs at most
+    rate times per second instead of every full frame.
+
+    push() only folds the frame into a per-pixel min/max envelope
+    (kernels::minMaxAccumulate); when a tick is due, the envelope is reduced
+    to the columns (kernels::decimateMinMax), published and started over. So
+    every frame between two previews is in the next one and a one-frame spike
+    on one pixel still shows as a column maximum. The frame stream never
+    waits: the previews go through a triple buffer, where the producer always
+    has a buffer of its own and the reader takes the newest complete one.
+
+    The column edges split [from, to) as evenly as possible, see
+    getColumnEdges(). latest() is for one reader thread.
+  */
+  class previewTap {
+  private:
+    int from, to, columns;
+    int64_t period; // [ns] between previews
+    int64_t nextTick = 0;
+    std::vector<int> edges;
+    // padded for the whole-vector reads of decimateMinMax
+    std::vector<uint16_t> low, high;
+    uint32_t aggregated = 0;
+    uint64_t firstIndex = 0, lastIndex = 0;
+    int64_t lastTimestamp = 0;
+    std::atomic<uint64_t> published{0};
+
+    static constexpr int FRESH = 4;
+    previewFrame buffers[3];
+    int back = 0, front = 2;
+    std::atomic<int> middle{1};
+
+    void reset(void) {
+      std::fill(low.begin(), low.end(), 0xffff);
+      std::fill(high.begin(), high.end(), 0);
+      aggregated = 0;
+    }
+
+  public:
+    previewTap(int preview_columns=512, double max_rate=30.0, int pixel_from=0, int pixel_to=usb4kPixelCount)
+      : from(pixel_from), to(pixel_to), columns(preview_columns) {
+      if (from < 0 || to > usb4kPixelCount || from >= to)
+	throw std::out_of_range("Preview pixel range Out of range!");
+      if (columns < 1 || columns > to - from)
+	throw std::invalid_argument("Preview needs between one column and one per pixel!");
+      if (max_rate <= 0)
+	throw std::invalid_argument("Preview rate must be positive!");
+      period = int64_t(1e9 / max_rate);
+
+      for (int c = 0; c <= columns; ++c) edges.push_back(from + int64_t(c) * (to - from) / columns);
+      low.resize(usb4kPixelCount + 16);
+      high.resize(usb4kPixelCount + 16);
+      for (auto &b : buffers) {
+	b.low.resize(columns);
+	b.high.resize(columns);
+      }
+      reset();
+    }
+
+    // now: CLOCK_MONOTONIC [ns] deciding the ticks
+    void push(const frameMetadata &meta, const uint16_t *raw, int64_t now) {
+      kernels::minMaxAccumulate(raw + from, low.data() + from, high.data() + from, to - from);
+      if (aggregated++ == 0) firstIndex = meta.index;
+      lastIndex = meta.index;
+      lastTimestamp = meta.timestamp;
+
+      if (now >= nextTick) {
+	flush();
+	nextTick += period;
+	if (nextTick <= now) nextTick = now + period;
+      }
+    }
+    // As the sink of an acquisitionThread
+    void push(const frameMetadata &meta, const uint16_t *raw) { push(meta, raw, monotonicNow()); }
+
+    // Publishes the frames aggregated so far, e.g. at the end of the stream
+    void flush(void) {
+      if (aggregated == 0) return;
+      previewFrame &p = buffers[back];
+      kernels::decimateMinMax(low.data(), high.data(), edges.data(), columns, p.low.data(), p.high.data());
+      p.firstIndex = firstIndex;
+      p.lastIndex = lastIndex;
+      p.timestamp = lastTimestamp;
+      p.frames = aggregated;
+      back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+      published.fetch_add(1, std::memory_order_relaxed);
+      reset();
+    }
+
+    // The newest preview not seen yet, NULL if there is none. Stays valid until the next call.
+    const previewFrame* latest(void) {
+      if (!(middle.load(std::memory_order_relaxed) & FRESH)) return NULL;
+      front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+      return &buffers[front];
+    }
+
+    // Column c covers the pixels [edges[c], edges[c+1])
+    const std::vector<int>& getColumnEdges(void) const { return edges; }
+    int getColumns(void) const { return columns; }
+    // Previews published by the producer
+    uint64_t getPublished(void) const { return published.load(std::memory_order_relaxed); }
+  };
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cmath>
+
+#include "spectrometer.hpp"
+#include "kernels.hpp"
+
+namespace spectrometer {
+  /*
+    Ratio measurements against a stored reference, (S - D) / (R - D), output
+    as transmittance, absorbance -log10(T), or reflectance (the ratio scaled
+    by the reflectance of the white standard).
+
+    The dark D and the reference R are averaged over a few frames at the
+    integration time in use and 1 / (R - D) is kept, so a frame costs one
+    subtraction, one multiplication and, for absorbance, one kernels::log10
+    per pixel. S - D and R - D are clamped to the noise floor, by default three
+    times the RMS dark noise, which bounds the absorbance of opaque samples
+    and of pixels the reference leaves dark instead of producing infinities.
+  */
+  class ratioMeasurement {
+  public:
+    enum mode {
+      TRANSMITTANCE,
+      ABSORBANCE,
+      REFLECTANCE
+    };
+
+  private:
+    usb4k *spec;
+    mode output;
+    float noiseFloor;
+    bool autoFloor;
+    float reflectance = 1;
+    int integration = 0; // [us] of dark and reference
+    bool hasDark = false, hasReference = false;
+
+    std::array<float, usb4kPixelCount> dark;
+    std::array<float, usb4kPixelCount> reference;
+    std::array<float, usb4kPixelCount> inverseReference;
+    std::array<float, usb4kPixelCount> spectrum;
+
+    void average(int frames, std::array<float, usb4kPixelCount> &mean, double *variance=NULL) {
+      if (!spec)
+	throw std::runtime_error("No spectrometer to capture from!");
+      if (frames < 1)
+	throw std::invalid_argument("At least one frame has to be averaged!");
+      std::array<double, usb4kPixelCount> sum{}, squares{};
+      for (int f = 0; f < frames; ++f) {
+	std::array<uint16_t, usb4kPixelCount> &raw = spec->getRawSpectrum();
+	for (int i = 0; i < usb4kPixelCount; ++i) {
+	  sum[i] += raw[i];
+	  squares[i] += double(raw[i]) * raw[i];
+	}
+      }
+      double var = 0;
+      for (int i = 0; i < usb4kPixelCount; ++i) {
+	mean[i] = sum[i] / frames;
+	var += squares[i] / frames - (sum[i] / frames) * (sum[i] / frames);
+      }
+      if (variance) *variance = frames > 1 ? var / usb4kPixelCount * frames / (frames - 1) : 0.0;
+    }
+
+    void update(void) {
+      if (!hasDark || !hasReference) return;
+      const float scale = output == REFLECTANCE ? reflectance : 1.0f;
+      for (int i = 0; i < usb4kPixelCount; ++i)
+	inverseReference[i] = scale / std::max(reference[i] - dark[i], noiseFloor);
+    }
+
+  public:
+    // noise_floor in counts, 0 to derive it from the captured dark
+    ratioMeasurement(usb4k &s, mode m=ABSORBANCE, float noise_floor=0)
+      : spec(&s), output(m), noiseFloor(noise_floor > 0 ? noise_floor : 1.0f), autoFloor(noise_floor <= 0) {}
+    // Without a device, for recorded frames and externally measured frames
+    ratioMeasurement(mode m=ABSORBANCE, float noise_floor=1.0f)
+      : spec(NULL), output(m), noiseFloor(noise_floor), autoFloor(false) {
+      if (noise_floor <= 0)
+	throw std::invalid_argument("Noise floor must be positive!");
+    }
+
+    // With the light path blocked
+    void captureDark(int frames=16) {
+      double variance;
+      average(frames, dark, &variance);
+      // a reference of another integration time does not pair with it, and has to be taken again;
+      // dark first is the order that works after the integration time changed
+      if (spec->getIntegrationTime() != integration) hasReference = false;
+      if (autoFloor && frames > 1) noiseFloor = std::max(1.0, 3.0 * std::sqrt(variance));
+      integration = spec->getIntegrationTime();
+      hasDark = true;
+      update();
+    }
+
+    // With the blank, or the white standard for reflectance
+    void captureReference(int frames=16) {
+      // a refused reference must not replace the one in use
+      std::array<float, usb4kPixelCount> captured;
+      average(frames, captured);
+      if (hasDark && spec->getIntegrationTime() != integration)
+	throw std::runtime_error("Dark and reference taken at different integration times!");
+      reference = captured;
+      integration = spec->getIntegrationTime();
+      hasReference = true;
+      update();
+    }
+
+    void setDark(const std::array<float, usb4kPixelCount> &d) { dark = d; hasDark = true; update(); }
+    void setReference(const std::array<float, usb4kPixelCount> &r) { reference = r; hasReference = true; update(); }
+    const std::array<float, usb4kPixelCount>& getDark(void) const { return dark; }
+    const std::array<float, usb4kPixelCount>& getReference(void) const { return reference; }
+
+    void setMode(mode m) { output = m; update(); }
+    mode getMode(void) const { return output; }
+    // Reflectance of the white standard, 1 for an ideal one
+    void setStandardReflectance(float r) { reflectance = r; update(); }
+    float getNoiseFloor(void) const { return noiseFloor; }
+    bool ready(void) const { return hasDark && hasReference; }
+
+    void compute(const uint16_t *raw, float *out) const {
+      if (!ready())
+	throw std::runtime_error("Dark and reference must be taken first!");
+      kernels::ratio(raw, dark.data(), inverseReference.data(), noiseFloor, output == ABSORBANCE, out, usb4kPixelCount);
+    }
+
+    const std::array<float, usb4kPixelCount>& acquire(void) {
+      if (!spec)
+	throw std::runtime_error("No spectrometer to acquire from!");
+      if (spec->getIntegrationTime() != integration)
+	throw std::runtime_error("Integration time changed since the reference was taken!");
+      compute(spec->getRawSpectrum().data(), spectrum.data());
+      return spectrum;
+    }
+  };
+}
@@ -0,0 +1,227 @@
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+
+#include "recorder.hpp"
+#include "codec.hpp"
+#include "kernels.hpp"
+
+namespace spectrometer {
+
+  namespace triggers {
+    triggerPredicate peakAbove(int from, int to, float threshold)
+    {
+      if (from < 0 || to > usb4kPixelCount || from >= to)
+	throw std::out_of_range("Trigger range is out of the detector!");
+      return [=](const frameMetadata &, const float *spectrum) {
+	return *std::max_element(spectrum + from, spectrum + to) > threshold;
+      };
+    }
+
+    triggerPredicate bandRatioChange(int a_from, int a_to, int b_from, int b_to, float relative_change)
+    {
+      if (a_from < 0 || b_from < 0 || a_to > usb4kPixelCount || b_to > usb4kPixelCount || a_from >= a_to || b_from >= b_to)
+	throw std::out_of_range("Trigger range is out of the detector!");
+      auto baseline = std::make_shared<double>(NAN);
+      return [=](const frameMetadata &, const float *spectrum) {
+	double a = 0, b = 0;
+	for (int i = a_from; i < a_to; ++i) a += spectrum[i];
+	for (int i = b_from; i < b_to; ++i) b += spectrum[i];
+	if (b == 0) return false;
+	double ratio = a / b;
+	if (std::isnan(*baseline)) { *baseline = ratio; return false; }
+	return std::fabs(ratio - *baseline) > relative_change * std::fabs(*baseline);
+      };
+    }
+
+    triggerPredicate distanceFromBaseline(const std::array<float, usb4kPixelCount> &baseline, float threshold,
+					  int from, int to)
+    {
+      if (from < 0 || to > usb4kPixelCount || from >= to)
+	throw std::out_of_range("Trigger range is out of the detector!");
+      auto reference = std::make_shared<std::array<float, usb4kPixelCount>>(baseline);
+      const double limit = double(threshold) * threshold * (to - from);
+      return [=](const frameMetadata &, const float *spectrum) {
+	double sum = 0;
+	for (int i = from; i < to; ++i) {
+	  double d = spectrum[i] - (*reference)[i];
+	  sum += d * d;
+	}
+	return sum > limit;
+      };
+    }
+  }
+
+  eventRecorder::eventRecorder(const std::string &path_prefix, const float *wavelength_coeffs,
+			       const float *linearity_coeffs, const std::string &serial,
+			       size_t pre_trigger, size_t post_trigger, size_t slack, bool compress)
+    : prefix(path_prefix), serialNumber(serial), compressed(compress),
+      preTrigger(pre_trigger), postTrigger(post_trigger), slotCount(pre_trigger + post_trigger + std::max<size_t>(slack, 1))
+  {
+    std::memcpy(wavelengthCoeffs, wavelength_coeffs, sizeof(wavelengthCoeffs));
+    std::memcpy(linearityCoeffs, linearity_coeffs, sizeof(linearityCoeffs));
+    slots.reset(new slot[slotCount]);
+    for (size_t i = 0; i < slotCount; ++i) slots[i].sequence.store(0, std::memory_order_relaxed);
+    writer = std::thread(&eventRecorder::writerLoop, this);
+  }
+
+  eventRecorder::~eventRecorder(void)
+  {
+    try { flush(); } catch (...) {}
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    wake.notify_all();
+    writer.join();
+  }
+
+  bool eventRecorder::push(const frameMetadata &meta, const uint16_t *raw)
+  {
+    const uint64_t n = head.load(std::memory_order_relaxed);
+    slot &s = slots[n % slotCount];
+    s.sequence.store(2*n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s.frame.meta = meta;
+    std::memcpy(s.frame.raw, raw, sizeof(s.frame.raw));
+    s.sequence.store(2*n + 2, std::memory_order_release);
+    head.store(n + 1, std::memory_order_release);
+
+    bool fired = false;
+    if (!predicates.empty()) {
+      kernels::offsetCorrect(raw, usb4kEdarkIndices.front(), usb4kEdarkIndices.size(), spectrum.data(), usb4kPixelCount);
+
+      for (auto &p : predicates)
+	if (p.second(meta, spectrum.data())) {
+	  fired = true;
+	  fire(n);
+	  break;
+	}
+    }
+
+    if (recording) {
+      if (n + 1 >= recordUntil) {
+	{
+	  std::lock_guard<std::mutex> guard(lock);
+	  events.back().end = recordUntil;
+	  events.back().closed = true;
+	}
+	lastEnd = recordUntil;
+	recording = false;
+	wake.notify_all();
+      } else if (n % 64 == 0) {
+	wake.notify_all();
+      }
+    }
+    return fired;
+  }
+
+  void eventRecorder::fire(uint64_t n)
+  {
+    recordUntil = n + 1 + postTrigger;
+    if (recording) return;
+
+    // not before the end of the previous event
+    uint64_t first = std::max(n > preTrigger ? n - preTrigger : 0, lastEnd);
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      events.push_back({ first, 0, false });
+    }
+    eventCount.fetch_add(1, std::memory_order_relaxed);
+    recording = true;
+    wake.notify_all();
+  }
+
+  void eventRecorder::flush(void)
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    if (recording) {
+      recordUntil = lastEnd = head.load(std::memory_order_relaxed);
+      events.back().end = recordUntil;
+      events.back().closed = true;
+      recording = false;
+    }
+    wake.notify_all();
+    drained.wait(guard, [this] { return events.empty(); });
+  }
+
+  recorderStats eventRecorder::getStats(void) const
+  {
+    return { head.load(std::memory_order_relaxed), eventCount.load(std::memory_order_relaxed),
+	written.load(std::memory_order_relaxed), lost.load(std::memory_order_relaxed) };
+  }
+
+  std::vector<std::string> eventRecorder::getFiles(void)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    return files;
+  }
+
+  void eventRecorder::writerLoop(void)
+  {
+    archivedFrame frame;
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+      wake.wait(guard, [this] { return stopping || !events.empty(); });
+      if (events.empty()) break; // stopping
+
+      event &e = events.front(); // deque references survive push_back
+      const std::string path = prefix + "-" + std::to_string(files.size()) + ".u4k";
+      files.push_back(path);
+      uint64_t next = e.first;
+      guard.unlock();
+
+      std::unique_ptr<archiveWriter> plain;
+      std::unique_ptr<compressedArchiveWriter> packed;
+      try {
+	if (compressed) packed.reset(new compressedArchiveWriter(path, wavelengthCoeffs, linearityCoeffs, serialNumber));
+	else plain.reset(new archiveWriter(path, wavelengthCoeffs, linearityCoeffs, serialNumber));
+      } catch (const std::exception &) {
+	// nothing to write to, the event is lost
+      }
+
+      while (true) {
+	guard.lock();
+	const bool closed = e.closed;
+	const uint64_t end = e.end;
+	guard.unlock();
+
+	uint64_t available = head.load(std::memory_order_acquire);
+	if (closed) available = std::min(available, end);
+	for (; next < available; ++next) {
+	  const slot &s = slots[next % slotCount];
+	  const uint64_t before = s.sequence.load(std::memory_order_acquire);
+	  bool valid = before == 2*next + 2;
+	  if (valid) {
+	    frame = s.frame;
+	    std::atomic_thread_fence(std::memory_order_acquire);
+	    valid = s.sequence.load(std::memory_order_relaxed) == before;
+	  }
+	  if (!valid || !(plain || packed)) {
+	    lost.fetch_add(1, std::memory_order_relaxed);
+	    continue;
+	  }
+	  try {
+	    if (packed) packed->append(frame.meta, frame.raw);
+	    else plain->append(frame);
+	    written.fetch_add(1, std::memory_order_relaxed);
+	  } catch (const std::exception &) {
+	    lost.fetch_add(1, std::memory_order_relaxed);
+	  }
+	}
+	if (closed && next >= end) break;
+
+	guard.lock();
+	wake.wait_for(guard, std::chrono::milliseconds(10));
+	guard.unlock();
+      }
+
+      packed.reset();
+      plain.reset();
+      guard.lock();
+      events.pop_front();
+      drained.notify_all();
+    }
+  }
+
+}
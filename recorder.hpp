@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "archive.hpp"
+
+namespace spectrometer {
+  // Evaluated on every frame with the electric dark subtracted spectrum
+  typedef std::function<bool(const frameMetadata &meta, const float *spectrum)> triggerPredicate;
+
+  namespace triggers {
+    // Any pixel of [from, to) above threshold counts
+    triggerPredicate peakAbove(int from, int to, float threshold);
+
+    // Ratio of the sums of two pixel ranges off by more than a relative change
+    // from its value on the first frame seen (the baseline)
+    triggerPredicate bandRatioChange(int a_from, int a_to, int b_from, int b_to, float relative_change);
+
+    // RMS distance over [from, to) from a baseline spectrum above threshold counts
+    triggerPredicate distanceFromBaseline(const std::array<float, usb4kPixelCount> &baseline, float threshold,
+					  int from=usb4kActivePixelBegin, int to=usb4kActivePixelEnd);
+  }
+
+  struct recorderStats {
+    uint64_t frames;   // pushed
+    uint64_t events;   // triggered, overlapping ones merged
+    uint64_t written;  // frames on disk
+    uint64_t lost;     // frames overwritten before the writer got to them
+  };
+
+  /*
+    Keeps the last frames in memory and records only the ones around events.
+
+    push() copies each frame into a ring of slots (seqlock stamped as in
+    shm.hpp) and evaluates the triggers. When one fires, an event opens that
+    covers the preTrigger frames before it and runs for postTrigger frames
+    after the last firing, so bursts of triggers give one event. A writer
+    thread streams every event into its own archive, <prefix>-<n>.u4k, straight
+    from the ring; push() takes a lock only to open or close an event and
+    never waits for the disk. The ring holds preTrigger + postTrigger frames
+    plus the slack, which is how far the writer may lag; frames it lapped are
+    counted as lost and skipped.
+  */
+  class eventRecorder {
+  private:
+    struct alignas(64) slot {
+      std::atomic<uint64_t> sequence; // odd while written, 2*(frame+1) once complete
+      archivedFrame frame;
+    };
+
+    struct event {
+      uint64_t first, end; // frames [first, end), end unknown while open
+      bool closed;
+    };
+
+    std::string prefix;
+    float wavelengthCoeffs[4];
+    float linearityCoeffs[8];
+    std::string serialNumber;
+    bool compressed;
+    size_t preTrigger, postTrigger;
+    size_t slotCount;
+    std::unique_ptr<slot[]> slots;
+    std::atomic<uint64_t> head{0}; // frames pushed
+
+    std::vector<std::pair<std::string, triggerPredicate>> predicates;
+    std::array<float, usb4kPixelCount> spectrum;
+    bool recording = false;
+    uint64_t recordUntil = 0; // end of the open event
+    uint64_t lastEnd = 0;     // of the last closed one
+
+    std::mutex lock;
+    std::condition_variable wake, drained;
+    std::deque<event> events;
+    std::vector<std::string> files;
+    bool stopping = false;
+    std::atomic<uint64_t> eventCount{0}, written{0}, lost{0};
+    std::thread writer;
+
+    void fire(uint64_t n);
+    void writerLoop(void);
+
+  public:
+    eventRecorder(const std::string &path_prefix, const float *wavelength_coeffs, const float *linearity_coeffs,
+		  const std::string &serial, size_t pre_trigger, size_t post_trigger, size_t slack=1024,
+		  bool compress=false);
+    eventRecorder(const std::string &path_prefix, const frameSource &spec, size_t pre_trigger, size_t post_trigger,
+		  size_t slack=1024, bool compress=false)
+      : eventRecorder(path_prefix, spec.getWavelengthCoeffs(), spec.getLinearityCoeffs(), spec.getSerialNumber(),
+		      pre_trigger, post_trigger, slack, compress) {}
+    virtual ~eventRecorder(void);
+
+    eventRecorder(const eventRecorder &) = delete;
+    eventRecorder& operator=(const eventRecorder &) = delete;
+
+    void addTrigger(const std::string &name, triggerPredicate predicate) {
+      predicates.emplace_back(name, std::move(predicate));
+    }
+
+    // Returns true if a trigger fired on this frame; call from one thread only
+    bool push(const frameMetadata &meta, const uint16_t *raw);
+
+    // Fires an event by hand on the next frame, e.g. on an external signal
+    void trigger(void) { fire(head.load(std::memory_order_relaxed)); }
+
+    // Closes an open event early and waits until every event is on disk;
+    // from the pushing thread like trigger()
+    void flush(void);
+
+    bool isRecording(void) const { return recording; }
+    recorderStats getStats(void) const;
+    std::vector<std::string> getFiles(void);
+  };
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <memory>
+#include <chrono>
+#include <thread>
+
+#include "archive.hpp"
+
+namespace spectrometer {
+  /*
+    Plays back a frame archive as a frameSource.
+
+    Frames come straight out of the archive mapping, so reading costs a
+    pointer and the page cache. With speed > 0 each frame is held back until
+    its recorded timestamp, relative to the first one, divided by speed has
+    elapsed: 1 is the original timing, 10 ten times faster. With speed 0 they
+    come as fast as they are asked for. A looping source restarts at the end
+    with indices and timestamps carried on, so downstream code sees one
+    continuous recording.
+  */
+  class replaySource : public frameSource {
+  private:
+    std::unique_ptr<archiveReader> owned;
+    const archiveReader &archive;
+    double speed;
+    bool loop;
+
+    size_t position = 0;
+    uint64_t indexOffset = 0;
+    int64_t timeOffset = 0;  // [ns] added to the recorded timestamps when looping
+    int64_t recordedSpan = 0; // [ns] first to last frame plus one frame period
+    std::chrono::steady_clock::time_point start;
+    int64_t startTimestamp = 0; // [ns] recorded time of the frame played at start
+    bool started = false;
+    uint64_t late = 0;
+    frameMetadata current;
+    std::string serialNumber;
+
+    void measure(void) {
+      const archiveHeader &header = archive.getHeader();
+      serialNumber.assign(header.serialNumber, strnlen(header.serialNumber, sizeof(header.serialNumber)));
+      if (archive.size() < 2) return;
+      int64_t first = archive[0].meta.timestamp, last = archive[archive.size()-1].meta.timestamp;
+      recordedSpan = (last - first) + (last - first) / int64_t(archive.size() - 1);
+    }
+
+  public:
+    replaySource(const std::string &path, double speed_multiple=1.0, bool looping=false)
+      : owned(new archiveReader(path)), archive(*owned), speed(speed_multiple), loop(looping) {
+      if (speed < 0)
+	throw std::invalid_argument("Replay speed can not be negative!");
+      measure();
+    }
+    replaySource(const archiveReader &reader, double speed_multiple=1.0, bool looping=false)
+      : archive(reader), speed(speed_multiple), loop(looping) {
+      if (speed < 0)
+	throw std::invalid_argument("Replay speed can not be negative!");
+      measure();
+    }
+
+    bool next(frameMetadata &meta, const uint16_t *&raw) override {
+      if (position >= archive.size()) {
+	if (!loop || archive.size() == 0) return false;
+	position = 0;
+	indexOffset += archive.size();
+	timeOffset += recordedSpan;
+      }
+
+      const archivedFrame &frame = archive[position++];
+      meta = frame.meta;
+      meta.index += indexOffset;
+      meta.timestamp += timeOffset;
+      raw = frame.raw;
+
+      if (speed > 0) {
+	if (!started) {
+	  start = std::chrono::steady_clock::now();
+	  startTimestamp = meta.timestamp;
+	  started = true;
+	}
+	auto due = start + std::chrono::nanoseconds(int64_t((meta.timestamp - startTimestamp) / speed));
+	if (std::chrono::steady_clock::now() > due) ++late;
+	else std::this_thread::sleep_until(due);
+      }
+      current = meta;
+      return true;
+    }
+
+    // Back to the first frame; timing restarts with the next frame, as after setSpeed()
+    void rewind(void) { position = 0; indexOffset = 0; timeOffset = 0; started = false; late = 0; }
+
+    void setSpeed(double speed_multiple) { speed = speed_multiple; started = false; }
+    double getSpeed(void) const { return speed; }
+    // Frames that were already overdue when asked for, i.e. the consumer fell behind
+    uint64_t getLate(void) const { return late; }
+    size_t size(void) const { return archive.size(); }
+
+    // of the frame last played, or the first one
+    int getIntegrationTime(void) const override {
+      if (position) return current.integration;
+      return archive.size() ? archive[0].meta.integration : 0;
+    }
+    const std::string& getSerialNumber(void) const override { return serialNumber; }
+    const float* getWavelengthCoeffs(void) const override { return archive.getHeader().wavelengthCoeffs; }
+    const float* getLinearityCoeffs(void) const override { return archive.getHeader().linearityCoeffs; }
+  };
+}
@@ -0,0 +1,74 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+#include <omp.h>
+
+#include "batch.hpp"
+
+static void usage(const char *name)
+{
+  std::cerr << "usage: " << name << " <archive> <output> [options]\n"
+	    << "  --average N            frames averaged into one row (1)\n"
+	    << "  --resample FROM TO STEP  resample onto a uniform grid within the calibration [nm]\n"
+	    << "  --no-edark             skip the electric dark subtraction\n"
+	    << "  --no-linearity         skip the non-linearity correction\n"
+	    << "  --threads N            OpenMP threads (all)\n"
+	    << "  --chunk N              input frames per scheduled chunk (32)\n"
+	    << "  --scaling              report the scaling from 1 to --threads threads\n";
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  spectrometer::batchConfig config;
+  int threads = 0;
+  bool scaling = false;
+
+  for (int i = 3; i < argc; ++i) {
+    std::string opt(argv[i]);
+    if (opt == "--average" && i + 1 < argc) config.average = std::atoi(argv[++i]);
+    else if (opt == "--resample" && i + 3 < argc) {
+      config.resample = true;
+      config.resampleFrom = std::atof(argv[++i]);
+      config.resampleTo = std::atof(argv[++i]);
+      config.resampleStep = std::atof(argv[++i]);
+    }
+    else if (opt == "--no-edark") config.edark = false;
+    else if (opt == "--no-linearity") config.linearity = false;
+    else if (opt == "--threads" && i + 1 < argc) threads = std::atoi(argv[++i]);
+    else if (opt == "--chunk" && i + 1 < argc) config.chunkFrames = std::atoi(argv[++i]);
+    else if (opt == "--scaling") scaling = true;
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  try {
+    spectrometer::archiveReader archive(argv[1]);
+    spectrometer::batchProcessor processor(archive, config);
+
+    if (scaling)
+      processor.reportScaling(threads > 0 ? threads : omp_get_max_threads());
+
+    std::vector<float> rows;
+    double seconds = processor.run(rows, threads);
+    std::cout << archive.size() << " frames -> " << processor.rowCount() << " x " << processor.rowWidth()
+	      << " in " << seconds << " s" << std::endl;
+
+    std::ofstream out(argv[2], std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(rows.data()), rows.size() * sizeof(float));
+    if (!out)
+      throw std::runtime_error("Failed to write the output!");
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
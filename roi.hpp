@@ -0,0 +1,110 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "spectrometer.hpp"
+#include "kernels.hpp"
+
+namespace spectrometer {
+  struct band {
+    float from, to; // [nm]
+  };
+
+  /*
+    Integrates many wavelength bands per frame in O(1) each.
+
+    A pixel spans the wavelengths between the midpoints to its neighbours, so
+    a band covers whole pixels [lo+1, hi) plus fractions of its edge pixels lo
+    and hi. The bounds and edge weights are mapped once from the calibration;
+    per frame one prefix sum (in double, to keep 3840 x 16 bit exact enough)
+    answers every band with two lookups.
+
+    Results are batched column-wise: column(b)[f] is band b of the f-th frame
+    since beginBatch(), ready to be handed over per band.
+  */
+  class roiEngine {
+  private:
+    struct bounds {
+      int lo, hi;    // edge pixels, lo <= hi
+      float wlo, whi; // covered fraction of them (only wlo if lo == hi)
+    };
+
+    std::vector<bounds> rois;
+    std::vector<double> prefix;
+    std::vector<float> columns;
+    size_t capacity = 0;
+    size_t frames = 0;
+
+    // fractional pixel position of a wavelength, pixel i spanning [i-0.5, i+0.5)
+    static float pixelOf(const std::array<float, usb4kPixelCount> &wl, float nm) {
+      const int last = usb4kPixelCount - 1;
+      if (nm <= wl[0]) return std::max(-0.5f, (nm - wl[0]) / (wl[1] - wl[0]));
+      if (nm >= wl[last]) return std::min(last + 0.5f, last + (nm - wl[last]) / (wl[last] - wl[last-1]));
+      int i = std::upper_bound(wl.begin(), wl.end(), nm) - wl.begin() - 1;
+      return i + (nm - wl[i]) / (wl[i+1] - wl[i]);
+    }
+
+  public:
+    roiEngine(const std::array<float, usb4kPixelCount> &wavelengths, const std::vector<band> &bands)
+      : prefix(usb4kPixelCount + 1) {
+      for (auto &b : bands) {
+	if (b.to <= b.from)
+	  throw std::invalid_argument("ROI band must span a positive range!");
+
+	float x0 = pixelOf(wavelengths, b.from) + 0.5f, x1 = pixelOf(wavelengths, b.to) + 0.5f; // pixel i spans [i, i+1)
+	bounds r;
+	r.lo = std::min(int(x0), usb4kPixelCount - 1);
+	r.hi = std::min(int(x1), usb4kPixelCount - 1);
+	if (r.lo == r.hi) {
+	  r.wlo = x1 - x0;
+	  r.whi = 0;
+	} else {
+	  r.wlo = (r.lo + 1) - x0;
+	  r.whi = x1 - r.hi;
+	}
+	rois.push_back(r);
+      }
+    }
+
+    size_t size(void) const { return rois.size(); }
+
+    // Single frame: out[b] is the integral of band b
+    void integrate(const float *spectrum, float *out) {
+      kernels::prefixSum(spectrum, prefix.data(), usb4kPixelCount);
+      const double *p = prefix.data();
+      for (size_t b = 0; b < rois.size(); ++b) {
+	const bounds &r = rois[b];
+	double inner = r.hi > r.lo ? p[r.hi] - p[r.lo + 1] : 0.0;
+	out[b] = inner + r.wlo * spectrum[r.lo] + r.whi * spectrum[r.hi];
+      }
+    }
+
+    void beginBatch(size_t frame_capacity) {
+      capacity = frame_capacity;
+      frames = 0;
+      columns.assign(capacity * rois.size(), 0.0f);
+    }
+
+    // Appends one frame to the batch; false once it is full
+    bool process(const float *spectrum) {
+      if (frames >= capacity) return false;
+
+      kernels::prefixSum(spectrum, prefix.data(), usb4kPixelCount);
+      const double *p = prefix.data();
+      float *out = columns.data() + frames;
+      for (size_t b = 0; b < rois.size(); ++b, out += capacity) {
+	const bounds &r = rois[b];
+	double inner = r.hi > r.lo ? p[r.hi] - p[r.lo + 1] : 0.0;
+	*out = inner + r.wlo * spectrum[r.lo] + r.whi * spectrum[r.hi];
+      }
+      ++frames;
+      return true;
+    }
+
+    bool process(const std::array<float, usb4kPixelCount> &spectrum) { return process(spectrum.data()); }
+
+    size_t batchFrames(void) const { return frames; }
+    const float* column(size_t b) const { return columns.data() + b * capacity; }
+  };
+}
@@ -0,0 +1,429 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <map>
+
+#include "server.hpp"
+
+namespace spectrometer {
+
+  static void setNonBlocking(int fd)
+  {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+      throw std::runtime_error("Failed to make the socket non-blocking!");
+  }
+
+  streamServer::streamServer(size_t max_queue)
+    : maxQueue(max_queue)
+  {
+    if (pipe(wakeup) != 0)
+      throw std::runtime_error("Failed to create the wake-up pipe!");
+    setNonBlocking(wakeup[0]);
+    setNonBlocking(wakeup[1]);
+  }
+
+  streamServer::~streamServer(void)
+  {
+    stop();
+    for (auto &c : clients) close(c->fd);
+    for (int fd : listeners) close(fd);
+    if (!unixPath.empty()) unlink(unixPath.c_str());
+    close(wakeup[0]);
+    close(wakeup[1]);
+  }
+
+  void streamServer::listenUnix(const std::string &path)
+  {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+      throw std::invalid_argument("UNIX socket path is too long!");
+    std::strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      throw std::runtime_error("Failed to create the UNIX socket!");
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(fd, 16) != 0) {
+      close(fd);
+      throw std::runtime_error("Failed to listen on the UNIX socket!");
+    }
+    setNonBlocking(fd);
+
+    std::lock_guard<std::mutex> guard(lock);
+    listeners.push_back(fd);
+    unixPath = path;
+  }
+
+  void streamServer::listenTcp(int port)
+  {
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+      throw std::runtime_error("Failed to create the TCP socket!");
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(fd, 16) != 0) {
+      close(fd);
+      throw std::runtime_error("Failed to listen on the TCP port!");
+    }
+    setNonBlocking(fd);
+
+    std::lock_guard<std::mutex> guard(lock);
+    listeners.push_back(fd);
+  }
+
+  void streamServer::start(void)
+  {
+    if (running.exchange(true)) return;
+    worker = std::thread(&streamServer::serve, this);
+  }
+
+  void streamServer::stop(void)
+  {
+    if (!running.exchange(false)) return;
+    if (write(wakeup[1], "x", 1) < 0) {}
+    worker.join();
+  }
+
+  void streamServer::publish(const frameMetadata &meta, const uint16_t *raw)
+  {
+    // copied before taking the lock, once for all clients
+    std::shared_ptr<const std::vector<uint16_t>> frame;
+    if (subscribers.load(std::memory_order_relaxed) > 0)
+      frame = std::make_shared<const std::vector<uint16_t>>(raw, raw + usb4kPixelCount);
+    auto now = std::chrono::steady_clock::now();
+    bool queued = false;
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      uint64_t sequence = publishedFrames++;
+      if (!frame) return;
+      for (auto &c : clients) {
+	if (!c->subscribed || sequence % c->frameDecimation != 0) continue;
+	if (c->backlog.load(std::memory_order_relaxed) >= maxQueue) {
+	  ++c->framesDropped;
+	  c->missed = true; // the next frame it gets must not be a delta
+	  continue;
+	}
+	c->incoming.push_back({ meta, frame, now });
+	c->backlog.fetch_add(1, std::memory_order_relaxed);
+	queued = true;
+      }
+    }
+
+    if (queued && write(wakeup[1], "x", 1) < 0) {} // a full pipe is already a pending wake-up
+  }
+
+  std::vector<streamClientStats> streamServer::getClientStats(void)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto now = std::chrono::steady_clock::now();
+    std::vector<streamClientStats> stats;
+
+    for (auto &c : clients) {
+      std::chrono::duration<double> elapsed = now - c->connected;
+      streamClientStats s;
+      s.fd = c->fd;
+      s.framesSent = c->framesSent;
+      s.framesDropped = c->framesDropped;
+      s.bytesSent = c->bytesSent;
+      s.bandwidth = elapsed.count() > 0 ? s.bytesSent / elapsed.count() : 0;
+      s.lagFrames = c->backlog;
+      s.lagSeconds = c->lagSeconds;
+      stats.push_back(s);
+    }
+    return stats;
+  }
+
+  void streamServer::accept(int listener)
+  {
+    while (true) {
+      int fd = ::accept(listener, NULL, NULL);
+      if (fd < 0) return;
+      setNonBlocking(fd);
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on UNIX sockets
+
+      std::unique_ptr<client> c(new client);
+      c->fd = fd;
+      c->connected = std::chrono::steady_clock::now();
+      std::lock_guard<std::mutex> guard(lock);
+      clients.push_back(std::move(c));
+    }
+  }
+
+  bool streamServer::receive(client &c)
+  {
+    uint8_t buf[256];
+    while (true) {
+      ssize_t n;
+      if (!c.subscribed) {
+	n = read(c.fd, reinterpret_cast<uint8_t *>(&c.subscription) + c.received, sizeof(c.subscription) - c.received);
+      } else {
+	n = read(c.fd, buf, sizeof(buf)); // nothing is expected, only the hang-up
+      }
+      if (n == 0) return false;
+      if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+      if (!c.subscribed) {
+	c.received += n;
+	if (c.received < sizeof(c.subscription)) continue;
+	if (c.subscription.magic != streamMagic || c.subscription.frameDecimation < 1 ||
+	    c.subscription.pixelBinning < 1 || c.subscription.pixelBinning > usb4kPixelCount)
+	  return false;
+	if (c.subscription.flags & streamCompressed)
+	  c.encoder.reset(new spectrumEncoder(usb4kPixelCount / c.subscription.pixelBinning));
+	std::lock_guard<std::mutex> guard(lock);
+	c.frameDecimation = c.subscription.frameDecimation;
+	c.subscribed = true;
+	++subscribers;
+      }
+    }
+  }
+
+  void streamServer::prepare(client &c, std::deque<pending> &frames,
+			     std::map<std::pair<const void *, uint32_t>, std::shared_ptr<std::vector<uint16_t>>> &binned)
+  {
+    const uint32_t binning = c.subscription.pixelBinning;
+    for (pending &p : frames) {
+      // binned once per frame and binning, whichever client comes first
+      auto &pixels = binned[{ p.raw.get(), binning }];
+      if (!pixels) {
+	pixels = std::make_shared<std::vector<uint16_t>>(usb4kPixelCount / binning);
+	const uint16_t *raw = p.raw->data();
+	if (binning == 1) {
+	  std::copy(raw, raw + usb4kPixelCount, pixels->begin());
+	} else {
+	  for (size_t i = 0; i < pixels->size(); ++i) {
+	    uint32_t sum = 0;
+	    for (uint32_t j = 0; j < binning; ++j) sum += raw[i*binning + j];
+	    (*pixels)[i] = uint16_t((sum + binning/2) / binning);
+	  }
+	}
+      }
+
+      message m;
+      m.header.magic = streamMagic;
+      m.header.pixelCount = pixels->size();
+      m.header.pixelBinning = binning;
+      m.header.encodedBytes = 0;
+      m.header.meta = p.meta;
+      m.published = p.published;
+
+      if (c.encoder) {
+	// the encoder state is per client, so is the payload
+	auto encoded = std::make_shared<std::vector<uint8_t>>(codec::maxEncodedSize(pixels->size()));
+	encoded->resize(c.encoder->encode(pixels->data(), encoded->data()));
+	m.header.encodedBytes = encoded->size();
+	m.payload = encoded->data();
+	m.payloadBytes = encoded->size();
+	m.owner = encoded;
+      } else {
+	m.payload = reinterpret_cast<const uint8_t *>(pixels->data());
+	m.payloadBytes = pixels->size() * sizeof(uint16_t);
+	m.owner = pixels;
+      }
+      c.queue.push_back(std::move(m));
+    }
+  }
+
+  bool streamServer::flush(client &c)
+  {
+    const size_t maxBatch = 16;
+    while (!c.queue.empty()) {
+      struct iovec iov[2*maxBatch];
+      int count = 0;
+      size_t skip = c.offset;
+
+      for (size_t k = 0; k < c.queue.size() && k < maxBatch; ++k) {
+	message &m = c.queue[k];
+	size_t headerBytes = sizeof(m.header);
+	if (skip < headerBytes) {
+	  iov[count].iov_base = reinterpret_cast<uint8_t *>(&m.header) + skip;
+	  iov[count++].iov_len = headerBytes - skip;
+	  skip = 0;
+	} else {
+	  skip -= headerBytes;
+	}
+	iov[count].iov_base = const_cast<uint8_t *>(m.payload) + skip;
+	iov[count++].iov_len = m.payloadBytes - skip;
+	skip = 0;
+      }
+
+      struct msghdr msg;
+      std::memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      ssize_t n = sendmsg(c.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+      c.bytesSent += n;
+      size_t sent = c.offset + n;
+      auto now = std::chrono::steady_clock::now();
+      while (!c.queue.empty()) {
+	message &m = c.queue.front();
+	size_t total = sizeof(m.header) + m.payloadBytes;
+	if (sent < total) break;
+	sent -= total;
+	++c.framesSent;
+	c.lagSeconds = std::chrono::duration<double>(now - m.published).count();
+	c.queue.pop_front();
+	c.backlog.fetch_sub(1, std::memory_order_relaxed);
+      }
+      c.offset = sent;
+    }
+    return true;
+  }
+
+  void streamServer::serve(void)
+  {
+    std::vector<struct pollfd> fds;
+    std::deque<pending> frames;
+    std::map<std::pair<const void *, uint32_t>, std::shared_ptr<std::vector<uint16_t>>> binned;
+
+    std::vector<int> listening;
+
+    // only this thread changes clients, so it reads them without the lock
+    while (running) {
+      {
+	std::lock_guard<std::mutex> guard(lock);
+	listening = listeners;
+      }
+      fds.clear();
+      fds.push_back({ wakeup[0], POLLIN, 0 });
+      for (int fd : listening) fds.push_back({ fd, POLLIN, 0 });
+      for (auto &c : clients) fds.push_back({ c->fd, short(POLLIN | (c->queue.empty() ? 0 : POLLOUT)), 0 });
+
+      if (poll(fds.data(), fds.size(), -1) < 0) continue;
+
+      if (fds[0].revents & POLLIN) {
+	char buf[64];
+	while (read(wakeup[0], buf, sizeof(buf)) > 0);
+      }
+      for (size_t i = 0; i < listening.size(); ++i)
+	if (fds[1 + i].revents & POLLIN) accept(listening[i]);
+
+      // clients accepted above are not in fds yet and wait for the next round
+      size_t polled = fds.size() - 1 - listening.size();
+      binned.clear();
+      for (size_t i = 0, k = 0; k < polled; ++k) {
+	client &c = *clients[i];
+	short revents = fds[1 + listening.size() + k].revents;
+	bool alive = !(revents & (POLLERR | POLLNVAL));
+	if (alive && (revents & (POLLIN | POLLHUP))) alive = receive(c);
+
+	bool missed;
+	{
+	  std::lock_guard<std::mutex> guard(lock);
+	  frames.swap(c.incoming);
+	  missed = c.missed;
+	  c.missed = false;
+	}
+	if (missed && c.encoder) c.encoder->reset();
+	if (alive) prepare(c, frames, binned);
+	frames.clear();
+	if (alive && !c.queue.empty()) alive = flush(c);
+
+	if (alive) { ++i; continue; }
+	close(c.fd);
+	std::lock_guard<std::mutex> guard(lock);
+	if (c.subscribed) --subscribers;
+	clients.erase(clients.begin() + i);
+      }
+    }
+  }
+
+  streamClient::streamClient(const std::string &unix_path)
+  {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (unix_path.size() >= sizeof(addr.sun_path))
+      throw std::invalid_argument("UNIX socket path is too long!");
+    std::strcpy(addr.sun_path, unix_path.c_str());
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+      if (fd >= 0) close(fd);
+      throw std::runtime_error("Failed to connect to the spectrum server!");
+    }
+  }
+
+  streamClient::streamClient(int tcp_port)
+  {
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(tcp_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+      if (fd >= 0) close(fd);
+      throw std::runtime_error("Failed to connect to the spectrum server!");
+    }
+  }
+
+  streamClient::~streamClient(void)
+  {
+    if (fd >= 0) close(fd);
+  }
+
+  void streamClient::subscribe(uint32_t frame_decimation, uint32_t pixel_binning, bool compressed)
+  {
+    streamSubscription s = { streamMagic, frame_decimation, pixel_binning, compressed ? streamCompressed : 0 };
+    if (send(fd, &s, sizeof(s), MSG_NOSIGNAL) != sizeof(s))
+      throw std::runtime_error("Failed to subscribe to the spectrum server!");
+  }
+
+  void streamClient::readFully(void *buf, size_t len)
+  {
+    uint8_t *p = static_cast<uint8_t *>(buf);
+    while (len > 0) {
+      ssize_t n = read(fd, p, len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0)
+	throw std::runtime_error("Connection to the spectrum server is lost!");
+      p += n;
+      len -= n;
+    }
+  }
+
+  void streamClient::receive(frameMetadata &meta, std::vector<uint16_t> &raw)
+  {
+    streamFrameHeader header;
+    readFully(&header, sizeof(header));
+    if (header.magic != streamMagic || header.pixelCount > usb4kPixelCount)
+      throw std::runtime_error("Corrupted frame from the spectrum server!");
+
+    meta = header.meta;
+    raw.resize(header.pixelCount);
+    if (header.encodedBytes == 0) {
+      readFully(raw.data(), raw.size() * sizeof(uint16_t));
+      return;
+    }
+
+    if (header.encodedBytes > codec::maxEncodedSize(header.pixelCount))
+      throw std::runtime_error("Corrupted frame from the spectrum server!");
+    encoded.resize(header.encodedBytes);
+    readFully(encoded.data(), encoded.size());
+    if (!decoder) decoder.reset(new spectrumDecoder(header.pixelCount));
+    decoder->decode(encoded.data(), encoded.size(), raw.data());
+  }
+
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+#include "archive.hpp"
+#include "codec.hpp"
+
+namespace spectrometer {
+  constexpr uint32_t streamMagic = 0x5334344b; // "K44S"
+
+  /*
+    Wire format, native byte order (local clients only):
+      client -> server: streamSubscription, once after connecting
+      server -> client: streamFrameHeader followed by pixelCount uint16_t, or by
+                        encodedBytes of a spectrumEncoder frame if compressed
+  */
+  constexpr uint32_t streamCompressed = 0x01;
+
+  struct streamSubscription {
+    uint32_t magic;
+    uint32_t frameDecimation; // every Nth frame, >= 1
+    uint32_t pixelBinning;    // mean of N adjacent pixels, >= 1
+    uint32_t flags;
+  };
+
+  struct streamFrameHeader {
+    uint32_t magic;
+    uint32_t pixelCount;
+    uint32_t pixelBinning;
+    uint32_t encodedBytes;    // 0: raw pixels follow
+    frameMetadata meta;
+  };
+
+  struct streamClientStats {
+    int fd;
+    uint64_t framesSent;
+    uint64_t framesDropped;
+    uint64_t bytesSent;
+    double bandwidth;  // [bytes/s] since the connection
+    uint64_t lagFrames; // frames queued but not yet sent to this client
+    double lagSeconds;  // age of the frame sent last when it went out
+  };
+
+  /*
+    Streams frames to local clients over a UNIX domain socket and/or loopback
+    TCP. publish() copies the frame once and, under the lock, only appends it
+    to the queues of the clients due for it, so the acquisition thread never
+    blocks on a socket nor pays per client. The server thread takes the
+    queued frames, bins them once per binning in use and compresses them
+    with each client's own encoder, then sends them with vectored writes,
+    several frames per call, all outside the lock. A client whose queue is
+    full misses the new frames instead of holding the others back.
+  */
+  class streamServer {
+  private:
+    // A published frame as queued by publish(), before binning and encoding
+    struct pending {
+      frameMetadata meta;
+      std::shared_ptr<const std::vector<uint16_t>> raw;
+      std::chrono::steady_clock::time_point published;
+    };
+
+    struct message {
+      streamFrameHeader header;
+      std::shared_ptr<const void> owner; // of the payload, shared by the clients of a binning if raw
+      const uint8_t *payload;
+      size_t payloadBytes;
+      std::chrono::steady_clock::time_point published;
+    };
+
+    struct client {
+      int fd;
+      std::chrono::steady_clock::time_point connected;
+
+      // under the lock
+      bool subscribed = false;
+      uint32_t frameDecimation = 1;
+      std::deque<pending> incoming;
+      bool missed = false;  // frames dropped since the server thread took the last ones
+      uint64_t framesDropped = 0;
+
+      // the server thread only; the counters are read by getClientStats()
+      streamSubscription subscription;
+      size_t received = 0; // bytes of the subscription read so far
+      std::unique_ptr<spectrumEncoder> encoder; // compressed subscriptions only
+      std::deque<message> queue;
+      size_t offset = 0;   // bytes of queue.front() already sent
+      std::atomic<size_t> backlog{0}; // incoming and queue
+      std::atomic<uint64_t> framesSent{0}, bytesSent{0};
+      std::atomic<double> lagSeconds{0};
+    };
+
+    std::vector<int> listeners;
+    std::string unixPath;
+    std::vector<std::unique_ptr<client>> clients; // changed by the server thread under the lock
+    size_t maxQueue;
+    uint64_t publishedFrames = 0;
+    std::atomic<int> subscribers{0};
+
+    std::mutex lock;
+    int wakeup[2] = { -1, -1 };
+    std::atomic<bool> running{false};
+    std::thread worker;
+
+    void serve(void);
+    void accept(int listener);
+    bool receive(client &c);
+    void prepare(client &c, std::deque<pending> &frames,
+		 std::map<std::pair<const void *, uint32_t>, std::shared_ptr<std::vector<uint16_t>>> &binned);
+    bool flush(client &c);
+
+  public:
+    streamServer(size_t max_queue=64);
+    virtual ~streamServer(void);
+
+    void listenUnix(const std::string &path);
+    void listenTcp(int port); // loopback only
+    void start(void);
+    void stop(void);
+
+    void publish(const frameMetadata &meta, const uint16_t *raw);
+
+    std::vector<streamClientStats> getClientStats(void);
+  };
+
+  class streamClient {
+  private:
+    int fd = -1;
+    std::unique_ptr<spectrumDecoder> decoder;
+    std::vector<uint8_t> encoded;
+    void readFully(void *buf, size_t len);
+
+  public:
+    streamClient(const std::string &unix_path);
+    streamClient(int tcp_port);
+    virtual ~streamClient(void);
+
+    void subscribe(uint32_t frame_decimation=1, uint32_t pixel_binning=1, bool compressed=false);
+    // Blocks for the next frame; raw is resized to its pixel count
+    void receive(frameMetadata &meta, std::vector<uint16_t> &raw);
+  };
+}
@@ -0,0 +1,92 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <new>
+
+#include "shm.hpp"
+
+namespace spectrometer {
+
+  static const char shmMagic[8] = { 'U', '4', 'K', 'S', 'H', 'M', '0', '1' };
+
+  shmPublisher::shmPublisher(const std::string &shm_name, const std::array<float, usb4kPixelCount> &wavelengths,
+			     uint32_t slot_count)
+    : name(shm_name)
+  {
+    if (slot_count == 0)
+      throw std::invalid_argument("Shared memory ring needs at least one slot!");
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0)
+      throw std::runtime_error("Failed to create the shared memory!");
+
+    mappedLength = sizeof(shmHeader) + sizeof(shmSlot) * slot_count;
+    if (ftruncate(fd, mappedLength) != 0) {
+      close(fd);
+      shm_unlink(name.c_str());
+      throw std::runtime_error("Failed to size the shared memory!");
+    }
+
+    void *addr = mmap(NULL, mappedLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      shm_unlink(name.c_str());
+      throw std::runtime_error("Failed to map the shared memory!");
+    }
+
+    header = new (addr) shmHeader;
+    slots = reinterpret_cast<shmSlot *>(static_cast<uint8_t *>(addr) + sizeof(shmHeader));
+    for (uint32_t i = 0; i < slot_count; ++i) new (&slots[i].sequence) std::atomic<uint64_t>(0);
+
+    header->pixelCount = usb4kPixelCount;
+    header->slotCount = slot_count;
+    std::copy(std::begin(wavelengths), std::end(wavelengths), header->wavelengths);
+    header->published.store(0, std::memory_order_relaxed);
+    // readers check the magic last, so it is written once the rest is in place
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header->magic, shmMagic, sizeof(shmMagic));
+  }
+
+  shmPublisher::~shmPublisher(void)
+  {
+    if (header) munmap(header, mappedLength);
+    shm_unlink(name.c_str());
+  }
+
+  shmReader::shmReader(const std::string &shm_name)
+  {
+    int fd = shm_open(shm_name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+      throw std::runtime_error("Failed to open the shared memory, is the publisher running?");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(shmHeader)) {
+      close(fd);
+      throw std::runtime_error("Shared memory is not initialized!");
+    }
+
+    mappedLength = st.st_size;
+    void *addr = mmap(NULL, mappedLength, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+      throw std::runtime_error("Failed to map the shared memory!");
+
+    header = static_cast<shmHeader *>(addr);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (std::memcmp(header->magic, shmMagic, sizeof(shmMagic)) != 0 || header->pixelCount != usb4kPixelCount ||
+	mappedLength < sizeof(shmHeader) + sizeof(shmSlot) * header->slotCount) {
+      munmap(addr, mappedLength);
+      throw std::runtime_error("Not a spectrum ring in the shared memory!");
+    }
+
+    slots = reinterpret_cast<const shmSlot *>(static_cast<const uint8_t *>(addr) + sizeof(shmHeader));
+    cursor = published();
+  }
+
+  shmReader::~shmReader(void)
+  {
+    if (header) munmap(header, mappedLength);
+  }
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+
+#include "archive.hpp"
+
+namespace spectrometer {
+  constexpr uint32_t shmDefaultSlots = 64;
+
+  struct alignas(64) shmSlot {
+    // seqlock: odd while the slot is being written, 2*(frame+1) once frame is complete
+    std::atomic<uint64_t> sequence;
+    frameMetadata meta;
+    uint16_t raw[usb4kPixelCount];
+  };
+
+  struct alignas(64) shmHeader {
+    char magic[8];
+    uint32_t pixelCount;
+    uint32_t slotCount;
+    float wavelengths[usb4kPixelCount];
+    alignas(64) std::atomic<uint64_t> published; // frames published so far
+  };
+
+  /*
+    Publishes frames into a ring of slots in POSIX shared memory (/dev/shm).
+    The producer never waits for nor knows about the readers; a reader that
+    falls more than slotCount frames behind loses the overwritten ones.
+  */
+  class shmPublisher {
+  private:
+    std::string name;
+    shmHeader *header = NULL;
+    shmSlot *slots = NULL;
+    size_t mappedLength = 0;
+
+  public:
+    shmPublisher(const std::string &shm_name, const std::array<float, usb4kPixelCount> &wavelengths,
+		 uint32_t slot_count=shmDefaultSlots);
+    virtual ~shmPublisher(void);
+
+    shmPublisher(const shmPublisher &) = delete;
+    shmPublisher& operator=(const shmPublisher &) = delete;
+
+    void publish(const frameMetadata &meta, const uint16_t *raw) {
+      uint64_t n = header->published.load(std::memory_order_relaxed);
+      shmSlot &slot = slots[n % header->slotCount];
+
+      slot.sequence.store(2*n + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      slot.meta = meta;
+      std::memcpy(slot.raw, raw, sizeof(slot.raw));
+      slot.sequence.store(2*n + 2, std::memory_order_release);
+
+      header->published.store(n + 1, std::memory_order_release);
+    }
+
+    uint64_t published(void) const { return header->published.load(std::memory_order_relaxed); }
+  };
+
+  class shmReader {
+  private:
+    shmHeader *header = NULL;
+    const shmSlot *slots = NULL;
+    size_t mappedLength = 0;
+    uint64_t cursor = 0;
+    uint64_t dropped = 0;
+
+  public:
+    // Starts at the newest frame; older ones already in the ring are skipped
+    shmReader(const std::string &shm_name);
+    virtual ~shmReader(void);
+
+    shmReader(const shmReader &) = delete;
+    shmReader& operator=(const shmReader &) = delete;
+
+    uint64_t published(void) const { return header->published.load(std::memory_order_acquire); }
+    uint32_t slotCount(void) const { return header->slotCount; }
+    const float* getWavelengths(void) const { return header->wavelengths; }
+
+    /*
+      Zero-copy access to frame n: f(meta, raw) runs on the shared slot and the
+      result is only valid if view() returns true afterwards, i.e. the slot was
+      not overwritten meanwhile. False as well if n is not published yet.
+    */
+    template <typename F>
+    bool view(uint64_t n, F f) const {
+      const shmSlot &slot = slots[n % header->slotCount];
+      uint64_t before = slot.sequence.load(std::memory_order_acquire);
+      if (before != 2*n + 2) return false;
+      f(slot.meta, slot.raw);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return slot.sequence.load(std::memory_order_relaxed) == before;
+    }
+
+    bool read(uint64_t n, frameMetadata &meta, uint16_t *raw) const {
+      return view(n, [&meta, raw](const frameMetadata &m, const uint16_t *r) {
+	  meta = m;
+	  std::memcpy(raw, r, sizeof(uint16_t) * usb4kPixelCount);
+	});
+    }
+
+    // Copies the next unread frame if any, jumping ahead when lapped by the producer
+    bool next(frameMetadata &meta, uint16_t *raw) {
+      while (true) {
+	uint64_t head = published();
+	if (cursor >= head) return false;
+	if (head - cursor > header->slotCount) {
+	  dropped += head - cursor - header->slotCount;
+	  cursor = head - header->slotCount;
+	}
+	if (read(cursor, meta, raw)) { ++cursor; return true; }
+	++dropped, ++cursor; // overwritten while copying
+      }
+    }
+
+    uint64_t getDropped(void) const { return dropped; }
+  };
+}
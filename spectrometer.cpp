@@ -316,5 +316,51 @@ namespace spectrometer {
     if (usbDevices) libusb_free_device_list(usbDevices, 1);
     libusb_exit(NULL);
   }
+
+  std::vector<libusb_pollfd> getPollFds(void)
+  {
+    const struct libusb_pollfd **pollfds = libusb_get_pollfds(NULL);
+    if (!pollfds)
+      throw std::runtime_error("Failed to retrieve the libusb file descriptors!");
+
+    std::vector<libusb_pollfd> fds;
+    for (int i = 0; pollfds[i]; ++i) fds.push_back(*pollfds[i]);
+    libusb_free_pollfds(pollfds);
+
+    return fds;
+  }
+
+  void setPollFdNotifiers(libusb_pollfd_added_cb added, libusb_pollfd_removed_cb removed, void *user_data)
+  {
+    libusb_set_pollfd_notifiers(NULL, added, removed, user_data);
+  }
+
+  bool pollFdsHandleTimeouts(void)
+  {
+    // false: the caller has to wake up for getNextTimeout() as well as for the descriptors
+    return libusb_pollfds_handle_timeouts(NULL) != 0;
+  }
+
+  int getNextTimeout(void)
+  {
+    struct timeval tv;
+    int ret = libusb_get_next_timeout(NULL, &tv);
+    if (ret < 0)
+      throw std::runtime_error("Failed to retrieve the next libusb timeout!");
+    if (ret == 0) return -1;
+    return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+  }
+
+  int handleEvents(int timeout_ms)
+  {
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    int ret = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+    if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+      throw std::runtime_error("Failed to handle the libusb events!");
+    return ret;
+  }
   
 }
@@ -4,6 +4,10 @@
 #include <sstream>
 #include <string>
 #include <array>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <limits>
 
 #include <chrono>
 #include <thread>
@@ -13,6 +17,8 @@
 
 #include <libusb-1.0/libusb.h>
 
+#include "timing.hpp"
+
 namespace spectrometer {
   void initializeUSBStack(void);
 
@@ -24,13 +30,58 @@ namespace spectrometer {
   libusb_device* filterDevice(int vid, int pid, int index);
   void deinitializeUSBStack(void);
 
+  // Event-loop integration. All usb4k instances share the default libusb context,
+  // so one thread polling these descriptors can drive every attached spectrometer
+  // through the submit*() calls of usb4k.
+  std::vector<libusb_pollfd> getPollFds(void);
+  void setPollFdNotifiers(libusb_pollfd_added_cb added, libusb_pollfd_removed_cb removed, void *user_data);
+  bool pollFdsHandleTimeouts(void);
+  int getNextTimeout(void); // [ms] until libusb needs handleEvents() for a timeout, -1 if none
+  int handleEvents(int timeout_ms=0);
+
   constexpr int usb4kPixelCount = 256*15;
   constexpr std::array<int, 13> usb4kEdarkIndices = { 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17 };
+  // a range, as kernels::offsetCorrect takes them
+  static_assert(usb4kEdarkIndices.back() - usb4kEdarkIndices.front() + 1 == int(usb4kEdarkIndices.size()));
   constexpr int usb4kActivePixelBegin = 21;
   constexpr int usb4kActivePixelEnd = 3669;
   constexpr int usb4kDefaultTimeout = 10;
+  constexpr uint16_t usb4kSaturationLevel = 65535;
+
+  // Wavelength [nm] of every pixel from the 3rd order calibration polynomial
+  inline void wavelengthsFromCoeffs(const float *coeffs, std::array<float, usb4kPixelCount> &wavelengths) {
+    for (int i = 0; i < usb4kPixelCount; ++i) {
+      double x = i; // i*i*i overflows int beyond pixel 1290
+      wavelengths[i] = coeffs[0] + x*coeffs[1] + x*x*coeffs[2] + x*x*x*coeffs[3];
+    }
+  }
   
-  class usb4k {
+  struct frameMetadata {
+    uint64_t index;
+    int64_t timestamp;   // [ns] since the epoch
+    int32_t integration; // [us]
+    float temperature;   // PCB [C], NaN if not read
+  };
+
+  /*
+    Anything delivering raw frames with their calibration: the device itself,
+    or a recording played back (replaySource in replay.hpp), so processing
+    code written against it runs the same on both.
+  */
+  class frameSource {
+  public:
+    virtual ~frameSource(void) {}
+
+    // Blocks for the next frame; raw stays valid until the next call. False at the end.
+    virtual bool next(frameMetadata &meta, const uint16_t *&raw) = 0;
+
+    virtual int getIntegrationTime(void) const = 0;
+    virtual const std::string& getSerialNumber(void) const = 0;
+    virtual const float* getWavelengthCoeffs(void) const = 0;
+    virtual const float* getLinearityCoeffs(void) const = 0;
+  };
+
+  class usb4k : public frameSource {
   private:
     libusb_device_handle *deviceHandle = NULL;
     bool needReattach = false;
@@ -58,38 +109,104 @@ namespace spectrometer {
     std::array<float, usb4kPixelCount> spectrumWavelengths;
     std::array<uint16_t, usb4kPixelCount> spectrumAmplitudes;
     int integrationTime;
+    uint64_t frameIndex = 0;
+    frameClock timing;
+    frameTimestamps lastTimestamps = {};
+    int triggerMode = 0;
+    int triggerTimeout = 0; // [ms] for the first packet outside the normal mode, 0 adaptive
+    bool lateFrame = false; // requested, but its first packet timed out
+    adaptiveTimeout firstPacketTimeout, packetTimeout;
+
+  public:
+    typedef std::function<void(int status, std::array<uint16_t, usb4kPixelCount>& spectrum)> spectrumCallback;
+    typedef std::function<void(int status, const uint8_t *reply, int len)> commandCallback;
+
+  private:
+    // Asynchronous transfers, completed from handleEvents()
+    struct asyncCommand {
+      uint8_t request[64];
+      int requestLength;
+      int replyLength;
+      commandCallback callback;
+    };
+
+    libusb_transfer *commandTransfer = NULL;
+    uint8_t commandBuffer[64];
+    std::deque<asyncCommand> commandQueue;
+    bool commandReplying = false;
+
+    // request(EP1), first 4 packets(EP6), remaining 11 packets(EP2), sync byte(EP2)
+    libusb_transfer *spectrumTransfers[4] = { NULL, NULL, NULL, NULL };
+    uint8_t spectrumRequest[1] = { 0x09 };
+    uint8_t spectrumSync[1];
+    std::array<uint16_t, usb4kPixelCount> asyncAmplitudes;
+    spectrumCallback pendingSpectrum;
+    int spectrumPending = 0;
+    int spectrumStatus = LIBUSB_TRANSFER_COMPLETED;
     
+    // libusb status (0 or LIBUSB_ERROR_*) instead of an exception, for the acquisition path
+    inline int tryTransfer(uint8_t endpoint, uint8_t *buf, int len, int &transferred, int timeout) {
+      return libusb_bulk_transfer(deviceHandle, endpoint, buf, len, &transferred, timeout);
+    }
+
     inline int writeEP1(uint8_t *buf, int len, int timeout=usb4kDefaultTimeout) {
-      int ret, inouts;
-      ret = libusb_bulk_transfer(deviceHandle, 0x01, buf, len, &inouts, timeout);
-      if (ret != 0)
+      int inouts;
+      if (tryTransfer(0x01, buf, len, inouts, timeout) != 0)
 	throw std::runtime_error("Failed to transfer the data to out_EP1!");
       //printf("%d transferred.\n", inouts);
       return inouts;
     }
     
     inline int readEP1(uint8_t *buf, int len, int timeout=usb4kDefaultTimeout) {
-      int ret, inouts;
-      ret = libusb_bulk_transfer(deviceHandle, 0x81, buf, len, &inouts, timeout);
-      if (ret != 0)
-    throw std::runtime_error("Failed to receive the data from in_EP1!");
+      int inouts;
+      if (tryTransfer(0x81, buf, len, inouts, timeout) != 0)
+	throw std::runtime_error("Failed to receive the data from in_EP1!");
       //printf("%d received.\n", inouts);
       return inouts;
     }
     
     inline int readEP6(uint8_t *buf, int len, int timeout=usb4kDefaultTimeout) {
-      int ret, inouts;
-      ret = libusb_bulk_transfer(deviceHandle, 0x86, buf, len, &inouts, timeout);
-      if (ret != 0) throw std::runtime_error("Failed to recevice the data from inEP2!");
+      int inouts;
+      if (tryTransfer(0x86, buf, len, inouts, timeout) != 0)
+	throw std::runtime_error("Failed to recevice the data from inEP6!");
       return inouts;
     }
     
     inline int readEP2(uint8_t *buf, int len, int timeout=1000) {
-      int ret, inouts;
-      ret = libusb_bulk_transfer(deviceHandle, 0x82, buf, len, &inouts, timeout);
-      if (ret != 0) throw std::runtime_error("Failed to recevice the data from inEP2!");
+      int inouts;
+      if (tryTransfer(0x82, buf, len, inouts, timeout) != 0)
+	throw std::runtime_error("Failed to recevice the data from inEP2!");
       return inouts;
     }
+
+    inline void copyPacket(const uint16_t *packet, int i) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      std::copy(packet, packet+256, spectrumAmplitudes.begin()+i*256);
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      for (int j = 0; j < 256; ++j)
+	spectrumAmplitudes[i*256 + j] = __builtin_bswap16(packet[j]);
+#endif
+    }
+
+    // Reads and drops what is left of a frame in EP6 and EP2, so that the next read starts on a
+    // first packet; an endpoint that stalled is cleared on the way
+    void drainFrame(int timeout) {
+      int len;
+      for (uint8_t endpoint : { uint8_t(0x86), uint8_t(0x82) })
+	for (int k = 0; k < 16; ++k) {
+	  int status = tryTransfer(endpoint, temperalBuffer, 512, len, timeout);
+	  if (status == LIBUSB_ERROR_PIPE) libusb_clear_halt(deviceHandle, endpoint);
+	  if (status != 0) break;
+	}
+    }
+
+    // First packet: the integration (or the trigger) and the readout, then the packets
+    // following each other. Both start from the old fixed values.
+    void resetTimeouts(void) {
+      int frame = integrationTime / 1000;
+      firstPacketTimeout.reset(std::max(usb4kDefaultTimeout, int(integrationTime * 2.1 / 1000.0)), frame + 2);
+      packetTimeout.reset(usb4kDefaultTimeout, 2);
+    }
     
     void initializeUSB4K(void) {
       temperalBuffer[0] = 0x01;
@@ -190,13 +307,7 @@ namespace spectrometer {
       wavelengthCoeffs[2] = queryNumeric(0x03);
       wavelengthCoeffs[3] = queryNumeric(0x04);
 
-      for (int i = 0; i < usb4kPixelCount; ++i) {
-	spectrumWavelengths[i] = wavelengthCoeffs[0];
-	spectrumWavelengths[i] += i*wavelengthCoeffs[1];
-	spectrumWavelengths[i] += i*i*wavelengthCoeffs[2];
-	spectrumWavelengths[i] += i*i*i*wavelengthCoeffs[3];
-	//std::cout << spectrumWavelengths[i] << (i < pixelCount-1 ? ',':'\n');
-      }
+      wavelengthsFromCoeffs(wavelengthCoeffs, spectrumWavelengths);
   
       lightConstant = queryNumeric(0x05);
   
@@ -242,7 +353,115 @@ namespace spectrometer {
       std::cout << "Firmware Ver.: " << readFirmwareVer() << std::endl;
 
       integrationTime = getIntegration();
+      resetTimeouts();
       //setIntegration(1000, true);
+
+      setupAsync();
+    }
+
+    void setupAsync(void) {
+      commandTransfer = libusb_alloc_transfer(0);
+      for (auto &t : spectrumTransfers) t = libusb_alloc_transfer(0);
+      if (!commandTransfer || !spectrumTransfers[0] || !spectrumTransfers[1] || !spectrumTransfers[2] || !spectrumTransfers[3])
+	throw std::runtime_error("Failed to allocate the asynchronous transfers!");
+
+      uint8_t *amplitudes = reinterpret_cast<uint8_t *>(asyncAmplitudes.data());
+      libusb_fill_bulk_transfer(spectrumTransfers[0], deviceHandle, 0x01, spectrumRequest, 1,
+				spectrumTransferDone, this, usb4kDefaultTimeout);
+      libusb_fill_bulk_transfer(spectrumTransfers[1], deviceHandle, 0x86, amplitudes, 4*512,
+				spectrumTransferDone, this, usb4kDefaultTimeout);
+      libusb_fill_bulk_transfer(spectrumTransfers[2], deviceHandle, 0x82, amplitudes + 4*512, 11*512,
+				spectrumTransferDone, this, 1000);
+      libusb_fill_bulk_transfer(spectrumTransfers[3], deviceHandle, 0x82, spectrumSync, 1,
+				spectrumTransferDone, this, 1000);
+    }
+
+    // Called from the destructor, so it never throws. A transfer libusb still
+    // holds after the cancellation is leaked rather than freed under it.
+    void releaseAsync(void) {
+      try {
+	cancelAsync();
+      } catch (...) {}
+      for (int i = 0; i < 1000 && (spectrumPending > 0 || !commandQueue.empty()); ++i) {
+	try {
+	  handleEvents(1);
+	} catch (const std::exception &e) {
+	  std::cerr << "Releasing the asynchronous transfers: " << e.what() << std::endl;
+	} catch (...) {}
+      }
+
+      if (!commandQueue.empty())
+	std::cerr << "Command transfer still in flight, leaking it!" << std::endl;
+      else if (commandTransfer) libusb_free_transfer(commandTransfer);
+      if (spectrumPending > 0)
+	std::cerr << "Spectrum transfers still in flight, leaking them!" << std::endl;
+      else
+	for (auto t : spectrumTransfers) if (t) libusb_free_transfer(t);
+    }
+
+    void submitNextCommand(void) {
+      asyncCommand &cmd = commandQueue.front();
+      std::memcpy(commandBuffer, cmd.request, cmd.requestLength);
+      commandReplying = false;
+      libusb_fill_bulk_transfer(commandTransfer, deviceHandle, 0x01, commandBuffer, cmd.requestLength,
+				commandTransferDone, this, usb4kDefaultTimeout);
+      int ret = libusb_submit_transfer(commandTransfer);
+      if (ret != 0) {
+	commandCallback callback = std::move(cmd.callback);
+	commandQueue.pop_front();
+	if (callback) callback(LIBUSB_TRANSFER_ERROR, NULL, 0);
+	if (!commandQueue.empty()) submitNextCommand();
+      }
+    }
+
+    static void LIBUSB_CALL commandTransferDone(libusb_transfer *transfer) {
+      usb4k *self = static_cast<usb4k *>(transfer->user_data);
+      asyncCommand &cmd = self->commandQueue.front();
+
+      if (transfer->status == LIBUSB_TRANSFER_COMPLETED && !self->commandReplying && cmd.replyLength > 0) {
+	// the request went out, now collect the reply from in_EP1
+	self->commandReplying = true;
+	libusb_fill_bulk_transfer(transfer, self->deviceHandle, 0x81, self->commandBuffer, cmd.replyLength,
+				  commandTransferDone, self, usb4kDefaultTimeout);
+	if (libusb_submit_transfer(transfer) == 0) return;
+	transfer->status = LIBUSB_TRANSFER_ERROR;
+	transfer->actual_length = 0;
+      }
+
+      uint8_t reply[64];
+      int len = self->commandReplying ? transfer->actual_length : 0;
+      std::memcpy(reply, self->commandBuffer, len);
+      int status = transfer->status;
+
+      commandCallback callback = std::move(cmd.callback);
+      self->commandQueue.pop_front();
+      // keep the queue moving before the callback, which may submit more commands
+      if (!self->commandQueue.empty()) self->submitNextCommand();
+      if (callback) callback(status, reply, len);
+    }
+
+    static void LIBUSB_CALL spectrumTransferDone(libusb_transfer *transfer) {
+      usb4k *self = static_cast<usb4k *>(transfer->user_data);
+
+      if (transfer->status != LIBUSB_TRANSFER_COMPLETED && self->spectrumStatus == LIBUSB_TRANSFER_COMPLETED) {
+	self->spectrumStatus = transfer->status;
+	// the frame is lost anyway, so wake the others up not to wait for their timeouts
+	for (auto t : self->spectrumTransfers)
+	  if (t != transfer) libusb_cancel_transfer(t);
+      }
+
+      if (--self->spectrumPending > 0) return;
+
+      int status = self->spectrumStatus;
+      if (status == LIBUSB_TRANSFER_COMPLETED && self->spectrumSync[0] != 0x69)
+	status = LIBUSB_TRANSFER_ERROR;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      for (auto &v : self->asyncAmplitudes) v = __builtin_bswap16(v);
+#endif
+
+      spectrumCallback callback = std::move(self->pendingSpectrum);
+      self->pendingSpectrum = nullptr;
+      if (callback) callback(status, self->asyncAmplitudes);
     }
     
   public:
@@ -259,6 +478,7 @@ namespace spectrometer {
     }
     
     virtual ~usb4k(void) {
+      releaseAsync();
       delete [] temperalBuffer;
       if (deviceHandle) libusb_release_interface(deviceHandle, interface);
       if (needReattach) libusb_attach_kernel_driver(deviceHandle, 0);
@@ -289,6 +509,9 @@ namespace spectrometer {
       return usec;
     }
     
+    // Last integration time set through this handle, without asking the device
+    int getIntegrationTime(void) const override { return integrationTime; }
+    
     bool setIntegration(int usec, bool verify=false) {
       if (usec < 10 || usec > 65535000)
 	throw std::out_of_range("Integration time Out of range [10, 65535000] us!");
@@ -314,6 +537,7 @@ namespace spectrometer {
       }
 
       integrationTime = usec;
+      resetTimeouts();
   
       return true;
     }
@@ -352,8 +576,17 @@ namespace spectrometer {
       temperalBuffer[1] = mode & 0xff;
       temperalBuffer[2] = (mode >> 8) & 0xff;
       writeEP1(temperalBuffer, 3);
+      triggerMode = mode;
+      timing.reset();
     }
 
+    // How long the first packet may wait for a trigger outside NORMAL_TRIGGER,
+    // 0 to follow the measured waits like in the normal mode
+    void setTriggerTimeout(int ms) { triggerTimeout = ms; }
+    // Current libusb timeouts [ms] of the first and of the following packets
+    int getFirstPacketTimeout(void) const { return firstPacketTimeout.get(); }
+    int getPacketTimeout(void) const { return packetTimeout.get(); }
+
     float readPCBTemperature(void) {
       temperalBuffer[0] = 0x6c;
       writeEP1(temperalBuffer, 1);
@@ -366,79 +599,189 @@ namespace spectrometer {
       return spectrumWavelengths;
     }
 
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    std::array<uint16_t, usb4kPixelCount>& getRawSpectrum(bool request=true) {
+    const std::string& getSerialNumber(void) const override { return serialNumber; }
+    const float* getWavelengthCoeffs(void) const override { return wavelengthCoeffs; }
+    const float* getLinearityCoeffs(void) const override { return linearityCoeffs; }
+
+    /*
+      Reads a spectrum into getRawSpectrum()'s array without throwing. Returns
+      0, or the LIBUSB_ERROR_* of the transfer that failed: LIBUSB_ERROR_TIMEOUT
+      from the first packet is a missed trigger or no frame in time.
+      LIBUSB_ERROR_IO stands for a short packet or a wrong sync byte.
+
+      A frame that was requested but timed out may still arrive, so the next
+      call does not request again but reads that frame, and only a second
+      timeout gives up on it. After any other failure, a short or failed
+      first packet included, what is left of the frame is drained from the
+      endpoints before returning, so either way the call can just be
+      repeated.
+    */
+    int tryGetRawSpectrum(bool request=true) {
+      int i = 0, len, status;
+      if (request && lateFrame) request = false; // the frame of the last request is still due
+      lateFrame = false;
       if (request) {
 	// request spectrum
 	temperalBuffer[0] = 0x09;
-	writeEP1(temperalBuffer, 1);
+	if ((status = tryTransfer(0x01, temperalBuffer, 1, len, usb4kDefaultTimeout)) != 0) return status;
       }
+      int64_t requested = request ? monotonicNow() : 0;
+      int64_t waiting = requested ? requested : monotonicNow();
 
-      int i = 0, len;
-      int waiting = std::max(usb4kDefaultTimeout, int(integrationTime * 2.1 / 1000.0));
-      //int waiting = 0;
+      bool triggered = triggerMode != NORMAL_TRIGGER && triggerTimeout > 0;
       uint16_t *packet = reinterpret_cast<uint16_t *>(temperalBuffer);
-  
-      len = readEP6(temperalBuffer, 512, waiting);
-      std::copy(packet, packet+256, spectrumAmplitudes.begin());
-    
-      for (i = 1; i < 4; ++i) {
-	//std::cout << "packet: " << i << std::endl;
-	len = readEP6(temperalBuffer, 512);
-	assert(len == 512);
-	std::copy(packet, packet+256, spectrumAmplitudes.begin()+i*256);
+      status = tryTransfer(0x86, temperalBuffer, 512, len, triggered ? triggerTimeout : firstPacketTimeout.get());
+      if (status == 0 && len != 512) status = LIBUSB_ERROR_IO;
+      if (status == LIBUSB_ERROR_TIMEOUT) {
+	// waiting for a trigger is no sign of a tight timeout
+	if (triggerMode == NORMAL_TRIGGER) firstPacketTimeout.expired();
+	lateFrame = request;
+	return status;
       }
-    
-      for (; i < 15; ++i) {
-	//std::cout << "packet: " << i << std::endl;
-	len = readEP2(temperalBuffer, 512);
-	assert(len == 512);
-	std::copy(packet, packet+256, spectrumAmplitudes.begin()+i*256);
+      if (status != 0) {
+	// the rest of a frame that started badly is on its way all the same
+	drainFrame(packetTimeout.get());
+	return status;
+      }
+      int64_t arrived = monotonicNow();
+      if (!triggered) firstPacketTimeout.add(arrived - waiting);
+      copyPacket(packet, 0);
+
+      const int timeout = packetTimeout.get();
+      for (i = 1; i < 15; ++i) {
+	int64_t begin = monotonicNow();
+	// first 4 packets from EP6, the remaining 11 from EP2
+	status = tryTransfer(i < 4 ? 0x86 : 0x82, temperalBuffer, 512, len, timeout);
+	if (status == 0 && len != 512) status = LIBUSB_ERROR_IO;
+	if (status != 0) {
+	  if (status == LIBUSB_ERROR_TIMEOUT) packetTimeout.expired();
+	  drainFrame(packetTimeout.get());
+	  return status;
+	}
+	packetTimeout.add(monotonicNow() - begin);
+	copyPacket(packet, i);
       }
 
-      len = readEP2(temperalBuffer, 1);
-      assert(temperalBuffer[0] == 0x69);
-  
-      return spectrumAmplitudes;
+      if ((status = tryTransfer(0x82, temperalBuffer, 1, len, timeout)) == 0 && temperalBuffer[0] != 0x69)
+	status = LIBUSB_ERROR_IO;
+      if (status != 0) {
+	drainFrame(timeout);
+	return status;
+      }
+      timing.update(requested, arrived, monotonicNow(), integrationTime, lastTimestamps);
+      return 0;
     }
-#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+
+    // Throws what tryGetRawSpectrum() returns, with the endpoints drained the same way
     std::array<uint16_t, usb4kPixelCount>& getRawSpectrum(bool request=true) {
-      if (request) {
-	// request spectrum
-	temperalBuffer[0] = 0x09;
-	writeEP1(temperalBuffer, 1);
-      }
+      int status = tryGetRawSpectrum(request);
+      if (status != 0)
+	throw std::runtime_error(std::string("Failed to receive a spectrum: ") + libusb_error_name(status) + "!");
+      return spectrumAmplitudes;
+    }
 
-      int i = 0, len;
-      int waiting = int(integrationTime / 1000.0 * 2.1);
-      uint16_t *packet = reinterpret_cast<uint16_t *>(temperalBuffer);
-  
-      len = readEP6(temperalBuffer, 512, waiting);
-      for (int j = 0; j < 256; ++j)
-	spectrumAmplitudes[/*i*256 +*/ j] = __builtin_bswap16(packet[j]);
-    
-      for (i = 1; i < 4; ++i) {
-	std::cout << "packet: " << i << std::endl;
-	len = readEP6(temperalBuffer, 512);
-	assert(len == 512);
-	for (int j = 0; j < 256; ++j)
-	  spectrumAmplitudes[i*256 + j] = __builtin_bswap16(packet[j]);
-      }
-    
-      for (; i < 15; ++i) {
-	std::cout << "packet: " << i << std::endl;
-	len = readEP2(temperalBuffer, 512);
-	assert(len == 512);
-	for (int j = 0; j < 256; ++j)
-	  spectrumAmplitudes[i*256 + j] = __builtin_bswap16(packet[j]);
+    // Times of the last getRawSpectrum(), requestSent 0 if it did not request
+    const frameTimestamps& getLastTimestamps(void) const { return lastTimestamps; }
+    // Integration end to first packet [ns], shifts the estimated integration
+    void setReadoutLatency(int64_t ns) { timing.setReadoutLatency(ns); }
+
+    // frameSource: the next spectrum, stamped with the estimated end of its integration
+    bool next(frameMetadata &meta, const uint16_t *&raw) override {
+      raw = getRawSpectrum().data();
+      meta.index = frameIndex++;
+      meta.timestamp = lastTimestamps.realtime(lastTimestamps.integrationEnd);
+      meta.integration = integrationTime;
+      meta.temperature = std::numeric_limits<float>::quiet_NaN();
+      return true;
+    }
+
+    /*
+      Non-blocking counterparts of getRawSpectrum() and the EP1 commands.
+      The callbacks are invoked from spectrometer::handleEvents() on the thread
+      polling getPollFds(). Do not mix them with the blocking calls while any
+      asynchronous transfer is in flight, since both share the endpoints.
+    */
+    void submitSpectrum(spectrumCallback callback, bool request=true) {
+      if (spectrumPending > 0)
+	throw std::runtime_error("A spectrum is already in flight!");
+
+      pendingSpectrum = std::move(callback);
+      spectrumStatus = LIBUSB_TRANSFER_COMPLETED;
+      spectrumSync[0] = 0;
+      spectrumTransfers[1]->timeout = firstPacketTimeout.get();
+
+      // Every read is queued up front, so the host is already listening when the
+      // readout starts and no round trip is spent between the packets.
+      for (int i = request ? 0 : 1; i < 4; ++i) {
+	if (libusb_submit_transfer(spectrumTransfers[i]) != 0) {
+	  if (spectrumPending == 0) {
+	    pendingSpectrum = nullptr;
+	    throw std::runtime_error("Failed to submit the spectrum transfers!");
+	  }
+	  // the callback reports the failure once the submitted ones come back
+	  spectrumStatus = LIBUSB_TRANSFER_ERROR;
+	  for (int j = request ? 0 : 1; j < i; ++j) libusb_cancel_transfer(spectrumTransfers[j]);
+	  return;
+	}
+	++spectrumPending;
       }
+    }
 
-      len = readEP2(temperalBuffer, 1);
-      assert(temperalBuffer[0] == 0x69);
-  
-      return spectrumAmplitudes;
+    void submitCommand(const uint8_t *request, int len, int reply_len, commandCallback callback) {
+      if (len < 1 || len > 64 || reply_len < 0 || reply_len > 64)
+	throw std::out_of_range("EP1 command length Out of range [1, 64] bytes!");
+
+      asyncCommand cmd;
+      std::memcpy(cmd.request, request, len);
+      cmd.requestLength = len;
+      cmd.replyLength = reply_len;
+      cmd.callback = std::move(callback);
+      commandQueue.push_back(std::move(cmd));
+      if (commandQueue.size() == 1) submitNextCommand();
+    }
+
+    void submitIntegration(int usec, commandCallback callback) {
+      if (usec < 10 || usec > 65535000)
+	throw std::out_of_range("Integration time Out of range [10, 65535000] us!");
+
+      if (usec < 655000) usec = ((usec + 5) / 10) * 10;
+      else usec = ((usec + 500) / 1000) * 1000;
+
+      uint8_t cmd[5] = { 0x02, uint8_t(usec & 0xff), uint8_t((usec >> 8) & 0xff),
+			 uint8_t((usec >> 16) & 0xff), uint8_t((usec >> 24) & 0xff) };
+      submitCommand(cmd, 5, 0, [this, usec, callback](int status, const uint8_t *reply, int len) {
+	  if (status == LIBUSB_TRANSFER_COMPLETED) {
+	    integrationTime = usec;
+	    resetTimeouts();
+	  }
+	  if (callback) callback(status, reply, len);
+	});
+    }
+
+    void submitPCBTemperature(std::function<void(int status, float celsius)> callback) {
+      uint8_t cmd[1] = { 0x6c };
+      submitCommand(cmd, 1, 3, [callback](int status, const uint8_t *reply, int len) {
+	  if (status == LIBUSB_TRANSFER_COMPLETED && len != 3) status = LIBUSB_TRANSFER_ERROR;
+	  float celsius = status == LIBUSB_TRANSFER_COMPLETED ? 0.003906 * ((reply[2] << 8) + reply[1]) : 0;
+	  callback(status, celsius);
+	});
+    }
+
+    bool isSpectrumPending(void) const { return spectrumPending > 0; }
+    size_t pendingCommands(void) const { return commandQueue.size(); }
+
+    void cancelAsync(void) {
+      if (spectrumPending > 0)
+	for (auto t : spectrumTransfers) if (t) libusb_cancel_transfer(t);
+
+      // only the front command is on the wire, the queued ones are dropped here
+      while (commandQueue.size() > 1) {
+	commandCallback callback = std::move(commandQueue.back().callback);
+	commandQueue.pop_back();
+	if (callback) callback(LIBUSB_TRANSFER_CANCELLED, NULL, 0);
+      }
+      if (!commandQueue.empty() && commandTransfer) libusb_cancel_transfer(commandTransfer);
     }
-#endif
 
     void test(int integration_us) {
       ////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "spectrometer.hpp"
+#include "kernels.hpp"
+
+namespace spectrometer {
+  /*
+    Stitches the spectra of several spectrometers covering adjacent or
+    overlapping wavelength ranges into one spectrum on a common, evenly
+    spaced wavelength grid.
+
+    What depends only on the calibrations is computed once: for every device
+    the span of grid points its pixels [from, to) cover, and per point the
+    pixel pair to interpolate between, with the blend weight folded into
+    the two interpolation weights. The weight of a device at a wavelength
+    grows with the distance to the nearer end of its range and is normalized
+    over the devices covering that wavelength, so in an overlap one device
+    fades into the other while elsewhere the one device has weight 1. A
+    cycle is then one kernels::blendLinear pass per device over its span,
+    which grows with the points covered and not with the devices.
+
+    The spectra are dark corrected counts. Each is divided by its integration
+    time, so the result is in counts per millisecond whatever the devices
+    integrate, and multiplied by the gain of its device (1 unless set), for
+    differing responses. Grid points no device covers are NaN.
+
+    push() assembles the cycles of free running devices, one producer thread
+    each: a frame waits until every other device has one whose integration
+    overlaps its own (within the tolerance), and every complete cycle goes to
+    the sink. A newer frame of the same device replaces the waiting one, so
+    of devices integrating faster than the slowest only the frame that
+    overlaps its integration is used and the others are dropped, counted by
+    getUnpaired(); averaging them would blend spectra taken outside the
+    slow device's integration. Only the intake runs under the lock: the
+    completing push() swaps the frames out and stitches and calls the sink
+    after releasing it, so the other producers do not wait for that.
+  */
+  class spectralStitcher {
+  public:
+    typedef std::function<void(const frameMetadata &meta, const float *spectrum)> stitchSink;
+
+  private:
+    struct device {
+      int first = 0;             // grid points [first, first + index.size())
+      std::vector<int> index;    // lower pixel of the pair for each
+      std::vector<float> wa, wb; // interpolation times blend weights
+      float gain = 1;
+      bool pending = false;      // a frame waiting for the other devices
+      frameMetadata meta;
+      std::vector<float> spectrum;
+    };
+
+    // What a complete cycle is stitched from, outside the lock
+    struct cycle {
+      std::vector<std::vector<float>> spectra;
+      std::vector<const float *> inputs;
+      std::vector<int32_t> integrations;
+      std::vector<float> gains;
+      std::vector<float> output;
+    };
+
+    int from, to;
+    std::vector<float> grid;
+    std::vector<int> gaps; // grid points no device covers
+    std::vector<device> devices;
+
+    std::mutex lock;
+    int64_t tolerance = 0;
+    std::shared_ptr<const stitchSink> sink;
+    std::vector<std::unique_ptr<cycle>> spareCycles; // one per cycle being stitched at most
+    std::atomic<uint64_t> cycles{0}, unpaired{0};
+
+    // gains: per device, NULL for the ones set
+    void stitch(const float *const *spectra, const int32_t *integration_us, const float *gains, float *out) const {
+      std::fill(out, out + grid.size(), 0.0f);
+      for (size_t d = 0; d < devices.size(); ++d) {
+	const device &dev = devices[d];
+	if (integration_us[d] <= 0)
+	  throw std::invalid_argument("Stitching needs positive integration times!");
+	kernels::blendLinear(spectra[d], dev.index.data(), dev.wa.data(), dev.wb.data(),
+			     (gains ? gains[d] : dev.gain) * 1000.0f / integration_us[d], dev.index.size(),
+			     out + dev.first);
+      }
+      for (int j : gaps) out[j] = NAN;
+    }
+
+  public:
+    // wavelengths: usb4kPixelCount values per device, e.g. usb4k::getWavelengths(),
+    // ascending over [pixel_from, pixel_to); step_nm 0 for the finest pixel spacing of them
+    spectralStitcher(const std::vector<const float *> &wavelengths, double step_nm=0,
+		     int pixel_from=usb4kActivePixelBegin, int pixel_to=usb4kActivePixelEnd)
+      : from(pixel_from), to(pixel_to), devices(wavelengths.size()) {
+      if (wavelengths.empty())
+	throw std::invalid_argument("Stitching needs at least one device!");
+      if (from < 0 || to > usb4kPixelCount || to - from < 2)
+	throw std::out_of_range("Stitching pixel range Out of range!");
+      if (step_nm < 0)
+	throw std::invalid_argument("Stitching step must not be negative!");
+
+      double low = INFINITY, high = -INFINITY, finest = INFINITY;
+      for (const float *wl : wavelengths) {
+	for (int i = from + 1; i < to; ++i)
+	  if (!(wl[i] > wl[i - 1]))
+	    throw std::invalid_argument("Stitching needs wavelengths ascending over the pixels!");
+	low = std::min(low, double(wl[from]));
+	high = std::max(high, double(wl[to - 1]));
+	finest = std::min(finest, double(wl[to - 1] - wl[from]) / (to - from - 1));
+      }
+      const double step = step_nm > 0 ? step_nm : finest;
+      const int points = int((high - low) / step) + 1;
+      for (int j = 0; j < points; ++j) grid.push_back(low + j * step);
+
+      // blend weights: distance to the nearer end of each range covering a point
+      std::vector<double> weight(points * devices.size(), 0.0);
+      for (int j = 0; j < points; ++j) {
+	double sum = 0;
+	int covering = 0;
+	for (size_t d = 0; d < devices.size(); ++d) {
+	  const float *wl = wavelengths[d];
+	  if (grid[j] < wl[from] || grid[j] > wl[to - 1]) continue;
+	  weight[j * devices.size() + d] = std::min(grid[j] - wl[from], wl[to - 1] - grid[j]);
+	  sum += weight[j * devices.size() + d];
+	  ++covering;
+	}
+	if (covering == 0) { gaps.push_back(j); continue; }
+	for (size_t d = 0; d < devices.size(); ++d) {
+	  const float *wl = wavelengths[d];
+	  if (grid[j] < wl[from] || grid[j] > wl[to - 1]) continue;
+	  // only ends of ranges meet here: shared evenly
+	  double &w = weight[j * devices.size() + d];
+	  w = sum > 0 ? w / sum : 1.0 / covering;
+	}
+      }
+
+      for (size_t d = 0; d < devices.size(); ++d) {
+	const float *wl = wavelengths[d];
+	device &dev = devices[d];
+	dev.first = std::lower_bound(grid.begin(), grid.end(), wl[from]) - grid.begin();
+	const int last = std::upper_bound(grid.begin(), grid.end(), wl[to - 1]) - grid.begin();
+	int k = from;
+	for (int j = dev.first; j < last; ++j) {
+	  while (k < to - 2 && wl[k + 1] <= grid[j]) ++k;
+	  const double f = std::min(1.0, double(grid[j] - wl[k]) / (wl[k + 1] - wl[k]));
+	  const double w = weight[j * devices.size() + d];
+	  dev.index.push_back(k);
+	  dev.wa.push_back(w * (1 - f));
+	  dev.wb.push_back(w * f);
+	}
+	dev.spectrum.resize(usb4kPixelCount);
+      }
+    }
+
+    // One spectrum per device and their integration times [us] into size() points
+    void stitch(const float *const *spectra, const int32_t *integration_us, float *out) const {
+      stitch(spectra, integration_us, NULL, out);
+    }
+
+    // The frame of one device, dark corrected; returns true if it completed a cycle
+    bool push(int d, const frameMetadata &meta, const float *spectrum) {
+      if (meta.integration <= 0)
+	throw std::invalid_argument("Stitching needs positive integration times!");
+      std::unique_ptr<cycle> c;
+      std::shared_ptr<const stitchSink> target;
+      frameMetadata out = { 0, 0, 0, NAN };
+      {
+	std::lock_guard<std::mutex> guard(lock);
+	device &dev = devices.at(d);
+	if (dev.pending) ++unpaired;
+	dev.meta = meta;
+	std::copy(spectrum, spectrum + usb4kPixelCount, dev.spectrum.begin());
+	dev.pending = true;
+
+	// a common instant of all integrations
+	int64_t latestStart = std::numeric_limits<int64_t>::min(), earliestEnd = std::numeric_limits<int64_t>::max();
+	for (const device &e : devices) {
+	  if (!e.pending) return false;
+	  latestStart = std::max(latestStart, e.meta.timestamp - int64_t(e.meta.integration) * 1000);
+	  earliestEnd = std::min(earliestEnd, e.meta.timestamp);
+	}
+	if (latestStart - earliestEnd > tolerance) return false;
+
+	if (spareCycles.empty()) {
+	  c.reset(new cycle);
+	  c->spectra.assign(devices.size(), std::vector<float>(usb4kPixelCount));
+	  c->inputs.resize(devices.size());
+	  c->integrations.resize(devices.size());
+	  c->gains.resize(devices.size());
+	  c->output.resize(grid.size());
+	} else {
+	  c = std::move(spareCycles.back());
+	  spareCycles.pop_back();
+	}
+	out.index = cycles++;
+	for (size_t e = 0; e < devices.size(); ++e) {
+	  // the device gets the cycle's old buffer for its next frame
+	  c->spectra[e].swap(devices[e].spectrum);
+	  c->integrations[e] = devices[e].meta.integration;
+	  c->gains[e] = devices[e].gain;
+	  out.timestamp = std::max(out.timestamp, devices[e].meta.timestamp);
+	  out.integration = std::max(out.integration, devices[e].meta.integration);
+	  devices[e].pending = false;
+	}
+	target = sink;
+      }
+
+      for (size_t e = 0; e < devices.size(); ++e) c->inputs[e] = c->spectra[e].data();
+      stitch(c->inputs.data(), c->integrations.data(), c->gains.data(), c->output.data());
+      try {
+	if (target) (*target)(out, c->output.data());
+      } catch (...) {
+	std::lock_guard<std::mutex> guard(lock);
+	spareCycles.push_back(std::move(c));
+	throw;
+      }
+      std::lock_guard<std::mutex> guard(lock);
+      spareCycles.push_back(std::move(c));
+      return true;
+    }
+
+    // Called from push() with every stitched spectrum, which is only valid during the call;
+    // meta has the cycle as index, the latest end of integration and the longest integration.
+    // Outside the lock, so producers completing cycles together call it at once, and not
+    // necessarily in the order of meta.index.
+    void setSink(stitchSink s) {
+      std::shared_ptr<const stitchSink> shared;
+      if (s) shared = std::make_shared<const stitchSink>(std::move(s));
+      std::lock_guard<std::mutex> guard(lock);
+      sink = std::move(shared);
+    }
+    // [ns] by which the integrations of a cycle may miss each other
+    void setTolerance(int64_t ns) { std::lock_guard<std::mutex> guard(lock); tolerance = ns; }
+    void setGain(int d, float gain) { std::lock_guard<std::mutex> guard(lock); devices.at(d).gain = gain; }
+    float getGain(int d) { std::lock_guard<std::mutex> guard(lock); return devices.at(d).gain; }
+
+    size_t size(void) const { return grid.size(); }
+    size_t getDevices(void) const { return devices.size(); }
+    const std::vector<float>& getWavelengths(void) const { return grid; }
+    // Grid points covered by device d: [first, first + count)
+    int getFirst(int d) const { return devices.at(d).first; }
+    int getCount(int d) const { return devices.at(d).index.size(); }
+    uint64_t getCycles(void) const { return cycles; }
+    // Frames replaced by a newer one of their device before a cycle took them
+    uint64_t getUnpaired(void) const { return unpaired; }
+  };
+}
@@ -1,6 +1,2012 @@
 #include <opencv2/opencv.hpp>
 
-int main(void)
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cmath>
+
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <omp.h>
+
+#include "shm.hpp"
+#include "server.hpp"
+#include "codec.hpp"
+#include "roi.hpp"
+#include "filters.hpp"
+#include "matcher.hpp"
+#include "ratio.hpp"
+#include "recorder.hpp"
+#include "replay.hpp"
+#include "graph.hpp"
+#include "acquisition.hpp"
+#include "timing.hpp"
+#include "pixelstats.hpp"
+#include "preview.hpp"
+#include "waterfall.hpp"
+#include "pca.hpp"
+#include "stitch.hpp"
+#include "awaitable.hpp"
+#include "darklibrary.hpp"
+#include "hdr.hpp"
+#include "peaks.hpp"
+#include "batch.hpp"
+
+#if defined(HAVE_ZSTD)
+# include <zstd.h>
+#endif
+#if defined(HAVE_LZ4)
+# include <lz4.h>
+#endif
+
+/*
+  Multi-process throughput of the shared memory ring: the parent publishes
+  frames as fast as it can while the forked readers follow with next().
+  A frame is corrupt if its payload does not match its index.
+*/
+static bool testShmThroughput(int readers, int frames)
+{
+  struct result { uint64_t received, dropped, corrupt; double seconds; };
+
+  std::array<float, spectrometer::usb4kPixelCount> wavelengths;
+  wavelengths.fill(0);
+  spectrometer::shmPublisher publisher("/usb4k_test_preprocess", wavelengths);
+
+  int ready[2], results[2];
+  if (pipe(ready) != 0 || pipe(results) != 0) return false;
+
+  for (int r = 0; r < readers; ++r) {
+    if (fork() != 0) continue;
+
+    spectrometer::shmReader reader("/usb4k_test_preprocess");
+    if (write(ready[1], "r", 1) != 1) _exit(1);
+
+    spectrometer::frameMetadata meta;
+    std::vector<uint16_t> raw(spectrometer::usb4kPixelCount);
+    result res = { 0, 0, 0, 0 };
+    auto start = std::chrono::steady_clock::now();
+    while (res.received + reader.getDropped() < uint64_t(frames)) {
+      if (!reader.next(meta, raw.data())) { sched_yield(); continue; }
+      ++res.received;
+      if (raw[0] != uint16_t(meta.index) || raw[spectrometer::usb4kPixelCount-1] != uint16_t(meta.index + 1))
+	++res.corrupt;
+    }
+    res.dropped = reader.getDropped();
+    res.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (write(results[1], &res, sizeof(res)) != sizeof(res)) _exit(1);
+    _exit(0);
+  }
+
+  char c;
+  for (int r = 0; r < readers; ++r)
+    if (read(ready[0], &c, 1) != 1) return false;
+
+  spectrometer::frameMetadata meta = { 0, 0, 3800, 0 };
+  std::vector<uint16_t> raw(spectrometer::usb4kPixelCount);
+  auto start = std::chrono::steady_clock::now();
+  for (int n = 0; n < frames; ++n) {
+    meta.index = n;
+    std::fill(raw.begin(), raw.end() - 1, uint16_t(n));
+    raw.back() = uint16_t(n + 1);
+    publisher.publish(meta, raw.data());
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  bool ok = true;
+  const double frameBytes = sizeof(uint16_t) * spectrometer::usb4kPixelCount;
+  std::cout << "shm publisher: " << frames / seconds << " frames/s, "
+	    << frames * frameBytes / seconds / 1e9 << " GB/s\n";
+  for (int r = 0; r < readers; ++r) {
+    result res;
+    if (read(results[0], &res, sizeof(res)) != sizeof(res)) { ok = false; break; }
+    std::cout << "  reader: " << res.received << " received, " << res.dropped << " dropped, "
+	      << res.corrupt << " corrupt, " << res.received * frameBytes / res.seconds / 1e9 << " GB/s\n";
+    if (res.corrupt) ok = false;
+  }
+  while (wait(NULL) > 0);
+
+  close(ready[0]); close(ready[1]);
+  close(results[0]); close(results[1]);
+  return ok;
+}
+
+/*
+  Streaming server with forked local clients: a fast one taking every frame
+  and a slow one asking for every 2nd frame binned by 4 and compressed, which
+  has to lose frames (and restart from a keyframe) rather than slow the other
+  one down.
+*/
+static bool testStreamServer(int frames)
+{
+  const std::string path = "/tmp/usb4k_test_preprocess.sock";
+  struct result { uint64_t received, corrupt; uint32_t pixels; };
+
+  std::unique_ptr<spectrometer::streamServer> server(new spectrometer::streamServer(32));
+  server->listenUnix(path);
+  server->start();
+
+  int results[2];
+  if (pipe(results) != 0) return false;
+
+  const uint32_t binnings[2] = { 1, 4 };
+  for (int r = 0; r < 2; ++r) {
+    if (fork() != 0) continue;
+
+    result res = { 0, 0, 0 };
+    try {
+      spectrometer::streamClient client(path);
+      client.subscribe(r + 1, binnings[r], r == 1); // the slow one compressed, so its drops reset the encoder
+      spectrometer::frameMetadata meta;
+      std::vector<uint16_t> raw;
+      while (true) {
+	client.receive(meta, raw);
+	++res.received;
+	res.pixels = raw.size();
+	if (raw.front() != uint16_t(meta.index)) ++res.corrupt;
+	if (r == 1) usleep(1000);
+      }
+    } catch (std::runtime_error &) {
+      // the server went away after the last frame
+    }
+    if (write(results[1], &res, sizeof(res)) != sizeof(res)) _exit(1);
+    _exit(0);
+  }
+
+  // wait for both subscriptions before publishing
+  for (int i = 0; i < 1000; ++i) {
+    auto stats = server->getClientStats();
+    if (stats.size() == 2) break;
+    usleep(1000);
+  }
+  usleep(10000);
+
+  spectrometer::frameMetadata meta = { 0, 0, 3800, 0 };
+  std::vector<uint16_t> raw(spectrometer::usb4kPixelCount);
+  for (int n = 0; n < frames; ++n) {
+    meta.index = n;
+    std::fill(raw.begin(), raw.end(), uint16_t(n));
+    server->publish(meta, raw.data());
+    if (n % 8 == 0) usleep(100);
+  }
+
+  bool ok = true;
+  for (int i = 0; i < 2000; ++i) {
+    auto stats = server->getClientStats();
+    bool drained = true;
+    for (auto &s : stats) drained &= s.lagFrames == 0;
+    if (drained) {
+      for (auto &s : stats)
+	std::cout << "stream client " << s.fd << ": " << s.framesSent << " sent, " << s.framesDropped << " dropped, "
+		  << s.bandwidth / 1e6 << " MB/s, lag " << s.lagSeconds * 1e3 << " ms\n";
+      break;
+    }
+    usleep(1000);
+  }
+  server.reset(); // hangs the clients up
+
+  for (int r = 0; r < 2; ++r) {
+    result res;
+    if (read(results[0], &res, sizeof(res)) != sizeof(res)) { ok = false; break; }
+    std::cout << "  client " << r << ": " << res.received << " frames of " << res.pixels << " pixels, "
+	      << res.corrupt << " corrupt\n";
+    if (res.corrupt || res.received == 0 || res.pixels != spectrometer::usb4kPixelCount / binnings[r]) ok = false;
+  }
+  while (wait(NULL) > 0);
+
+  close(results[0]); close(results[1]);
+  return ok;
+}
+
+/*
+  Simulated USB4000 frames: a few Gaussian lines drifting slowly over a
+  sloped baseline, with shot and read noise.
+*/
+static std::vector<std::vector<uint16_t>> simulateFrames(int frames, unsigned seed=1)
+{
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> noise(0, 1);
+  std::vector<std::vector<uint16_t>> out(frames, std::vector<uint16_t>(spectrometer::usb4kPixelCount));
+
+  for (int f = 0; f < frames; ++f) {
+    for (int i = 0; i < spectrometer::usb4kPixelCount; ++i) {
+      double v = 1500 + 0.1*i;
+      v += 30000 * std::exp(-0.5 * std::pow((i - 900 - 0.01*f) / 3.0, 2));
+      v += 8000 * std::exp(-0.5 * std::pow((i - 2200) / 6.0, 2));
+      v += 2000 * std::exp(-0.5 * std::pow((i - 3100 + 0.02*f) / 2.0, 2));
+      v += noise(rng) * std::sqrt(v) + noise(rng) * 8;
+      out[f][i] = uint16_t(std::min(std::max(v, 0.0), 65535.0));
+    }
+  }
+  return out;
+}
+
+static std::vector<std::vector<uint16_t>> loadFrames(const char *path, size_t limit)
+{
+  spectrometer::archiveReader archive(path);
+  std::vector<std::vector<uint16_t>> out;
+  for (size_t i = 0; i < archive.size() && i < limit; ++i)
+    out.emplace_back(archive[i].raw, archive[i].raw + spectrometer::usb4kPixelCount);
+  return out;
+}
+
+/*
+  Round trip of the codec for every kernel variant, then ratio and speed
+  against zstd/LZ4 (when built with them) on the given frames.
+*/
+static bool testCodec(const std::vector<std::vector<uint16_t>> &frames, const char *label)
+{
+  using namespace spectrometer;
+  using clock = std::chrono::steady_clock;
+  const size_t frameBytes = usb4kPixelCount * sizeof(uint16_t);
+  const size_t total = frames.size() * frameBytes;
+  bool ok = true;
+
+  std::vector<uint8_t> encoded(codec::maxEncodedSize(usb4kPixelCount) * frames.size());
+  std::vector<size_t> sizes(frames.size());
+  std::vector<uint16_t> decoded(usb4kPixelCount);
+
+  std::cout << "codec on " << frames.size() << " " << label << " frames:\n";
+  const kernels::isa best = kernels::detectISA();
+  for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+    kernels::activeISA() = kernels::isa(isa);
+
+    spectrumEncoder encoder;
+    auto start = clock::now();
+    size_t offset = 0;
+    for (size_t f = 0; f < frames.size(); ++f) {
+      sizes[f] = encoder.encode(frames[f].data(), encoded.data() + offset);
+      offset += sizes[f];
+    }
+    double encodeSeconds = std::chrono::duration<double>(clock::now() - start).count();
+
+    spectrumDecoder decoder;
+    start = clock::now();
+    offset = 0;
+    size_t mismatches = 0;
+    for (size_t f = 0; f < frames.size(); ++f) {
+      offset += decoder.decode(encoded.data() + offset, sizes[f], decoded.data());
+      if (!std::equal(decoded.begin(), decoded.end(), frames[f].begin())) ++mismatches;
+    }
+    double decodeSeconds = std::chrono::duration<double>(clock::now() - start).count();
+
+    std::cout << "  usb4k codec (" << (isa == kernels::AVX2 ? "avx2" : isa == kernels::SSE ? "sse" : "scalar") << "): ratio "
+	      << double(total) / offset << ", encode " << total / encodeSeconds / 1e9 << " GB/s, decode "
+	      << total / decodeSeconds / 1e9 << " GB/s, " << mismatches << " mismatches\n";
+    if (mismatches) ok = false;
+  }
+  kernels::activeISA() = best;
+
+#if defined(HAVE_ZSTD)
+  {
+    std::vector<uint8_t> out(ZSTD_compressBound(frameBytes));
+    size_t compressed = 0;
+    auto start = clock::now();
+    for (auto &f : frames) compressed += ZSTD_compress(out.data(), out.size(), f.data(), frameBytes, 1);
+    double seconds = std::chrono::duration<double>(clock::now() - start).count();
+    std::cout << "  zstd -1: ratio " << double(total) / compressed << ", encode " << total / seconds / 1e9 << " GB/s\n";
+  }
+#endif
+#if defined(HAVE_LZ4)
+  {
+    std::vector<char> out(LZ4_compressBound(frameBytes));
+    size_t compressed = 0;
+    auto start = clock::now();
+    for (auto &f : frames)
+      compressed += LZ4_compress_default(reinterpret_cast<const char *>(f.data()), out.data(), frameBytes, out.size());
+    double seconds = std::chrono::duration<double>(clock::now() - start).count();
+    std::cout << "  lz4: ratio " << double(total) / compressed << ", encode " << total / seconds / 1e9 << " GB/s\n";
+  }
+#endif
+
+  return ok;
+}
+
+/*
+  ROI engine against a direct per-pixel integration of the same bands, for
+  every prefix-sum variant, then the frame rate with a thousand bands.
+*/
+static bool testRoiEngine(int rois, int frames)
+{
+  using namespace spectrometer;
+  std::array<float, usb4kPixelCount> wavelengths;
+  const float coeffs[4] = { 178.0f, 0.21f, -1.0e-5f, -1.0e-10f };
+  wavelengthsFromCoeffs(coeffs, wavelengths);
+
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> where(wavelengths[0], wavelengths[usb4kPixelCount-1]);
+  std::uniform_real_distribution<float> width(0.05f, 40.0f);
+  std::vector<band> bands(rois);
+  for (auto &b : bands) { b.from = where(rng); b.to = b.from + width(rng); }
+
+  auto simulated = simulateFrames(frames);
+  std::vector<std::array<float, usb4kPixelCount>> spectra(frames);
+  for (int f = 0; f < frames; ++f)
+    std::copy(simulated[f].begin(), simulated[f].end(), spectra[f].begin());
+
+  // reference: the overlap of every pixel span with the band
+  std::vector<float> reference(rois);
+  for (int b = 0; b < rois; ++b) {
+    double sum = 0;
+    for (int i = 0; i < usb4kPixelCount; ++i) {
+      double lo = i == 0 ? wavelengths[0] - 0.5*(wavelengths[1] - wavelengths[0]) : 0.5*(wavelengths[i-1] + wavelengths[i]);
+      double hi = i == usb4kPixelCount-1 ? wavelengths[i] + 0.5*(wavelengths[i] - wavelengths[i-1]) : 0.5*(wavelengths[i] + wavelengths[i+1]);
+      double overlap = std::min(hi, double(bands[b].to)) - std::max(lo, double(bands[b].from));
+      if (overlap > 0) sum += spectra[0][i] * overlap / (hi - lo);
+    }
+    reference[b] = sum;
+  }
+
+  bool ok = true;
+  roiEngine engine(wavelengths, bands);
+  std::vector<float> out(rois);
+  const kernels::isa best = kernels::detectISA();
+  for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+    kernels::activeISA() = kernels::isa(isa);
+    engine.integrate(spectra[0].data(), out.data());
+    double worst = 0;
+    // pixel spans are only piecewise linear in nm, hence a relative tolerance
+    for (int b = 0; b < rois; ++b)
+      worst = std::max(worst, double(std::fabs(out[b] - reference[b]) / std::max(1.0f, std::fabs(reference[b]))));
+    std::cout << "roi variant " << isa << ": worst relative error " << worst << "\n";
+    if (worst > 1e-3) ok = false;
+  }
+  kernels::activeISA() = best;
+
+  engine.beginBatch(frames);
+  auto start = std::chrono::steady_clock::now();
+  for (auto &spectrum : spectra) engine.process(spectrum);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "roi engine: " << rois << " bands, " << frames / seconds << " frames/s, "
+	    << seconds / frames * 1e9 << " ns/frame\n";
+  if (std::isnan(engine.column(rois/2)[0]) || engine.batchFrames() != size_t(frames)) ok = false;
+
+  return ok;
+}
+
+static bool testFilters(int frames)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  // a cubic is reproduced exactly by an order 3 fit, edges included
+  std::array<float, usb4kPixelCount> cubic, slope, out;
+  for (int i = 0; i < usb4kPixelCount; ++i) {
+    double x = (i - 1920) / 1000.0;
+    cubic[i] = 1000 + 500*x - 300*x*x + 200*x*x*x;
+    slope[i] = (500 - 600*x + 600*x*x) / 1000.0;
+  }
+
+  const kernels::isa best = kernels::detectISA();
+  for (int window : { 5, 11, 17 }) {
+    auto smooth = firFilter::savitzkyGolay(window, 3), derivative = firFilter::savitzkyGolay(window, 3, 1);
+    for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+      kernels::activeISA() = kernels::isa(isa);
+      double worst = 0;
+      smooth.apply(cubic, out);
+      for (int i = 0; i < usb4kPixelCount; ++i) worst = std::max(worst, std::fabs(double(out[i]) - cubic[i]) / 1000);
+      derivative.apply(cubic, out);
+      for (int i = 0; i < usb4kPixelCount; ++i) worst = std::max(worst, std::fabs(double(out[i]) - slope[i]));
+      std::cout << "savitzky-golay " << window << " variant " << isa << ": worst error " << worst << "\n";
+      if (worst > 1e-3) ok = false;
+    }
+  }
+
+  // fused dark correction against correct-then-filter, mirrored generic kernel
+  auto simulated = simulateFrames(frames);
+  std::array<float, usb4kPixelCount> dark, corrected, reference;
+  for (int i = 0; i < usb4kPixelCount; ++i) dark[i] = 10 + (i % 7);
+  firFilter gaussian({ 0.05f, 0.25f, 0.4f, 0.25f, 0.05f });
+  gaussian.setDark(dark.data());
+  for (int i = 0; i < usb4kPixelCount; ++i) corrected[i] = simulated[0][i] - 100.0f - dark[i];
+  kernels::activeISA() = kernels::SCALAR;
+  gaussian.apply(corrected, reference);
+  for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+    kernels::activeISA() = kernels::isa(isa);
+    gaussian.apply(simulated[0].data(), 100.0f, out.data());
+    double worst = 0;
+    for (int i = 0; i < usb4kPixelCount; ++i) worst = std::max(worst, double(std::fabs(out[i] - reference[i])));
+    std::cout << "fused dark filter variant " << isa << ": worst error " << worst << "\n";
+    if (worst > 1e-2) ok = false;
+  }
+  kernels::activeISA() = best;
+
+  for (int window : { 11, 13 }) { // unrolled and generic
+    auto smooth = firFilter::savitzkyGolay(window, 2);
+    smooth.setDark(dark.data());
+    auto start = std::chrono::steady_clock::now();
+    for (auto &frame : simulated) smooth.apply(frame.data(), 100.0f, out.data());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "savitzky-golay " << window << " fused: " << seconds / frames * 1e9 << " ns/frame\n";
+  }
+  return ok;
+}
+
+static bool testMatcher(int entries, int queries)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  // references: mixtures of a few smooth endmembers, as for real materials
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  std::normal_distribution<float> noise(0.0f, 1.0f);
+  std::vector<std::array<float, usb4kPixelCount>> endmembers(12);
+  for (auto &e : endmembers) {
+    e.fill(0.0f);
+    for (int line = 0; line < 6; ++line) {
+      float center = uniform(rng) * usb4kPixelCount, width = 20 + uniform(rng) * 300, height = uniform(rng);
+      for (int i = 0; i < usb4kPixelCount; ++i) e[i] += height * std::exp(-0.5f * std::pow((i - center) / width, 2));
+    }
+  }
+  std::vector<std::array<float, usb4kPixelCount>> references(entries);
+  for (auto &r : references) {
+    r.fill(0.0f);
+    for (auto &e : endmembers) {
+      float w = std::pow(uniform(rng), 4);
+      for (int i = 0; i < usb4kPixelCount; ++i) r[i] += w * e[i];
+    }
+  }
+
+  for (auto kind : { spectralMatcher::COSINE, spectralMatcher::CORRELATION, spectralMatcher::SAM }) {
+    spectralMatcher matcher(kind);
+    for (int e = 0; e < entries; ++e) matcher.add("ref" + std::to_string(e), references[e]);
+
+    // noisy, scaled copies of known entries
+    std::vector<int> truth(queries);
+    std::vector<std::array<float, usb4kPixelCount>> frames(queries);
+    for (int q = 0; q < queries; ++q) {
+      truth[q] = rng() % entries;
+      for (int i = 0; i < usb4kPixelCount; ++i) frames[q][i] = 3.0f * references[truth[q]][i] + 0.01f * noise(rng);
+    }
+
+    // near ties may swap places, so compare the ranked scores (as cosines for SAM)
+    auto sameScores = [kind](const std::vector<libraryMatch> &a, const std::vector<libraryMatch> &b) {
+      for (size_t j = 0; j < a.size(); ++j) {
+	float x = a[j].score, y = b[j].score;
+	if (kind == spectralMatcher::SAM) { x = std::cos(x); y = std::cos(y); }
+	if (std::fabs(x - y) > 1e-4f) return false;
+      }
+      return a.size() == b.size();
+    };
+
+    const kernels::isa best = kernels::detectISA();
+    std::vector<std::vector<libraryMatch>> golden(queries);
+    for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+      kernels::activeISA() = kernels::isa(isa);
+      int mismatches = 0;
+      for (int q = 0; q < queries; ++q) {
+	auto found = matcher.find(frames[q], 5);
+	if (isa == kernels::SCALAR) golden[q] = found;
+	else if (!sameScores(found, golden[q])) ++mismatches;
+      }
+      if (mismatches) { std::cout << "matcher variant " << isa << ": " << mismatches << " mismatches\n"; ok = false; }
+    }
+    kernels::activeISA() = best;
+
+    for (int components : { 0, 16 }) {
+      matcher.buildPrefilter(components);
+      int wrong = 0, differ = 0;
+      double latency = 0, worst = 0;
+      size_t candidates = 0;
+      for (int q = 0; q < queries; ++q) {
+	auto found = matcher.find(frames[q], 5);
+	if (found[0].index != truth[q]) ++wrong;
+	if (!sameScores(found, golden[q])) ++differ;
+	latency += matcher.getLastStats().latency;
+	worst = std::max(worst, matcher.getLastStats().latency);
+	candidates += matcher.getLastStats().candidates;
+      }
+      std::cout << "matcher metric " << kind << ", " << entries << " entries, " << components << " components: "
+		<< latency / queries * 1e6 << " us/frame (worst " << worst * 1e6 << " us), "
+		<< candidates / queries << " scored, " << wrong << " wrong, " << differ << " differ from full\n";
+      if (wrong || differ) ok = false;
+    }
+  }
+  return ok;
+}
+
+static bool testRatio(int frames)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  std::array<float, usb4kPixelCount> dark, reference;
+  for (int i = 0; i < usb4kPixelCount; ++i) {
+    dark[i] = 1500 + (i % 13);
+    reference[i] = dark[i] + 100 + 60000 * std::exp(-0.5 * std::pow((i - 1900) / 900.0, 2));
+  }
+
+  // the whole range of transmittances, down to the noise floor and beyond
+  std::vector<uint16_t> raw(usb4kPixelCount);
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> fraction(-0.01f, 1.2f);
+
+  ratioMeasurement absorbance(ratioMeasurement::ABSORBANCE, 4.0f), transmittance(ratioMeasurement::TRANSMITTANCE, 4.0f);
+  absorbance.setDark(dark);
+  absorbance.setReference(reference);
+  transmittance.setDark(dark);
+  transmittance.setReference(reference);
+
+  std::array<float, usb4kPixelCount> a, t;
+  const kernels::isa best = kernels::detectISA();
+  for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+    kernels::activeISA() = kernels::isa(isa);
+    double worst = 0, worstRelative = 0;
+    for (int f = 0; f < 50; ++f) {
+      for (int i = 0; i < usb4kPixelCount; ++i)
+	raw[i] = std::min(65535.0f, std::max(0.0f, dark[i] + fraction(rng) * (reference[i] - dark[i])));
+      absorbance.compute(raw.data(), a.data());
+      transmittance.compute(raw.data(), t.data());
+      for (int i = 0; i < usb4kPixelCount; ++i) {
+	double s = std::max(double(raw[i]) - dark[i], 4.0), r = std::max(double(reference[i]) - dark[i], 4.0);
+	worst = std::max(worst, std::fabs(a[i] + std::log10(s / r)));
+	worstRelative = std::max(worstRelative, std::fabs(t[i] - s / r) / (s / r));
+      }
+    }
+    std::cout << "ratio variant " << isa << ": absorbance error " << worst << " vs std::log10, transmittance relative error "
+	      << worstRelative << "\n";
+    if (worst > 1e-6 || worstRelative > 1e-6) ok = false;
+  }
+  kernels::activeISA() = best;
+
+  auto simulated = simulateFrames(frames);
+  for (auto m : { ratioMeasurement::TRANSMITTANCE, ratioMeasurement::ABSORBANCE }) {
+    absorbance.setMode(m);
+    auto start = std::chrono::steady_clock::now();
+    for (auto &frame : simulated) absorbance.compute(frame.data(), a.data());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "ratio mode " << m << ": " << seconds / frames * 1e9 << " ns/frame\n";
+  }
+
+  // reference per-pixel divide and std::log10, the way clients did it
+  auto start = std::chrono::steady_clock::now();
+  for (auto &frame : simulated)
+    for (int i = 0; i < usb4kPixelCount; ++i)
+      a[i] = -std::log10(std::max(frame[i] - dark[i], 4.0f) / std::max(reference[i] - dark[i], 4.0f));
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "ratio with std::log10: " << seconds / frames * 1e9 << " ns/frame (" << a[100] << ")\n";
+  return ok;
+}
+
+static bool testRecorder(int frames, int rate)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  // a flash in 3 frames, the last two close enough to merge into one event
+  auto simulated = simulateFrames(2000);
+  const std::vector<int> flashes = { frames / 4, frames / 2, frames / 2 + 100 };
+  const size_t pre = 1000, post = 500;
+  const float coeffs[12] = { 178.0f, 0.21f, -1.0e-5f, -1.0e-10f, 1, 0, 0, 0, 0, 0, 0, 0 };
+  const std::string prefix = "/tmp/test_preprocess-event-" + std::to_string(getpid());
+
+  std::vector<std::string> files;
+  double worst = 0, total = 0;
+  {
+    eventRecorder recorder(prefix, coeffs, coeffs + 4, "TEST", pre, post);
+    recorder.addTrigger("flash", triggers::peakAbove(2000, 2100, 60000.0f));
+    std::vector<uint16_t> raw(usb4kPixelCount);
+    auto due = std::chrono::steady_clock::now();
+    for (int f = 0; f < frames; ++f) {
+      // at a frame rate, the writer only has to keep up with the events
+      std::this_thread::sleep_until(due += std::chrono::nanoseconds(1000000000 / rate));
+      raw = simulated[f % simulated.size()];
+      if (std::find(flashes.begin(), flashes.end(), f) != flashes.end()) raw[2050] = 65535;
+      frameMetadata meta = { uint64_t(f), int64_t(f) * 1000000, 1000, NAN };
+
+      auto start = std::chrono::steady_clock::now();
+      recorder.push(meta, raw.data());
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      worst = std::max(worst, seconds);
+      total += seconds;
+    }
+    recorder.flush();
+    files = recorder.getFiles();
+    recorderStats stats = recorder.getStats();
+    std::cout << "event recorder: " << stats.frames << " frames at " << rate << " Hz, " << stats.events << " events, " << stats.written
+	      << " written, " << stats.lost << " lost, push " << total / frames * 1e9 << " ns/frame (worst "
+	      << worst * 1e6 << " us)\n";
+    if (stats.events != 2 || stats.lost) ok = false;
+  }
+
+  // [flash - pre, last flash + post] per event
+  const std::vector<std::pair<uint64_t, uint64_t>> expected = {
+    { flashes[0] - pre, flashes[0] + post }, { flashes[1] - pre, flashes[2] + post } };
+  if (files.size() != expected.size()) ok = false;
+  for (size_t e = 0; e < files.size() && e < expected.size(); ++e) {
+    archiveReader archive(files[e]);
+    bool contiguous = archive.size() == expected[e].second - expected[e].first + 1;
+    for (size_t i = 0; contiguous && i < archive.size(); ++i)
+      contiguous = archive[i].meta.index == expected[e].first + i &&
+	std::equal(archive[i].raw + 100, archive[i].raw + 200, simulated[archive[i].meta.index % simulated.size()].begin() + 100);
+    std::cout << "  " << files[e] << ": " << archive.size() << " frames from " << (archive.size() ? archive[0].meta.index : 0)
+	      << (contiguous ? "" : ", NOT as expected") << "\n";
+    if (!contiguous) ok = false;
+    unlink(files[e].c_str());
+  }
+  return ok;
+}
+
+static bool testReplay(int frames, int rate)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  auto simulated = simulateFrames(frames);
+  const float coeffs[12] = { 178.0f, 0.21f, -1.0e-5f, -1.0e-10f, 1, 0, 0, 0, 0, 0, 0, 0 };
+  const std::string path = "/tmp/test_preprocess-replay-" + std::to_string(getpid()) + ".u4k";
+  const int64_t period = 1000000000LL / rate;
+  {
+    archiveWriter writer(path, coeffs, coeffs + 4, "REPLAY");
+    for (int f = 0; f < frames; ++f) {
+      frameMetadata meta = { uint64_t(f), 1700000000000000000LL + f * period, 1000, NAN };
+      writer.append(meta, simulated[f].data());
+    }
+  }
+
+  // downstream work per frame, the same whatever the source
+  auto smooth = firFilter::savitzkyGolay(11, 2);
+  std::array<float, usb4kPixelCount> out;
+  auto consume = [&](frameSource &source, int count, double speed, double &worst_lag) {
+    frameMetadata meta;
+    const uint16_t *raw;
+    int64_t first = 0;
+    auto start = std::chrono::steady_clock::now();
+    int n = 0;
+    worst_lag = 0;
+    for (; n < count && source.next(meta, raw); ++n) {
+      auto now = std::chrono::steady_clock::now();
+      if (n == 0) { first = meta.timestamp; start = now; }
+      double lag = std::chrono::duration<double>(now - start).count() - (speed > 0 ? (meta.timestamp - first) * 1e-9 / speed : 0.0);
+      worst_lag = std::max(worst_lag, std::fabs(lag));
+      smooth.apply(raw, 0.0f, out.data());
+    }
+    return n;
+  };
+
+  for (double speed : { 10.0, 0.0 }) {
+    replaySource replay(path, speed);
+    double lag;
+    auto start = std::chrono::steady_clock::now();
+    int played = consume(replay, frames, speed, lag);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "replay at " << (speed > 0 ? std::to_string(int(speed)) + "x" : std::string("full speed")) << ": "
+	      << played << " frames in " << seconds << " s, " << played / seconds << " frames/s";
+    if (speed > 0) std::cout << ", worst lag " << lag * 1e6 << " us, " << replay.getLate() << " late";
+    std::cout << "\n";
+    if (played != frames) ok = false;
+    if (speed > 0 && std::fabs(seconds - frames / (rate * speed)) > 0.05 * frames / (rate * speed)) ok = false;
+  }
+
+  // looping carries indices and timestamps on
+  replaySource looping(path, 0.0, true);
+  frameMetadata meta, previous = {};
+  const uint16_t *raw;
+  for (int n = 0; n < 2 * frames + 10; ++n) {
+    looping.next(meta, raw);
+    if (n > 0 && (meta.index != previous.index + 1 || meta.timestamp - previous.timestamp != period)) {
+      std::cout << "replay loop broken at frame " << n << "\n";
+      ok = false;
+      break;
+    }
+    previous = meta;
+  }
+  if (looping.getSerialNumber() != "REPLAY") ok = false;
+
+  unlink(path.c_str());
+  return ok;
+}
+
+static bool testGraph(int frames)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  auto simulated = simulateFrames(256);
+  auto smooth = firFilter::savitzkyGolay(11, 2);
+
+  processingGraph graph(64);
+  int edark = graph.addStage("edark", [](graphFrame &f) {
+      uint32_t sum = 0;
+      for (int j : usb4kEdarkIndices) sum += f.raw[j];
+      const float offset = (float)sum / usb4kEdarkIndices.size();
+      for (int i = 0; i < usb4kPixelCount; ++i) f.spectrum[i] = f.raw[i] - offset;
+      return true;
+    });
+  int filter = graph.addStage("filter", [&smooth](graphFrame &f) {
+      std::array<float, usb4kPixelCount> in = f.spectrum;
+      smooth.apply(in, f.spectrum);
+      return true;
+    }, edark);
+
+  // an ORDERED sink must see every frame exactly once and in order
+  uint64_t expected = 0, disorder = 0;
+  graph.addStage("ordered", [&](graphFrame &f) {
+      if (f.meta.index != expected) ++disorder;
+      expected = f.meta.index + 1;
+      return true;
+    }, filter, processingGraph::ORDERED);
+
+  // every other frame stopped, its subtree sees it skipped
+  int decimate = graph.addStage("decimate", [](graphFrame &f) { return f.meta.index % 2 == 0; }, edark,
+				processingGraph::PARALLEL);
+  uint64_t kept = 0;
+  graph.addStage("decimated sink", [&](graphFrame &f) { ++kept; return true; }, decimate, processingGraph::SERIAL);
+
+  graph.start();
+  auto start = std::chrono::steady_clock::now();
+  for (int f = 0; f < frames; ++f) {
+    frameMetadata meta = { uint64_t(f), 0, 1000, NAN };
+    graph.push(meta, simulated[f % simulated.size()].data());
+  }
+  graph.drain();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  auto stats = graph.getStats();
+  graph.stop();
+
+  std::cout << "processing graph: " << frames / seconds << " frames/s, source blocked " << graph.getSourceWait()
+	    << " s, " << disorder << " out of order\n";
+  for (auto &s : stats)
+    std::cout << "  " << s.name << ": " << s.frames << " frames, " << s.skipped << " skipped, busy " << s.busy
+	      << " s, latency " << s.meanLatency * 1e6 << " us mean, " << s.maxLatency * 1e6 << " us max, queue <= "
+	      << s.queueHighWater << "\n";
+
+  if (disorder || expected != uint64_t(frames) || kept != uint64_t(frames / 2)) ok = false;
+  if (stats[4].skipped != uint64_t(frames - frames / 2) || stats[2].frames != uint64_t(frames)) ok = false;
+  return ok;
+}
+
+static bool testAcquisitionJitter(int frames, int rate)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  auto simulated = simulateFrames(frames);
+  const float coeffs[12] = { 178.0f, 0.21f, -1.0e-5f, -1.0e-10f, 1, 0, 0, 0, 0, 0, 0, 0 };
+  const std::string path = "/tmp/test_preprocess-jitter-" + std::to_string(getpid()) + ".u4k";
+  {
+    archiveWriter writer(path, coeffs, coeffs + 4);
+    for (int f = 0; f < frames; ++f) {
+      frameMetadata meta = { uint64_t(f), int64_t(f) * (1000000000LL / rate), 1000, NAN };
+      writer.append(meta, simulated[f].data());
+    }
+  }
+
+  // the replay sleeps to the recorded timing, so its periods show the scheduling jitter
+  realtimeOptions floating, pinned;
+  pinned.cpu = 0;
+  pinned.fifoPriority = 50;
+  pinned.lockMemory = true;
+  std::vector<uint16_t> ring(64 * usb4kPixelCount);
+  for (size_t i = 0; i < ring.size(); ++i) ring[i] = i * 2654435761u >> 16;
+  const std::vector<uint16_t> before = ring;
+  pinned.prefaultBuffers.push_back({ ring.data(), ring.size() * sizeof(uint16_t) });
+  for (auto *options : { &floating, &pinned }) {
+    replaySource replay(path, 1.0);
+    uint64_t sum = 0;
+    acquisitionThread acquisition(replay, [&sum](const frameMetadata &meta, const uint16_t *raw) { sum += raw[100]; },
+				  *options, 5000, 400);
+    acquisition.start();
+    acquisition.join();
+    std::cout << "acquisition " << (options == &pinned ? "realtime" : "default") << ": ";
+    acquisition.getPeriods().print(std::cout);
+    for (auto &line : acquisition.getReport()) std::cout << "  " << line << "\n";
+    if (acquisition.getFrames() != uint64_t(frames) || !acquisition.getError().empty()) ok = false;
+  }
+  munlockall();
+  // the prefault must leave what is in the buffers alone
+  if (ring != before) ok = false;
+
+  unlink(path.c_str());
+  return ok;
+}
+
+// Simulated free running device: integrations end on a drifting grid, frames arrive
+// after a readout latency plus host delays with occasional long stalls
+static bool testTimestamps(int frames)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  const int integration = 3800;                    // [us]
+  const double period = integration * 1000.0 * (1 + 50e-6); // device clock 50 ppm fast
+  const int64_t latency = 1200000;                 // integration end to first packet [ns]
+  std::mt19937 rng(43);
+  std::exponential_distribution<double> delay(1 / 30000.0);
+  std::uniform_real_distribution<double> uniform(0, 1);
+
+  frameClock clock(latency);
+  frameTimestamps ts;
+  double naiveSquares = 0, estimatedSquares = 0, naiveMax = 0, estimatedMax = 0;
+  int counted = 0, refined = 0;
+  double t = 1e9, updateTime = 0;
+  for (int f = 0; f < frames; ++f) {
+    int64_t request = t;
+    double k = std::ceil((t - 1e9) / period);         // the integration finishing next
+    double end = 1e9 + k * period;
+    double stall = uniform(rng) < 0.02 ? uniform(rng) * 2.5e6 : 0;
+    int64_t arrival = end + latency + delay(rng) + stall;
+
+    auto begin = std::chrono::steady_clock::now();
+    clock.update(request, arrival, arrival + 1000000, integration, ts);
+    updateTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    if (ts.integrationStart != ts.integrationEnd - integration * 1000LL) ok = false;
+    if (f >= 256) {
+      double naive = double(arrival - latency) - end, estimated = double(ts.integrationEnd) - end;
+      naiveSquares += naive * naive;
+      estimatedSquares += estimated * estimated;
+      naiveMax = std::max(naiveMax, std::fabs(naive));
+      estimatedMax = std::max(estimatedMax, std::fabs(estimated));
+      ++counted;
+      refined += ts.refined;
+    }
+    t = arrival + 1000000 + uniform(rng) * 1.5e6;     // rest of the readout, then processing
+  }
+
+  double naiveRms = std::sqrt(naiveSquares / counted), estimatedRms = std::sqrt(estimatedSquares / counted);
+  std::cout << "timestamps: integration end error naive " << naiveRms / 1e3 << " us rms, " << naiveMax / 1e3
+	    << " us max; estimated " << estimatedRms / 1e3 << " us rms, " << estimatedMax / 1e3 << " us max; "
+	    << 100.0 * refined / counted << "% refined, period " << clock.getPeriod() / 1e3 << " us (true "
+	    << period / 1e3 << "), " << updateTime / frames * 1e6 << " us/frame" << std::endl;
+  if (estimatedRms > naiveRms / 10 || refined < counted * 0.95) ok = false;
+
+  // a new integration time starts over from the arrival alone
+  clock.update(int64_t(t), int64_t(t) + 5000000, int64_t(t) + 6000000, 5000, ts);
+  if (ts.refined || ts.integrationEnd != int64_t(t) + 5000000 - latency) ok = false;
+
+  clockOffset offset;
+  for (int i = 0; i < 64; ++i) offset.update();
+  int64_t direct = realtimeNow() - monotonicNow();
+  std::cout << "timestamps: realtime offset uncertainty " << offset.uncertainty() << " ns, "
+	    << std::llabs(direct - offset.offset()) << " ns from a direct reading" << std::endl;
+  if (std::llabs(direct - offset.offset()) > 1000000) ok = false;
+
+  return ok;
+}
+
+// Stands in for libusb_bulk_transfer() timing out on a missed trigger
+static __attribute__((noinline)) int missedTrigger(uint8_t *buf, int &transferred)
+{
+  transferred = 0;
+  asm volatile("" : : "r"(buf) : "memory");
+  return LIBUSB_ERROR_TIMEOUT;
+}
+
+static __attribute__((noinline)) int throwingRead(uint8_t *buf)
+{
+  int inouts;
+  if (missedTrigger(buf, inouts) != 0) throw std::runtime_error("Failed to recevice the data from inEP6!");
+  return inouts;
+}
+
+static bool testTimeouts(int iterations)
 {
-  return 0;
+  using namespace spectrometer;
+  bool ok = true;
+
+  // a 3.8 ms integration: the initial value, then the measured waits with some margin
+  adaptiveTimeout first;
+  first.reset(10, 3 + 2);
+  std::mt19937 rng(44);
+  std::exponential_distribution<double> jitter(1 / 100000.0);
+  for (int i = 0; i < 7; ++i) first.add(3800000 + jitter(rng));
+  if (first.get() != 10) ok = false;
+  for (int i = 0; i < 200; ++i) first.add(3800000 + jitter(rng));
+  int settled = first.get();
+  first.expired();
+  int expired = first.get();
+  // a slower source is followed
+  for (int i = 0; i < 200; ++i) first.add(20000000 + jitter(rng));
+  int slowed = first.get();
+  std::cout << "timeouts: 3.8 ms waits -> " << settled << " ms, " << expired << " ms after a timeout, "
+	    << slowed << " ms after 20 ms waits" << std::endl;
+  if (settled < 5 || settled > 7 || expired <= settled || slowed < 21 || slowed > 30) ok = false;
+
+  // handling a missed trigger: an exception from the wrapper against the returned status
+  uint8_t buf[512];
+  uint64_t caught = 0, returned = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    try {
+      throwingRead(buf);
+    } catch (const std::runtime_error &) {
+      ++caught;
+    }
+  }
+  auto middle = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    int len;
+    if (missedTrigger(buf, len) == LIBUSB_ERROR_TIMEOUT) ++returned;
+  }
+  auto end = std::chrono::steady_clock::now();
+  double thrown = std::chrono::duration<double>(middle - begin).count() / iterations;
+  double status = std::chrono::duration<double>(end - middle).count() / iterations;
+  std::cout << "timeouts: missed trigger handled in " << thrown * 1e9 << " ns thrown, " << status * 1e9
+	    << " ns returned" << std::endl;
+  if (caught != uint64_t(iterations) || returned != uint64_t(iterations)) ok = false;
+
+  return ok;
+}
+
+// Dark frames with a fixed pattern, temporal noise and planted defects
+static bool testPixelStatistics(int frames)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  std::mt19937 rng(45);
+  std::normal_distribution<double> noise(0, 1);
+  std::vector<double> offset(usb4kPixelCount), sigma(usb4kPixelCount, 8.0);
+  for (int i = 0; i < usb4kPixelCount; ++i) offset[i] = 1500 + 5 * noise(rng);
+  const std::vector<int> hot = { 100, 1234, 3000 }, noisy = { 777, 2500 };
+  const int saturating = 1800;
+  for (int i : hot) offset[i] += 500;
+  for (int i : noisy) sigma[i] = 80;
+
+  std::vector<std::vector<uint16_t>> dark(frames, std::vector<uint16_t>(usb4kPixelCount));
+  for (int f = 0; f < frames; ++f)
+    for (int i = 0; i < usb4kPixelCount; ++i)
+      dark[f][i] = uint16_t(std::max(0.0, std::round(offset[i] + sigma[i] * noise(rng))));
+  dark[frames / 2][saturating] = usb4kSaturationLevel;
+
+  // two passes in double as the reference
+  std::vector<double> mean(usb4kPixelCount, 0), variance(usb4kPixelCount, 0);
+  for (auto &frame : dark)
+    for (int i = 0; i < usb4kPixelCount; ++i) mean[i] += frame[i];
+  for (double &m : mean) m /= frames;
+  for (auto &frame : dark)
+    for (int i = 0; i < usb4kPixelCount; ++i) variance[i] += (frame[i] - mean[i]) * (frame[i] - mean[i]);
+  for (double &v : variance) v /= frames - 1;
+
+  const kernels::isa best = kernels::detectISA();
+  for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+    kernels::activeISA() = kernels::isa(isa);
+    pixelStatistics stats, first, second;
+    auto start = std::chrono::steady_clock::now();
+    for (auto &frame : dark) stats.add(frame.data());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (int f = 0; f < frames; ++f) (f < frames / 3 ? first : second).add(dark[f].data());
+    first.merge(second);
+
+    double worstMean = 0, worstVariance = 0;
+    bool exact = true;
+    for (const pixelStatistics *s : { &stats, &first }) {
+      for (int i = 0; i < usb4kPixelCount; ++i) {
+	worstMean = std::max(worstMean, std::fabs(s->getMean()[i] - mean[i]) / mean[i]);
+	worstVariance = std::max(worstVariance, std::fabs(s->variance(i) - variance[i]) / variance[i]);
+	uint16_t lo = 65535, hi = 0;
+	for (auto &frame : dark) { lo = std::min(lo, frame[i]); hi = std::max(hi, frame[i]); }
+	if (s->getMinimum()[i] != lo || s->getMaximum()[i] != hi ||
+	    s->getSaturated()[i] != (i == saturating ? 1u : 0u)) exact = false;
+      }
+    }
+    std::cout << "pixel statistics variant " << isa << ": " << seconds / frames * 1e9 << " ns/frame, mean error "
+	      << worstMean << ", variance error " << worstVariance << " (relative, merged too)" << std::endl;
+    if (worstMean > 1e-12 || worstVariance > 1e-9 || !exact || stats.size() != uint64_t(frames)) ok = false;
+  }
+  kernels::activeISA() = best;
+
+  pixelStatistics stats;
+  for (auto &frame : dark) stats.add(frame.data());
+  std::vector<uint8_t> mask = stats.defectMask();
+  int flagged = 0, missed = 0;
+  for (int i = 0; i < usb4kPixelCount; ++i) flagged += mask[i] != 0;
+  for (int i : hot) missed += !(mask[i] & pixelStatistics::HOT);
+  for (int i : noisy) missed += !(mask[i] & pixelStatistics::NOISY);
+  missed += !(mask[saturating] & pixelStatistics::SATURATED);
+  std::vector<float> pattern(usb4kPixelCount);
+  stats.fixedPattern(pattern.data());
+  std::cout << "pixel statistics: " << flagged << " defects flagged, " << missed << " missed; fixed pattern noise "
+	    << stats.fixedPatternNoise() << " counts (5), temporal noise " << stats.temporalNoise() << " counts (8)" << std::endl;
+  if (missed || flagged > int(hot.size() + noisy.size()) + 1 + 2) ok = false;
+  if (std::fabs(stats.fixedPatternNoise() - 5) > 0.5 || std::fabs(stats.temporalNoise() - 8) > 0.5 ||
+      std::fabs(pattern[hot[0]] - 500) > 20) ok = false;
+
+  return ok;
+}
+
+static bool testPreview(int frames)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  // the decimation variants against the scalar one, on uneven columns
+  std::mt19937 rng(46);
+  std::uniform_int_distribution<int> value(0, 65535);
+  std::vector<uint16_t> lo(usb4kPixelCount + 16), hi(usb4kPixelCount + 16);
+  for (int i = 0; i < usb4kPixelCount; ++i) {
+    lo[i] = value(rng);
+    hi[i] = std::max<int>(lo[i], value(rng));
+  }
+  const kernels::isa best = kernels::detectISA();
+  for (int columns : { 512, 100, 3000 }) {
+    std::vector<int> edges;
+    for (int c = 0; c <= columns; ++c)
+      edges.push_back(usb4kActivePixelBegin + c * (usb4kActivePixelEnd - usb4kActivePixelBegin) / columns);
+    std::vector<uint16_t> goldenLow(columns), goldenHigh(columns), outLow(columns), outHigh(columns);
+    kernels::scalar::decimateMinMax(lo.data(), hi.data(), edges.data(), columns, goldenLow.data(), goldenHigh.data());
+    for (int isa = kernels::SSE; isa <= best; ++isa) {
+      kernels::activeISA() = kernels::isa(isa);
+      kernels::decimateMinMax(lo.data(), hi.data(), edges.data(), columns, outLow.data(), outHigh.data());
+      if (outLow != goldenLow || outHigh != goldenHigh) {
+	std::cout << "preview: decimation variant " << isa << " differs at " << columns << " columns" << std::endl;
+	ok = false;
+      }
+    }
+  }
+  kernels::activeISA() = best;
+
+  // 10 kHz frames into a 30 Hz preview, with a one frame spike
+  auto simulated = simulateFrames(frames);
+  const int spikeFrame = frames / 3, spikePixel = 2000;
+  simulated[spikeFrame][spikePixel] = 60000;
+  previewTap tap(512, 30.0);
+  const std::vector<int> &edges = tap.getColumnEdges();
+  const int spikeColumn = std::upper_bound(edges.begin(), edges.end(), spikePixel) - edges.begin() - 1;
+  uint64_t seen = 0, previews = 0;
+  bool spikeShown = false;
+  for (int f = 0; f < frames; ++f) {
+    frameMetadata meta = { uint64_t(f), int64_t(f) * 100000, 100, NAN };
+    tap.push(meta, simulated[f].data(), int64_t(f) * 100000);
+    if (f == frames - 1) tap.flush();
+    if (const previewFrame *p = tap.latest()) {
+      if (p->firstIndex != seen) ok = false; // nothing between two previews lost
+      seen = p->lastIndex + 1;
+      ++previews;
+      if (p->firstIndex <= uint64_t(spikeFrame) && uint64_t(spikeFrame) <= p->lastIndex)
+	spikeShown = p->high[spikeColumn] == 60000;
+    }
+  }
+  const uint64_t expected = (frames - 1) * 100000LL / (1000000000LL / 30) + 1;
+  std::cout << "preview: " << previews << " previews of " << frames << " frames (" << expected << " ticks + flush), spike "
+	    << (spikeShown ? "shown" : "lost") << std::endl;
+  if (seen != uint64_t(frames) || !spikeShown || previews < expected || previews > expected + 1) ok = false;
+
+  // the cost on the frame stream, with a reader polling like a display; a few
+  // frames over and over, so that the test data does not stream from memory
+  previewTap timed(512, 60.0);
+  std::atomic<bool> done{false};
+  std::atomic<uint64_t> read{0};
+  std::thread reader([&] {
+      while (!done) {
+	if (timed.latest()) ++read;
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    });
+  auto start = std::chrono::steady_clock::now();
+  for (int f = 0; f < frames; ++f) {
+    frameMetadata meta = { uint64_t(f), 0, 100, NAN };
+    timed.push(meta, simulated[f % 8].data());
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  done = true;
+  reader.join();
+  std::cout << "preview: push " << seconds / frames * 1e9 << " ns/frame, " << timed.getPublished() << " published, "
+	    << read << " read" << std::endl;
+
+  return ok;
+}
+
+static bool testWaterfall(int frames)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  // the display kernels against the scalar ones, on an odd width and odd values
+  const int columns = 1021;
+  std::mt19937 rng(47);
+  std::uniform_real_distribution<float> level(-1000, 70000);
+  std::vector<float> in(usb4kPixelCount), fraction(columns), values(columns);
+  std::vector<int> index(columns);
+  for (float &v : in) v = level(rng);
+  for (int c = 0; c < columns; ++c) {
+    index[c] = std::uniform_int_distribution<int>(0, usb4kPixelCount - 2)(rng);
+    fraction[c] = std::uniform_real_distribution<float>(0, 1)(rng);
+    values[c] = level(rng);
+  }
+  values[3] = NAN;
+  uint32_t lut[256];
+  for (int k = 0; k < 256; ++k) lut[k] = k | ((255 - k) << 8) | ((k * 7 & 255) << 16);
+
+  std::vector<float> goldenResampled(columns), resampled(columns);
+  std::vector<uint8_t> goldenRow(3 * columns + 16, 0xaa), row(3 * columns + 16, 0xaa);
+  kernels::scalar::resampleLinear(in.data(), index.data(), fraction.data(), columns, goldenResampled.data());
+  kernels::scalar::colorize(values.data(), 0, 255.0f / 65535, lut, goldenRow.data(), columns);
+  const kernels::isa best = kernels::detectISA();
+  for (int isa = kernels::SSE; isa <= best; ++isa) {
+    kernels::activeISA() = kernels::isa(isa);
+    kernels::resampleLinear(in.data(), index.data(), fraction.data(), columns, resampled.data());
+    kernels::colorize(values.data(), 0, 255.0f / 65535, lut, row.data(), columns);
+    double worst = 0;
+    for (int c = 0; c < columns; ++c)
+      worst = std::max(worst, std::fabs(double(resampled[c]) - goldenResampled[c]) / 70000);
+    // identical rows, and the bytes past the row untouched
+    if (worst > 1e-6 || row != goldenRow) {
+      std::cout << "waterfall: variant " << isa << " differs, resampling error " << worst << std::endl;
+      ok = false;
+    }
+  }
+  kernels::activeISA() = best;
+
+  // flat spectra of rising level: row r of the view has to be the r-th newest
+  waterfallRenderer waterfall(512, 64, 0, 65535);
+  std::vector<float> spectrum(usb4kPixelCount);
+  const int pushed = 100;
+  for (int f = 0; f < pushed; ++f) {
+    std::fill(spectrum.begin(), spectrum.end(), f * 600.0f);
+    waterfall.push(spectrum.data(), 0);
+  }
+  cv::Mat view = waterfall.view();
+  std::vector<uint8_t> expected(3 * 512);
+  for (int r = 0; r < view.rows; ++r) {
+    std::vector<float> flat(512, (pushed - 1 - r) * 600.0f);
+    kernels::scalar::colorize(flat.data(), 0, 255.0f / 65535, waterfall.getColormap(), expected.data(), 512);
+    if (std::memcmp(view.ptr<uint8_t>(r), expected.data(), expected.size()) != 0) {
+      std::cout << "waterfall: row " << r << " is not frame " << pushed - 1 - r << std::endl;
+      ok = false;
+      break;
+    }
+  }
+
+  // the cost of a row does not depend on the history
+  double perRow[2];
+  int histories[2] = { 64, 4096 };
+  auto simulated = simulateFrames(64);
+  std::vector<std::vector<float>> spectra(64, std::vector<float>(usb4kPixelCount));
+  for (int f = 0; f < 64; ++f) std::copy(simulated[f].begin(), simulated[f].end(), spectra[f].begin());
+  for (int h = 0; h < 2; ++h) {
+    waterfallRenderer timed(1024, histories[h], 0, 40000);
+    auto start = std::chrono::steady_clock::now();
+    for (int f = 0; f < frames; ++f) timed.push(spectra[f % 64].data(), 0);
+    perRow[h] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / frames;
+  }
+
+  // encoded at 10 Hz from 1 kHz frames, on the encoder thread; waiting after every push
+  // keeps ticks from merging, so each one gives an image
+  waterfallRenderer encoding(512, 128, 0, 40000);
+  encoding.setEncoding(".png", 10.0);
+  int changes = 0;
+  std::shared_ptr<const std::vector<uchar>> last;
+  for (int f = 0; f < 1000; ++f) {
+    encoding.push(spectra[f % 64].data(), int64_t(f) * 1000000);
+    encoding.waitEncoded();
+    auto image = encoding.getEncoded();
+    if (image != last) { ++changes; last = image; }
+  }
+  // and not waiting, the pushes only flag the ticks
+  waterfallRenderer unwaited(512, 128, 0, 40000);
+  unwaited.setEncoding(".png", 1000.0);
+  auto start = std::chrono::steady_clock::now();
+  for (int f = 0; f < frames; ++f) unwaited.push(spectra[f % 64].data(), int64_t(f) * 1000000);
+  double encodingRow = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / frames;
+  unwaited.waitEncoded();
+  std::cout << "waterfall: " << perRow[0] * 1e9 << " ns/row with 64 rows of history, " << perRow[1] * 1e9
+	    << " ns/row with 4096, " << encodingRow * 1e9 << " ns/row encoding every row; " << changes
+	    << " images encoded in 1 s of 1 kHz frames" << std::endl;
+  // 64 times the history may miss the cache more, but is far from the 64 times a copy would cost
+  if (perRow[1] > 4 * perRow[0]) ok = false;
+  if (changes != 10 || encoding.getEncodedCount() != 10 || !last || last->empty()) ok = false;
+  if (unwaited.getEncodedCount() < 1 || unwaited.getEncodedCount() > uint64_t(frames)) ok = false;
+
+  return ok;
+}
+
+static bool testStreamingPCA(int frames)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  // three orthogonal directions (bands far apart) with known deviations, plus white noise;
+  // in the second half the strongest fades out and a new one takes its place
+  auto band = [](int center, double width) {
+    std::vector<float> b(usb4kPixelCount);
+    double norm = 0;
+    for (int i = 0; i < usb4kPixelCount; ++i) {
+      b[i] = std::exp(-std::pow((i - center) / width, 2));
+      norm += b[i] * b[i];
+    }
+    for (float &x : b) x /= std::sqrt(norm);
+    return b;
+  };
+  const std::vector<std::vector<float>> bands = { band(800, 20), band(1800, 30), band(2800, 15), band(2200, 25) };
+  const double deviations[2][4] = { { 400, 200, 100, 0 }, { 0, 200, 100, 400 } };
+  const double noiseLevel = 2;
+
+  auto cosine = [](const float *w, const std::vector<float> &b) {
+    double d = 0;
+    for (int i = usb4kActivePixelBegin; i < usb4kActivePixelEnd; ++i) d += w[i - usb4kActivePixelBegin] * b[i];
+    return std::fabs(d);
+  };
+
+  const kernels::isa best = kernels::detectISA();
+  for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+    kernels::activeISA() = kernels::isa(isa);
+    std::mt19937 rng(49);
+    std::normal_distribution<float> noise(0, 1);
+    streamingPCA pca(4, 1e-3f);
+    std::vector<float> spectrum(usb4kPixelCount);
+    frameMetadata meta = {};
+    double seconds = 0, alignment[2][3], variance[3], residual = 0, anomaly = 0;
+
+    for (int f = 0; f < frames; ++f) {
+      const int phase = f < frames / 2 ? 0 : 1;
+      for (int i = 0; i < usb4kPixelCount; ++i) spectrum[i] = 1000 + 0.1f * i + noiseLevel * noise(rng);
+      for (int b = 0; b < 4; ++b) {
+	float a = deviations[phase][b] * noise(rng);
+	for (int i = 0; i < usb4kPixelCount; ++i) spectrum[i] += a * bands[b][i];
+      }
+      // one frame with a band the model has never seen
+      if (f == frames / 2 - 1)
+	for (int i = 1300; i < 1340; ++i) spectrum[i] += 100;
+      meta.index = f;
+
+      auto start = std::chrono::steady_clock::now();
+      const pcaScores &scores = pca.push(meta, spectrum.data());
+      seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      if (f >= frames / 4 && f < frames / 2 - 1) residual = std::max<double>(residual, scores.residual);
+      if (f == frames / 2 - 1) anomaly = scores.residual;
+      // before the drift each component on its band, in order; after it the new band
+      // leads, while the order of the others still settles, so they are taken as a subspace
+      if (f == frames / 2 - 2)
+	for (int c = 0; c < 3; ++c) {
+	  alignment[0][c] = cosine(pca.getComponent(c), bands[c]);
+	  variance[c] = pca.getVariances()[c];
+	}
+      if (f == frames - 1)
+	for (int b : { 3, 1, 2 }) {
+	  double captured = 0;
+	  for (int c = 0; c < 4; ++c) captured += std::pow(cosine(pca.getComponent(c), bands[b]), 2);
+	  alignment[1][b == 3 ? 0 : b] = b == 3 ? cosine(pca.getComponent(0), bands[b]) : std::sqrt(captured);
+	}
+    }
+
+    // every direction on top of the noise in it
+    double worstAlignment = 1, worstVariance = 0;
+    for (int c = 0; c < 3; ++c) {
+      worstAlignment = std::min({ worstAlignment, alignment[0][c], alignment[1][c] });
+      double expected = deviations[0][c] * deviations[0][c] + noiseLevel * noiseLevel;
+      worstVariance = std::max(worstVariance, std::fabs(variance[c] - expected) / expected);
+    }
+    std::cout << "PCA variant " << isa << ": " << seconds / frames * 1e9 << " ns/frame, alignment "
+	      << worstAlignment << " at worst, after the drift too, variance error " << worstVariance
+	      << ", anomaly residual " << anomaly / residual << " times the largest normal one" << std::endl;
+    if (worstAlignment < 0.99 || worstVariance > 0.15 || anomaly < 10 * residual) ok = false;
+
+    // the score stream: the newest ring of scores in order, then nothing
+    uint64_t cursor = 0, read = 0, last = 0;
+    pcaScores scores = {};
+    while (pca.next(cursor, scores)) {
+      if (read++ && scores.index != last + 1) ok = false;
+      last = scores.index;
+    }
+    if (read != 1024 || last != uint64_t(frames - 1) || scores.components != 4 || pca.next(cursor, scores)) ok = false;
+  }
+  kernels::activeISA() = best;
+
+  return ok;
+}
+
+static bool testStitching(int cycles)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  // three devices on adjacent ranges with 20 nm overlaps, each with its own polynomial
+  const float coeffs[3][4] = { { 200.0f, 0.0700f, -1.5e-7f, 2e-12f },
+			       { 430.0f, 0.0760f, -2.0e-7f, 3e-12f },
+			       { 680.0f, 0.0750f, -1.0e-7f, 1e-12f } };
+  const int32_t integration[3] = { 5000, 10000, 20000 };
+  std::array<float, usb4kPixelCount> wavelengths[3];
+  for (int d = 0; d < 3; ++d) wavelengthsFromCoeffs(coeffs[d], wavelengths[d]);
+
+  // a smooth source [counts/ms], seen by every device with its integration time
+  auto source = [](double nm) {
+    return 200 + 0.3 * nm + 3000 * std::exp(-std::pow((nm - 440) / 6, 2)) + 1500 * std::exp(-std::pow((nm - 690) / 9, 2));
+  };
+  std::vector<std::vector<float>> spectra(3, std::vector<float>(usb4kPixelCount));
+  for (int d = 0; d < 3; ++d)
+    for (int i = 0; i < usb4kPixelCount; ++i) spectra[d][i] = source(wavelengths[d][i]) * integration[d] / 1000.0;
+  const float *inputs[3] = { spectra[0].data(), spectra[1].data(), spectra[2].data() };
+
+  spectralStitcher stitcher({ wavelengths[0].data(), wavelengths[1].data(), wavelengths[2].data() });
+  const std::vector<float> &grid = stitcher.getWavelengths();
+  std::vector<float> reference(stitcher.size()), out(stitcher.size());
+
+  const kernels::isa best = kernels::detectISA();
+  for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+    kernels::activeISA() = kernels::isa(isa);
+    auto start = std::chrono::steady_clock::now();
+    for (int c = 0; c < cycles; ++c) stitcher.stitch(inputs, integration, out.data());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (isa == kernels::SCALAR) reference = out;
+
+    double worst = 0, variants = 0;
+    bool finite = true;
+    for (size_t j = 0; j < out.size(); ++j) {
+      if (!std::isfinite(out[j])) finite = false;
+      worst = std::max(worst, std::fabs(out[j] - source(grid[j])) / source(grid[j]));
+      variants = std::max(variants, double(std::fabs(out[j] - reference[j]) / reference[j]));
+    }
+    std::cout << "stitching variant " << isa << ": " << seconds / cycles * 1e9 << " ns/cycle for " << out.size()
+	      << " points over " << grid.front() << ".." << grid.back() << " nm, error " << worst
+	      << " (relative), " << variants << " from scalar" << std::endl;
+    if (!finite || worst > 1e-3 || variants > 1e-5) ok = false;
+  }
+  kernels::activeISA() = best;
+
+  // the overlaps fade: every point's weights sum to 1, shown by a flat source
+  std::vector<std::vector<float>> flat(3, std::vector<float>(usb4kPixelCount, 1.0f));
+  const float *flats[3] = { flat[0].data(), flat[1].data(), flat[2].data() };
+  const int32_t milliseconds[3] = { 1000, 1000, 1000 };
+  stitcher.stitch(flats, milliseconds, out.data());
+  for (float v : out) if (std::fabs(v - 1) > 1e-5) ok = false;
+
+  // without the middle device its range is a gap
+  spectralStitcher outer({ wavelengths[0].data(), wavelengths[2].data() }, grid[1] - grid[0]);
+  const float *ends[2] = { spectra[0].data(), spectra[2].data() };
+  const int32_t endIntegration[2] = { integration[0], integration[2] };
+  std::vector<float> gapped(outer.size());
+  outer.stitch(ends, endIntegration, gapped.data());
+  int nan = 0;
+  for (size_t j = 0; j < gapped.size(); ++j)
+    if (std::isnan(gapped[j])) ++nan;
+    else if (std::fabs(gapped[j] - source(outer.getWavelengths()[j])) > 1e-3 * source(outer.getWavelengths()[j])) ok = false;
+  const int expectedGap = outer.getFirst(1) - outer.getFirst(0) - outer.getCount(0);
+  if (nan != expectedGap || expectedGap < 1000) ok = false;
+
+  // free running devices: a cycle for every frame of the slowest, each with overlapping integrations
+  int64_t lastEnd = 0;
+  bool aligned = true;
+  stitcher.setSink([&](const frameMetadata &meta, const float *spectrum) {
+      if (meta.timestamp - meta.integration * 1000 < lastEnd) aligned = false;
+      lastEnd = meta.timestamp;
+    });
+  std::vector<std::pair<int64_t, int>> arrivals;
+  const int64_t offsets[3] = { 1300000, 4100000, 700000 };
+  for (int d = 0; d < 3; ++d)
+    for (int64_t t = offsets[d] + integration[d] * 1000; t < 2000000000; t += integration[d] * 1000)
+      arrivals.emplace_back(t, d);
+  std::sort(arrivals.begin(), arrivals.end());
+  uint64_t frames[3] = { 0, 0, 0 };
+  for (auto &a : arrivals) {
+    frameMetadata meta = { frames[a.second]++, a.first, integration[a.second], NAN };
+    stitcher.push(a.second, meta, inputs[a.second]);
+  }
+  std::cout << "stitching: " << stitcher.getCycles() << " cycles from " << frames[0] << ", " << frames[1] << " and "
+	    << frames[2] << " frames, " << stitcher.getUnpaired() << " unpaired" << std::endl;
+  if (!aligned || stitcher.getCycles() + 1 < frames[2] || stitcher.getCycles() > frames[2]) ok = false;
+
+  // one producer thread per device, a round of frames at a time; the sink runs outside the
+  // lock, so cycles may overlap, and every one must still see its own frames
+  spectralStitcher concurrent({ wavelengths[0].data(), wavelengths[1].data(), wavelengths[2].data() });
+  concurrent.setTolerance(std::numeric_limits<int64_t>::max() / 4);
+  std::atomic<int> delivered{0}, wrong{0};
+  concurrent.setSink([&](const frameMetadata &meta, const float *spectrum) {
+      const size_t j = concurrent.size() / 2;
+      if (std::fabs(spectrum[j] - source(grid[j])) > 1e-3 * source(grid[j])) ++wrong;
+      ++delivered;
+    });
+  std::atomic<int> round{0};
+  std::vector<std::thread> producers;
+  for (int d = 0; d < 3; ++d)
+    producers.emplace_back([&, d] {
+	for (int f = 0; f < 200; ++f) {
+	  while (round.load() < 3 * f) std::this_thread::yield();
+	  frameMetadata meta = { uint64_t(f), (f + 1) * 20000000LL, integration[d], NAN };
+	  concurrent.push(d, meta, inputs[d]);
+	  ++round;
+	}
+      });
+  for (auto &t : producers) t.join();
+  std::cout << "stitching from 3 threads: " << concurrent.getCycles() << " cycles, " << delivered << " delivered, "
+	    << wrong << " wrong, " << concurrent.getUnpaired() << " unpaired" << std::endl;
+  if (wrong || delivered != 200 || concurrent.getCycles() != 200) ok = false;
+
+  return ok;
+}
+
+// Completes at once through the executor, as a transfer callback from handleEvents() would
+struct fakeTransfer {
+  spectrometer::executor &exec;
+  int value;
+  bool fail;
+
+  bool await_ready(void) const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) { exec.schedule(h); }
+  int await_resume(void) {
+    if (fail) throw std::runtime_error("Fake transfer failed!");
+    return value;
+  }
+};
+
+static spectrometer::task<int> awaitTwice(spectrometer::executor &ex, int a, int b, bool fail)
+{
+  int x = co_await fakeTransfer{ex, a, false};
+  int y = co_await fakeTransfer{ex, b, fail};
+  co_return x + y;
+}
+
+static spectrometer::task<void> awaitChain(spectrometer::executor &ex, int id, std::vector<int> &trace, int &sum,
+					   bool &caught)
+{
+  for (int i = 0; i < 3; ++i) {
+    trace.push_back(id);
+    sum += co_await awaitTwice(ex, i, 10 * i, false);
+  }
+  try {
+    co_await awaitTwice(ex, 1, 2, true);
+  } catch (const std::runtime_error &) {
+    caught = true;
+  }
+}
+
+static spectrometer::task<void> awaitFailing(spectrometer::executor &ex)
+{
+  co_await awaitTwice(ex, 1, 2, true);
+}
+
+/*
+  The coroutine front-end without hardware: task chains returning values,
+  two tasks interleaving on one executor, an exception caught inside a
+  chain and one escaping from run().
+*/
+static bool testAwaitable(void)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  executor ex;
+  std::vector<int> trace;
+  int sums[2] = { 0, 0 };
+  bool caught[2] = { false, false };
+  ex.spawn(awaitChain(ex, 1, trace, sums[0], caught[0]));
+  ex.spawn(awaitChain(ex, 2, trace, sums[1], caught[1]));
+  ex.run();
+  if (trace != std::vector<int>({ 1, 2, 1, 2, 1, 2 }) || sums[0] != 33 || sums[1] != 33 || !caught[0] || !caught[1])
+    ok = false;
+
+  bool rethrown = false;
+  ex.spawn(awaitFailing(ex));
+  try {
+    ex.run();
+  } catch (const std::runtime_error &) {
+    rethrown = true;
+  }
+  if (!rethrown) ok = false;
+
+  std::cout << "awaitable: order";
+  for (int id : trace) std::cout << " " << id;
+  std::cout << ", sums " << sums[0] << " and " << sums[1] << " (33), exception " << (caught[0] && caught[1] ? "caught" : "lost")
+	    << " in the chain and " << (rethrown ? "rethrown" : "lost") << " by run()" << std::endl;
+  return ok;
+}
+
+/*
+  Dark library: bilinear interpolation between synthetic darks that are
+  linear in integration time and temperature, the nearest entry outside
+  them, the cache following new frames, and a save/load round trip that
+  saves the same bytes again.
+*/
+static bool testDarkLibrary(void)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  auto dark = [](int i, int usec, float celsius) { return 1000 + i % 50 + 2 * usec / 1000 + 4 * celsius; };
+  darkLibrary library;
+  std::array<uint16_t, usb4kPixelCount> raw;
+  for (int usec : { 10000, 20000 })
+    for (float celsius : { 20.0f, 30.0f }) {
+      for (int i = 0; i < usb4kPixelCount; ++i) raw[i] = dark(i, usec, celsius);
+      library.addFrame(usec, celsius, raw);
+    }
+
+  auto worst = [&](int usec, float celsius, int at_usec, float at_celsius, float shift) {
+    const darkLibrary::frame &frame = library.darkFrame(usec, celsius);
+    double error = 0;
+    for (int i = 0; i < usb4kPixelCount; ++i)
+      error = std::max(error, double(std::fabs(frame[i] - dark(i, at_usec, at_celsius) - shift)));
+    return error;
+  };
+  double between = worst(15000, 25.0f, 15000, 25.0f, 0);
+  double outside = worst(40000, 40.0f, 20000, 30.0f, 0);
+  double below = worst(5000, 10.0f, 10000, 20.0f, 0);
+  // a second frame of +40 at one corner moves its mean by 20, a quarter of that in the middle
+  for (int i = 0; i < usb4kPixelCount; ++i) raw[i] = dark(i, 10000, 20.0f) + 40;
+  worst(15000, 25.0f, 15000, 25.0f, 0);
+  library.addFrame(10000, 20.0f, raw);
+  double refreshed = worst(15000, 25.0f, 15000, 25.0f, 5);
+  std::cout << "dark library: error " << between << " interpolated, " << outside << " and " << below
+	    << " beyond the entries, " << refreshed << " after a new frame" << std::endl;
+  if (between > 1e-3 || outside > 1e-3 || below > 1e-3 || refreshed > 1e-3 || library.size() != 4) ok = false;
+
+  const std::string prefix = "/tmp/test_preprocess-darks-" + std::to_string(getpid());
+  library.save(prefix + "-1.dark");
+  darkLibrary loaded(1.0f);
+  loaded.load(prefix + "-1.dark");
+  loaded.save(prefix + "-2.dark");
+  std::ifstream first(prefix + "-1.dark", std::ios::binary), second(prefix + "-2.dark", std::ios::binary);
+  std::string a((std::istreambuf_iterator<char>(first)), std::istreambuf_iterator<char>());
+  std::string b((std::istreambuf_iterator<char>(second)), std::istreambuf_iterator<char>());
+  bool same = !a.empty() && a == b && loaded.size() == library.size() &&
+    loaded.darkFrame(15000, 25.0f) == library.darkFrame(15000, 25.0f);
+  std::cout << "dark library: " << a.size() << " bytes saved, " << (same ? "identical" : "different") << " after a reload"
+	    << std::endl;
+  if (!same) ok = false;
+  unlink((prefix + "-1.dark").c_str());
+  unlink((prefix + "-2.dark").c_str());
+
+  return ok;
+}
+
+/*
+  HDR fusion of exposures of 1, 4 and 16 ms of a known source, with pixels
+  that saturate in the longer ones and a band saturated in all: the result
+  against the source in counts per millisecond, the num/den weighting done
+  in double, the saturated pixels per frame, the all saturated band on the
+  shortest exposure, once with a dark frame and once with an offset, and
+  every variant against scalar bit for bit.
+*/
+static bool testHdrFusion(void)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  const int exposures[] = { 16000, 1000, 4000 };  // [us], any order
+  std::vector<double> source(usb4kPixelCount);       // [counts/ms]
+  for (int i = 0; i < usb4kPixelCount; ++i)
+    source[i] = i >= 1000 && i < 1100 ? 1e5 : 20 + (i * 37) % 20000 + 0.3 * (i % 4);
+  std::vector<float> darkFrame(usb4kPixelCount);
+  for (int i = 0; i < usb4kPixelCount; ++i) darkFrame[i] = 100 + i % 10;
+  std::vector<std::vector<uint16_t>> raws(3, std::vector<uint16_t>(usb4kPixelCount));
+
+  std::vector<float> reference(usb4kPixelCount);
+  const kernels::isa best = kernels::detectISA();
+  for (bool withDark : { true, false }) {
+    const float *dark = withDark ? darkFrame.data() : NULL;
+    const float offset = withDark ? 0 : 150;
+    std::vector<int> saturated(3, 0);
+    for (int e = 0; e < 3; ++e)
+      for (int i = 0; i < usb4kPixelCount; ++i) {
+	double level = source[i] * exposures[e] / 1000 + offset + (dark ? dark[i] : 0);
+	raws[e][i] = uint16_t(std::min(65535.0, std::round(level)));
+	if (raws[e][i] >= usb4kSaturationLevel) ++saturated[e];
+      }
+    // only the band saturates in 1 ms, more of the source in 4 and 16 ms
+    if (saturated[1] != 100 || !(saturated[2] > 100 && saturated[0] > saturated[2])) ok = false;
+
+    for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+      kernels::activeISA() = kernels::isa(isa);
+      hdrFusion fusion;
+      bool counted = true;
+      for (int e = 0; e < 3; ++e)
+	counted &= fusion.add(raws[e].data(), exposures[e], dark, offset) == saturated[e];
+      const std::array<float, usb4kPixelCount> &fused = fusion.result();
+
+      double sourceError = 0, weightError = 0, bandError = 0;
+      for (int i = 0; i < usb4kPixelCount; ++i) {
+	const double corrected = offset + (dark ? dark[i] : 0);
+	double num = 0, den = 0;
+	for (int e = 0; e < 3; ++e)
+	  if (raws[e][i] < usb4kSaturationLevel) { num += raws[e][i] - corrected; den += exposures[e] / 1000.0; }
+	if (den > 0) {
+	  weightError = std::max(weightError, std::fabs(fused[i] - num / den) / (num / den + 1));
+	  // rounding the counts costs up to half a count over the exposure summed
+	  sourceError = std::max(sourceError, std::fabs(fused[i] - source[i]) * den);
+	} else
+	  bandError = std::max(bandError, std::fabs(fused[i] - (65535 - corrected)));
+      }
+      bool same = true;
+      if (isa == kernels::SCALAR) std::copy(fused.begin(), fused.end(), reference.begin());
+      else same = std::equal(fused.begin(), fused.end(), reference.begin());
+
+      std::cout << "hdr fusion (" << (isa == kernels::AVX2 ? "avx2" : isa == kernels::SSE ? "sse" : "scalar")
+		<< (withDark ? ", dark" : ", offset") << "): " << saturated[0] << "/" << saturated[1] << "/"
+		<< saturated[2] << " saturated, error " << sourceError << " counts against the source, "
+		<< weightError << " relative to the weighting, " << bandError << " counts/ms all saturated"
+		<< (same ? "" : ", differs from scalar") << std::endl;
+      if (!counted || sourceError > 0.5 + 1e-3 || weightError > 1e-5 || bandError > 1e-3 || !same) ok = false;
+    }
+  }
+  kernels::activeISA() = best;
+  return ok;
+}
+
+/*
+  Peak search on Gaussian lines at known sub-pixel centres: the error of each
+  refinement, lines drifting from frame to frame that must keep to their own
+  tracker entry past a neighbour, the localMaxima variants against scalar on
+  noise with ties, and the time of peakFinder::find() per frame.
+*/
+static bool testPeaks(int frames)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  std::array<float, usb4kPixelCount> wavelengths;
+  for (int i = 0; i < usb4kPixelCount; ++i) wavelengths[i] = 200 + 0.25f * i;
+  const double centres[] = { 400.37, 812.81, 1500.5, 1512.25, 2203.12, 3000.66 };
+  const double amplitudes[] = { 5000, 1200, 3000, 1500, 800, 4000 };
+  const double sigma = 1.8;
+  auto render = [&](double drift, std::array<float, usb4kPixelCount> &spectrum) {
+    spectrum.fill(0);
+    for (int l = 0; l < 6; ++l)
+      for (int i = int(centres[l] + drift) - 12; i <= int(centres[l] + drift) + 12; ++i) {
+	double x = (i - centres[l] - drift) / sigma;
+	spectrum[i] += amplitudes[l] * std::exp(-0.5 * x * x);
+      }
+  };
+
+  std::array<float, usb4kPixelCount> spectrum;
+  render(0, spectrum);
+  const char *names[] = { "centroid", "parabolic", "gaussian" };
+  const double limits[] = { 0.1, 0.05, 1e-3 };
+  for (int method = peakFinder::CENTROID; method <= peakFinder::GAUSSIAN; ++method) {
+    peakFinder finder(wavelengths, 100, 200, 16, peakFinder::fit_method(method));
+    const std::vector<peak> &peaks = finder.find(spectrum);
+    double worst = peaks.size() == 6 ? 0 : INFINITY;
+    for (size_t l = 0; l < peaks.size() && l < 6; ++l) {
+      worst = std::max(worst, std::fabs(peaks[l].pixel - centres[l]));
+      worst = std::max(worst, std::fabs(peaks[l].wavelength - (200 + 0.25 * centres[l])) / 0.25);
+    }
+    std::cout << "peaks (" << names[method] << "): " << peaks.size() << " of 6 found, worst error " << worst
+	      << " pixels\n";
+    if (worst > limits[method]) ok = false;
+  }
+
+  // 0.01 pixel per frame over 300 frames; lines 3 and 4 stay 11.75 pixels apart
+  lineTracker tracker(1.0f);
+  for (int l = 0; l < 6; ++l) tracker.addLine(200 + 0.25f * centres[l]);
+  peakFinder finder(wavelengths, 100, 200, 16, peakFinder::GAUSSIAN);
+  double wander = 0;
+  bool kept = true;
+  for (int f = 1; f <= 300; ++f) {
+    double drift = 0.01 * f;
+    render(drift, spectrum);
+    tracker.update(finder.find(spectrum));
+    const std::vector<lineTracker::line> &lines = tracker.getLines();
+    for (int l = 0; l < 6; ++l) {
+      wander = std::max(wander, std::fabs(lines[l].wavelength - 0.25 * (centres[l] + drift) - 200));
+      if (lines[l].missed || lines[l].nominal != float(200 + 0.25f * centres[l])) kept = false;
+    }
+  }
+  std::cout << "line tracker: " << (kept ? "every line kept" : "lines lost or swapped") << " over 3 pixels of drift, "
+	    << wander << " nm from the true position at worst\n";
+  if (!kept || wander > 1e-3) ok = false;
+
+  // local maxima on quantized noise, which has plateaus and ties, over every tail length
+  std::mt19937 random(7);
+  std::uniform_int_distribution<int> level(0, 7);
+  std::vector<float> noise(usb4kPixelCount);
+  for (float &x : noise) x = level(random);
+  std::vector<int> reference(usb4kPixelCount), indices(usb4kPixelCount);
+  const kernels::isa best = kernels::detectISA();
+  size_t mismatches = 0;
+  for (int n = usb4kPixelCount - 17; n <= usb4kPixelCount; ++n)
+    for (float threshold : { -1.0f, 3.0f, 6.0f }) {
+      int expected = kernels::scalar::localMaxima(noise.data(), threshold, reference.data(), n);
+      for (int isa = kernels::SSE; isa <= best; ++isa) {
+	kernels::activeISA() = kernels::isa(isa);
+	int found = kernels::localMaxima(noise.data(), threshold, indices.data(), n);
+	if (found != expected || !std::equal(indices.begin(), indices.begin() + found, reference.begin())) ++mismatches;
+      }
+    }
+  std::cout << "local maxima variants: " << mismatches << " mismatches against scalar\n";
+  if (mismatches) ok = false;
+
+  // a noisy frame with the lines, found over and over
+  render(0, spectrum);
+  std::normal_distribution<float> gauss(0, 20);
+  for (float &x : spectrum) x += gauss(random);
+  for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+    kernels::activeISA() = kernels::isa(isa);
+    for (int method = peakFinder::CENTROID; method <= peakFinder::GAUSSIAN; ++method) {
+      peakFinder timed(wavelengths, 100, 200, 16, peakFinder::fit_method(method));
+      size_t found = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (int f = 0; f < frames; ++f) found += timed.find(spectrum).size();
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      std::cout << "peak finder variant " << isa << " (" << names[method] << "): " << seconds / frames * 1e9
+		<< " ns/frame, " << double(found) / frames << " peaks\n";
+    }
+  }
+  kernels::activeISA() = best;
+  return ok;
+}
+
+/*
+  Batch reprocessing of a small archive written here: the full chain with
+  resampling gives the same rows on one thread and on several, the grid
+  has every point from..to of a step that float accumulation gets wrong,
+  a range beyond the calibration is refused, and without corrections the
+  averaged rows are the plain mean of the raw frames.
+*/
+static bool testBatch(int frames)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  auto simulated = simulateFrames(frames);
+  const float coeffs[12] = { 178.0f, 0.21f, -1.0e-5f, -1.0e-10f, 0.95f, 2.0e-6f, -1.0e-11f, 0, 0, 0, 0, 0 };
+  const std::string path = "/tmp/test_preprocess-batch-" + std::to_string(getpid()) + ".u4k";
+  {
+    archiveWriter writer(path, coeffs, coeffs + 4, "BATCH");
+    for (int f = 0; f < frames; ++f) {
+      frameMetadata meta = { uint64_t(f), 1700000000000000000LL + f * 1000000LL, 1000, NAN };
+      writer.append(meta, simulated[f].data());
+    }
+  }
+  archiveReader archive(path);
+
+  batchConfig config;
+  config.resample = true;
+  config.resampleFrom = 200, config.resampleTo = 800, config.resampleStep = 0.1f;
+  config.average = 4;
+  config.chunkFrames = 8;
+  batchProcessor processor(archive, config);
+  std::vector<float> single, parallel;
+  double one = processor.run(single, 1);
+  const int threads = std::max(2, omp_get_max_threads());
+  double many = processor.run(parallel, threads);
+  bool same = single.size() == processor.rowCount() * processor.rowWidth() && single == parallel;
+  std::cout << "batch: " << archive.size() << " frames -> " << processor.rowCount() << " x " << processor.rowWidth()
+	    << ", " << one << " s on 1 thread, " << many << " s on " << threads << ", "
+	    << (same ? "identical" : "different") << "\n";
+  if (archive.size() != size_t(frames) || processor.rowWidth() != 6001 || !same) ok = false;
+
+  bool refused = false;
+  try {
+    config.resampleTo = 900;
+    batchProcessor beyond(archive, config);
+  } catch (std::out_of_range &) {
+    refused = true;
+  }
+  std::cout << "batch: a grid beyond the calibration " << (refused ? "refused" : "accepted") << "\n";
+  if (!refused) ok = false;
+
+  batchConfig plain;
+  plain.edark = plain.linearity = false;
+  plain.average = 4;
+  batchProcessor passThrough(archive, plain);
+  passThrough.run(parallel, threads);
+  size_t mismatches = 0;
+  for (size_t r = 0; r < passThrough.rowCount(); ++r)
+    for (int i = 0; i < usb4kPixelCount; ++i) {
+      float sum = 0;
+      for (int k = 0; k < 4; ++k) sum += simulated[r * 4 + k][i];
+      if (parallel[r * usb4kPixelCount + i] != sum / 4) ++mismatches;
+    }
+  std::cout << "batch: " << mismatches << " mismatches of the averaged rows against the raw frames\n";
+  if (mismatches) ok = false;
+
+  unlink(path.c_str());
+  return ok;
+}
+
+/*
+  The per-frame preprocessing of main.cpp against the plain loops it
+  replaced: electric dark correction, peak search over the active pixels
+  and accumulation, every variant on every frame and on odd lengths.
+*/
+static bool testPreprocessKernels(int frames)
+{
+  using namespace spectrometer;
+  bool ok = true;
+
+  auto simulated = simulateFrames(frames, 48);
+  // a saturated plateau, whose first pixel is the peak
+  for (int i = 1500; i < 1510; ++i) simulated[frames / 2][i] = 65535;
+
+  const int active = usb4kActivePixelEnd - usb4kActivePixelBegin;
+  const kernels::isa best = kernels::detectISA();
+  for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+    kernels::activeISA() = kernels::isa(isa);
+    std::vector<float> goldenAccumulator(usb4kPixelCount, 0), accumulator(usb4kPixelCount, 0);
+    std::vector<float> golden(usb4kPixelCount), spectrum(usb4kPixelCount);
+    std::vector<float> dark(usb4kPixelCount), goldenNum(usb4kPixelCount, 0), goldenDen(usb4kPixelCount, 0);
+    std::vector<float> num(usb4kPixelCount, 0), den(usb4kPixelCount, 0);
+    std::vector<int> goldenMaxima(usb4kPixelCount), maxima(usb4kPixelCount);
+    for (int i = 0; i < usb4kPixelCount; ++i) dark[i] = 3 + i % 11 * 0.5f;
+    int mismatches = 0, f = 0;
+    for (auto &raw : simulated) {
+      uint32_t sum = 0;
+      for (int j : usb4kEdarkIndices) sum += raw[j];
+      float edarkness = (float)sum / usb4kEdarkIndices.size();
+      std::transform(raw.begin(), raw.end(), golden.begin(), [edarkness](uint16_t v) -> float { return v - edarkness; });
+      auto peak = std::max_element(golden.begin() + usb4kActivePixelBegin, golden.begin() + usb4kActivePixelEnd);
+      std::transform(goldenAccumulator.begin(), goldenAccumulator.end(), golden.begin(), goldenAccumulator.begin(),
+		     std::plus<float>());
+
+      float level = kernels::offsetCorrect(raw.data(), usb4kEdarkIndices.front(), usb4kEdarkIndices.size(),
+					   spectrum.data(), usb4kPixelCount);
+      float max;
+      int index = kernels::argmax(spectrum.data() + usb4kActivePixelBegin, active, max);
+      kernels::accumulate(spectrum.data(), accumulator.data(), usb4kPixelCount);
+
+      if (level != edarkness || spectrum != golden || max != *peak ||
+	  index != peak - golden.begin() - usb4kActivePixelBegin || accumulator != goldenAccumulator) ++mismatches;
+
+      // strict maxima above the threshold, a plateau counting at its first pixel
+      int goldenFound = 0;
+      for (int i = 1; i < active - 1; ++i) {
+	const float *v = golden.data() + usb4kActivePixelBegin;
+	if (v[i] > 2000 && v[i] > v[i-1] && v[i] >= v[i+1]) goldenMaxima[goldenFound++] = i;
+      }
+      int found = kernels::localMaxima(spectrum.data() + usb4kActivePixelBegin, 2000, maxima.data(), active);
+      if (found != goldenFound || !std::equal(maxima.begin(), maxima.begin() + found, goldenMaxima.begin()))
+	++mismatches;
+
+      // exposures of 1, 2 and 3 ms, the plateau and the peaks above 30000 saturated
+      const float ms = 1 + f++ % 3;
+      int goldenSaturated = 0;
+      for (int i = 0; i < usb4kPixelCount; ++i) {
+	if (raw[i] >= 30000) { ++goldenSaturated; continue; }
+	goldenNum[i] += raw[i] - edarkness - dark[i];
+	goldenDen[i] += ms;
+      }
+      int saturated = kernels::hdrAccumulate(raw.data(), dark.data(), edarkness, 30000, ms, num.data(), den.data(),
+					     usb4kPixelCount);
+      if (saturated != goldenSaturated || num != goldenNum || den != goldenDen) ++mismatches;
+    }
+
+    // lengths off the vector widths, and ties between lanes
+    for (int n : { 1, 7, 13, 1001 }) {
+      std::vector<float> v(n, 5.0f);
+      float max;
+      if (kernels::argmax(v.data(), n, max) != 0 || max != 5.0f) ++mismatches;
+      v[n / 2] = 9.0f;
+      if (n > 1) v[n - 1] = 9.0f;
+      if (kernels::argmax(v.data(), n, max) != (n > 1 ? n / 2 : 0) || max != 9.0f) ++mismatches;
+      std::vector<float> out(n), reference(n);
+      kernels::offsetCorrect(simulated[0].data(), 5, 0, out.data(), n);
+      kernels::scalar::offsetCorrect(simulated[0].data(), 5, 0, reference.data(), n);
+      if (out != reference) ++mismatches;
+    }
+
+    std::cout << "preprocessing variant " << isa << ": " << mismatches << " mismatches over " << frames << " frames"
+	      << std::endl;
+    if (mismatches) ok = false;
+  }
+  kernels::activeISA() = best;
+  return ok;
+}
+
+/*
+  Microbenchmarks of kernels.hpp, every variant on a full frame of the
+  size in use: ns per frame, and GB/s over the bytes a frame reads and
+  writes. A few frames cycle, so the figures are for data in cache.
+*/
+static void benchmarkKernels(int frames)
+{
+  using namespace spectrometer;
+  const int n = usb4kPixelCount, active = usb4kActivePixelEnd - usb4kActivePixelBegin, columns = 1024;
+
+  auto simulated = simulateFrames(16, 49);
+  std::vector<std::vector<float>> spectra(16, std::vector<float>(n));
+  for (int f = 0; f < 16; ++f) std::copy(simulated[f].begin(), simulated[f].end(), spectra[f].begin());
+
+  std::vector<float> out(n), acc(n, 0), dark(n, 1500), inverse(n, 1e-4f), num(n, 0), den(n, 0), rows(4 * n, 0.5f);
+  std::vector<float> fraction(columns, 0.25f), resampled(columns, 1000);
+  std::vector<double> prefix(n + 1), mean(n, 0), m2(n, 0);
+  std::vector<uint16_t> lo(n + 16, 0xffff), hi(n + 16, 0), decimatedLow(512), decimatedHigh(512);
+  std::vector<uint32_t> saturated(n, 0), lut(256, 0x123456);
+  std::vector<uint8_t> bgr(3 * columns);
+  std::vector<int> indices(n), index(columns), edges, pairs(n);
+  for (int c = 0; c < columns; ++c) index[c] = c * (n - 2) / columns;
+  for (int i = 0; i < n; ++i) pairs[i] = std::min(i, n - 2);
+  for (int c = 0; c <= 512; ++c) edges.push_back(c * n / 512);
+  float dots[4], max = 0;
+  uint64_t count = 0;
+
+  struct benchmark {
+    const char *name;
+    size_t bytes; // read and written per frame
+    std::function<void(int f)> run;
+  };
+  const std::vector<benchmark> benchmarks = {
+    { "offsetCorrect", 6 * size_t(n), [&](int f) {
+	kernels::offsetCorrect(simulated[f].data(), usb4kEdarkIndices.front(), usb4kEdarkIndices.size(), out.data(), n); } },
+    { "argmax", 4 * size_t(active), [&](int f) {
+	kernels::argmax(spectra[f].data() + usb4kActivePixelBegin, active, max); } },
+    { "accumulate", 12 * size_t(n), [&](int f) { kernels::accumulate(spectra[f].data(), acc.data(), n); } },
+    { "localMaxima", 4 * size_t(n), [&](int f) {
+	kernels::localMaxima(spectra[f].data(), 5000, indices.data(), n); } },
+    { "hdrAccumulate", 22 * size_t(n), [&](int f) {
+	kernels::hdrAccumulate(simulated[f].data(), dark.data(), 0, 65535, 1000, num.data(), den.data(), n); } },
+    { "prefixSum", 12 * size_t(n), [&](int f) { kernels::prefixSum(spectra[f].data(), prefix.data(), n); } },
+    { "dot4", 20 * size_t(n), [&](int f) { kernels::dot4(spectra[f].data(), rows.data(), n, n, dots); } },
+    { "ratio", 14 * size_t(n), [&](int f) {
+	kernels::ratio(simulated[f].data(), dark.data(), inverse.data(), 4, true, out.data(), n); } },
+    { "welford", 50 * size_t(n), [&](int f) {
+	kernels::welford(simulated[f].data(), 1.0 / ++count, 65535, mean.data(), m2.data(), lo.data(), hi.data(),
+			 saturated.data(), n); } },
+    { "minMaxAccumulate", 10 * size_t(n), [&](int f) {
+	kernels::minMaxAccumulate(simulated[f].data(), lo.data(), hi.data(), n); } },
+    { "decimateMinMax", 4 * size_t(n) + 4 * 512, [&](int f) {
+	kernels::decimateMinMax(lo.data(), hi.data(), edges.data(), 512, decimatedLow.data(), decimatedHigh.data()); } },
+    { "resampleLinear", 16 * size_t(columns), [&](int f) {
+	kernels::resampleLinear(spectra[f].data(), index.data(), fraction.data(), columns, resampled.data()); } },
+    { "center", 16 * size_t(active), [&](int f) {
+	kernels::center(spectra[f].data() + usb4kActivePixelBegin, acc.data(), 1e-3f, out.data(), active); } },
+    { "dot", 8 * size_t(active), [&](int f) {
+	max += kernels::dot(spectra[f].data() + usb4kActivePixelBegin, dark.data(), active); } },
+    { "scaleAdd", 12 * size_t(active), [&](int f) {
+	kernels::scaleAdd(0.999f, acc.data(), 1e-3f, spectra[f].data() + usb4kActivePixelBegin, active, dots[0], dots[1]); } },
+    { "deflate", 16 * size_t(active), [&](int f) {
+	kernels::deflate(spectra[f].data() + usb4kActivePixelBegin, 1e-3f, 1e-3f, num.data(), out.data(), active); } },
+    { "blendLinear", 20 * size_t(n), [&](int f) {
+	kernels::blendLinear(spectra[f].data(), pairs.data(), inverse.data(), inverse.data(), 1.0f, n, num.data()); } },
+    { "colorize", 11 * size_t(columns), [&](int f) {
+	kernels::colorize(resampled.data(), 0, 255.0f / 40000, lut.data(), bgr.data(), columns); } },
+  };
+
+  const kernels::isa best = kernels::detectISA();
+  std::cout << "kernel benchmarks, ns/frame and GB/s for scalar";
+  if (best >= kernels::SSE) std::cout << ", SSE4.1";
+  if (best >= kernels::AVX2) std::cout << ", AVX2";
+  std::cout << ":" << std::endl;
+  for (auto &b : benchmarks) {
+    std::cout << "  " << std::left << std::setw(18) << b.name << std::right;
+    for (int isa = kernels::SCALAR; isa <= best; ++isa) {
+      kernels::activeISA() = kernels::isa(isa);
+      for (int f = 0; f < 64; ++f) b.run(f % 16); // warm up
+      auto start = std::chrono::steady_clock::now();
+      for (int f = 0; f < frames; ++f) b.run(f % 16);
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / frames;
+      std::cout << std::fixed << std::setprecision(0) << std::setw(9) << seconds * 1e9 << " ns"
+		<< std::setprecision(1) << std::setw(7) << b.bytes / seconds / 1e9 << " GB/s";
+    }
+    std::cout << std::defaultfloat << std::setprecision(6) << std::endl;
+  }
+  kernels::activeISA() = best;
+}
+
+int main(int argc, char *argv[])
+{
+  bool ok = true;
+
+  ok &= testPreprocessKernels(2000);
+  // only the kernels, for quick comparisons
+  if (argc > 1 && std::string(argv[1]) == "--bench") {
+    benchmarkKernels(20000);
+    std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+  }
+  benchmarkKernels(20000);
+
+  ok &= testShmThroughput(4, 200000);
+  ok &= testStreamServer(2000);
+  ok &= testCodec(simulateFrames(2000), "simulated");
+  ok &= testRoiEngine(1000, 2000);
+  ok &= testFilters(2000);
+  ok &= testMatcher(3000, 200);
+  ok &= testRatio(2000);
+  ok &= testRecorder(10000, 10000);
+  ok &= testReplay(2000, 1000);
+  ok &= testGraph(20000);
+  ok &= testAcquisitionJitter(2000, 1000);
+  ok &= testTimestamps(5000);
+  ok &= testTimeouts(200000);
+  ok &= testPixelStatistics(2000);
+  ok &= testPreview(20000);
+  ok &= testWaterfall(20000);
+  ok &= testStreamingPCA(8000);
+  ok &= testStitching(20000);
+  ok &= testAwaitable();
+  ok &= testDarkLibrary();
+  ok &= testHdrFusion();
+  ok &= testPeaks(20000);
+  ok &= testBatch(400);
+  // real frames from a recorded archive, if one is given
+  if (argc > 1) ok &= testCodec(loadFrames(argv[1], 20000), "recorded");
+
+  std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+  return ok ? 0 : 1;
 }
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <ctime>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+namespace spectrometer {
+  inline int64_t monotonicNow(void) {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  inline int64_t realtimeNow(void) {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  /*
+    CLOCK_REALTIME - CLOCK_MONOTONIC. Each sample reads the realtime clock
+    between two monotonic reads; the narrowest bracket of the last samples
+    wins, so a preemption between the reads does not bias the offset, while
+    a step of the realtime clock (NTP, settimeofday) still gets through
+    within a window.
+  */
+  class clockOffset {
+  private:
+    struct sample { int64_t offset, width; };
+    std::deque<sample> samples;
+    size_t window;
+
+  public:
+    clockOffset(size_t window_samples=64) : window(window_samples) { update(); }
+
+    int64_t update(void) {
+      int64_t m1 = monotonicNow(), r = realtimeNow(), m2 = monotonicNow();
+      samples.push_back({ r - (m1 + m2) / 2, m2 - m1 });
+      if (samples.size() > window) samples.pop_front();
+      return offset();
+    }
+
+    int64_t offset(void) const {
+      return std::min_element(samples.begin(), samples.end(),
+			      [](const sample &a, const sample &b) { return a.width < b.width; })->offset;
+    }
+    // Half the narrowest bracket [ns], the uncertainty of offset()
+    int64_t uncertainty(void) const {
+      return std::min_element(samples.begin(), samples.end(),
+			      [](const sample &a, const sample &b) { return a.width < b.width; })->width / 2;
+    }
+  };
+
+  // CLOCK_MONOTONIC [ns] of one frame; realtime() maps them to CLOCK_REALTIME
+  struct frameTimestamps {
+    int64_t requestSent;      // spectrum request written to EP1
+    int64_t integrationStart; // estimated
+    int64_t integrationEnd;   // estimated
+    int64_t firstPacket;      // first EP6 packet received
+    int64_t readoutComplete;  // sync byte received
+    int64_t realtimeOffset;   // CLOCK_REALTIME - CLOCK_MONOTONIC
+    bool refined;             // integration from the device clock model, not this frame alone
+
+    int64_t realtime(int64_t monotonic) const { return monotonic + realtimeOffset; }
+  };
+
+  /*
+    Estimates when each frame was integrated from when it arrived.
+
+    In the free running (normal) trigger mode the detector integrates back to
+    back, so integrations end on a grid t0 + k*P of the device clock with P
+    close to the integration time. A frame arrives readoutLatency after the
+    end of its integration plus a host delay that is never negative (USB
+    scheduling, preemption). The arrivals of the last frames are fitted with
+    a line over their grid indices k, and the line is moved down onto the
+    earliest arrival (the lower envelope), which cancels the host delay. P is
+    refined along, so device clock drift is followed.
+
+    Until enough frames are seen, or when the arrivals do not fit a grid
+    (other trigger modes, a changed integration time), the end is taken as
+    the arrival minus readoutLatency, and refined stays false.
+  */
+  class frameClock {
+  private:
+    int64_t readoutLatency;
+    size_t window;
+    size_t minimumFrames;
+    int integration = 0;      // [us] of the current grid
+    std::deque<std::pair<double, int64_t>> arrivals; // grid index, first packet
+    double period = 0;        // [ns]
+    double phase = 0;         // [ns] tick of grid index 0, on the lower envelope of the arrivals
+    bool fitted = false;
+    clockOffset offsets;
+    std::vector<double> residuals, sorted;
+
+    // The grid index of an arrival is fixed when it comes in: from the fitted grid, on
+    // which it is at or behind its tick, else counted in periods from the previous one
+    double index(int64_t arrival) const {
+      if (arrivals.empty()) return 0;
+      const auto &last = arrivals.back();
+      double k = fitted ? std::floor((arrival - phase) / period + 0.25)
+	: last.first + std::round((arrival - last.second) / period);
+      return std::max(k, last.first + 1);
+    }
+
+    void fit(void) {
+      fitted = false;
+      if (arrivals.size() < minimumFrames) return;
+
+      // Least squares of arrival over index, relative to the oldest for precision. The
+      // host delays are one sided, so the fit is repeated on the arrivals below the
+      // median, which follows the lower envelope and leaves the stalls out.
+      const size_t n = arrivals.size();
+      const double k0 = arrivals.front().first, a0 = arrivals.front().second;
+      double p = period, origin = 0, threshold = INFINITY, low = 0;
+      residuals.resize(n);
+      for (int pass = 0; pass < 3; ++pass) {
+	double m = 0, sk = 0, sa = 0, skk = 0, ska = 0;
+	for (size_t i = 0; i < n; ++i) {
+	  if (pass && residuals[i] > threshold) continue;
+	  double k = arrivals[i].first - k0, a = arrivals[i].second - a0;
+	  m += 1; sk += k; sa += a; skk += k * k; ska += k * a;
+	}
+	double det = m * skk - sk * sk;
+	if (det <= 0) return;
+	p = (m * ska - sk * sa) / det;
+	origin = a0 + (sa - p * sk) / m - p * k0;
+
+	for (size_t i = 0; i < n; ++i)
+	  residuals[i] = arrivals[i].second - (origin + p * arrivals[i].first);
+	sorted.assign(residuals.begin(), residuals.end());
+	std::nth_element(sorted.begin(), sorted.begin() + n / 2, sorted.end());
+	threshold = sorted[n / 2];
+	low = *std::min_element(sorted.begin(), sorted.end());
+      }
+      // a drift of more than a few percent is not the device clock, and most arrivals
+      // have to be close to the envelope, else this is no grid
+      if (std::fabs(p - integration * 1000.0) > 0.05 * integration * 1000.0) return;
+      if (threshold - low > 0.25 * p) return;
+
+      period = p;
+      phase = origin + low;
+      fitted = true;
+    }
+
+  public:
+    // readout_latency_ns: integration end to first packet, from the detector readout and the
+    // transfer of one packet; calibrate it against an external trigger if it matters
+    frameClock(int64_t readout_latency_ns=0, size_t window_frames=256, size_t minimum_frames=16)
+      : readoutLatency(readout_latency_ns), window(window_frames), minimumFrames(minimum_frames) {}
+
+    void reset(void) { arrivals.clear(); fitted = false; }
+
+    void update(int64_t request_sent, int64_t first_packet, int64_t readout_complete, int integration_us,
+		frameTimestamps &out) {
+      if (integration_us != integration) {
+	reset();
+	integration = integration_us;
+	period = integration_us * 1000.0;
+      }
+      arrivals.emplace_back(index(first_packet), first_packet);
+      if (arrivals.size() > window) arrivals.pop_front();
+      fit();
+
+      int64_t end = first_packet - readoutLatency;
+      out.refined = false;
+      if (fitted) {
+	end = std::min(end, int64_t(phase + arrivals.back().first * period) - readoutLatency);
+	out.refined = true;
+      }
+
+      out.requestSent = request_sent;
+      out.integrationEnd = end;
+      out.integrationStart = end - int64_t(integration_us) * 1000;
+      out.firstPacket = first_packet;
+      out.readoutComplete = readout_complete;
+      out.realtimeOffset = offsets.update();
+    }
+
+    bool isRefined(void) const { return fitted; }
+    // [ns] of the device clock grid, 0 before the first frame
+    double getPeriod(void) const { return period; }
+    int64_t getReadoutLatency(void) const { return readoutLatency; }
+    void setReadoutLatency(int64_t ns) { readoutLatency = ns; }
+  };
+
+  /*
+    A libusb timeout [ms] that follows the measured durations of a transfer:
+    the exponentially weighted mean plus six standard deviations, rounded up
+    and one millisecond added for the granularity of libusb, within floor and
+    ceiling. Until a few durations are seen the initial value applies. A
+    transfer that timed out although it should have completed calls
+    expired(), which doubles the estimate, so a timeout that is too tight
+    corrects itself within a frame.
+  */
+  class adaptiveTimeout {
+  private:
+    int initial, floor, ceiling;
+    double weight;
+    double mean = 0, variance = 0; // [ns]
+    uint64_t count = 0;
+
+  public:
+    adaptiveTimeout(int initial_ms=10, int floor_ms=1, int ceiling_ms=60000, double weight_=1.0/32)
+      : initial(initial_ms), floor(floor_ms), ceiling(ceiling_ms), weight(weight_) {}
+
+    void reset(int initial_ms, int floor_ms) {
+      initial = std::clamp(initial_ms, floor_ms, ceiling);
+      floor = floor_ms;
+      mean = variance = 0;
+      count = 0;
+    }
+
+    void add(int64_t ns) {
+      if (count++ == 0) { mean = ns; variance = 0; return; }
+      double delta = ns - mean;
+      mean += weight * delta;
+      variance = (1 - weight) * (variance + weight * delta * delta);
+    }
+
+    void expired(void) {
+      if (count < 8) initial = std::min(2 * initial, ceiling);
+      else { mean *= 2; variance *= 4; }
+    }
+
+    int get(void) const {
+      if (count < 8) return initial;
+      double ms = (mean + 6 * std::sqrt(variance)) / 1e6;
+      return int(std::clamp(std::ceil(ms) + 1, double(floor), double(ceiling)));
+    }
+
+    uint64_t size(void) const { return count; }
+    double getMean(void) const { return mean; }
+    double getDeviation(void) const { return std::sqrt(variance); }
+  };
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "spectrometer.hpp"
+#include "kernels.hpp"
+#include "timing.hpp"
+
+namespace spectrometer {
+  /*
+    Waterfall (spectrogram) image of the latest spectra, newest row on top.
+
+    A push() costs the same whatever the history: the spectrum is resampled
+    to the columns (kernels::resampleLinear over precomputed indices, evenly
+    spaced in pixels or in wavelength), mapped through a 256 entry colormap
+    (kernels::colorize) into one row of a circular cv::Mat, and nothing else
+    is moved. The ring holds every row twice, at r and r + rows, so the
+    history in display order is always one contiguous block: view() is a
+    cv::Mat header on it, without copying. It is meant for the pushing
+    thread, e.g. cv::imshow() between frames.
+
+    For other threads, setEncoding() compresses the view at a fixed rate
+    (cv::imencode, e.g. ".jpg" for a web client) and getEncoded() hands out
+    the newest image. push() only flags the ticks; an encoder thread copies
+    the view under the lock push() writes its row under and compresses the
+    copy outside it, so a push waits at most for that copy. A tick coming
+    while the last image is still being compressed is merged into the next.
+  */
+  class waterfallRenderer {
+  private:
+    int width, history;
+    int head = 0; // newest row
+    uint64_t lines = 0;
+    cv::Mat ring;
+
+    std::vector<int> index;
+    std::vector<float> fraction;
+    std::vector<float> resampled;
+    uint32_t lut[256];
+    float offset, scale;
+
+    std::string format;
+    std::vector<int> encodeParams;
+    int64_t encodePeriod = 0, nextEncode = 0;
+    std::mutex encodedLock;    // the ring and head, and everything of the encoder below
+    std::condition_variable encodeWake, encodeDone;
+    bool encodeRequested = false, encoding = false, stopping = false;
+    uint64_t encodedCount = 0;
+    std::shared_ptr<const std::vector<uchar>> encoded;
+    std::thread encoder;
+
+    void encoderLoop(void) {
+      cv::Mat snapshot;
+      std::unique_lock<std::mutex> guard(encodedLock);
+      while (true) {
+	encodeWake.wait(guard, [this] { return stopping || encodeRequested; });
+	if (stopping) break;
+	encodeRequested = false;
+	encoding = true;
+	view().copyTo(snapshot);
+	const std::string ext = format;
+	const std::vector<int> params = encodeParams;
+	guard.unlock();
+
+	auto image = std::make_shared<std::vector<uchar>>();
+	cv::imencode(ext, snapshot, *image, params);
+
+	guard.lock();
+	encoded = std::move(image);
+	++encodedCount;
+	encoding = false;
+	encodeDone.notify_all();
+      }
+    }
+
+    void setColumn(int c, double position) {
+      position = std::min(std::max(position, 0.0), double(usb4kPixelCount - 1));
+      index[c] = std::min(int(position), usb4kPixelCount - 2);
+      fraction[c] = position - index[c];
+    }
+
+  public:
+    waterfallRenderer(int columns=1024, int rows=512, float low=0, float high=65535, int colormap=cv::COLORMAP_JET,
+		      int pixel_from=usb4kActivePixelBegin, int pixel_to=usb4kActivePixelEnd)
+      : width(columns), history(rows) {
+      if (columns < 1 || rows < 1)
+	throw std::invalid_argument("Waterfall needs at least one column and one row!");
+      if (pixel_from < 0 || pixel_to > usb4kPixelCount || pixel_from >= pixel_to)
+	throw std::out_of_range("Waterfall pixel range Out of range!");
+
+      ring = cv::Mat(2 * rows, columns, CV_8UC3, cv::Scalar::all(0));
+      index.resize(columns);
+      fraction.resize(columns);
+      resampled.resize(columns);
+      // column centers over the pixel range
+      for (int c = 0; c < columns; ++c)
+	setColumn(c, pixel_from + (c + 0.5) * (pixel_to - pixel_from) / columns - 0.5);
+      setRange(low, high);
+      setColormap(colormap);
+    }
+    virtual ~waterfallRenderer(void) {
+      {
+	std::lock_guard<std::mutex> guard(encodedLock);
+	stopping = true;
+      }
+      encodeWake.notify_all();
+      if (encoder.joinable()) encoder.join();
+    }
+
+    waterfallRenderer(const waterfallRenderer &) = delete;
+    waterfallRenderer& operator=(const waterfallRenderer &) = delete;
+
+    // Values mapped from low (first color) to high (last color)
+    void setRange(float low, float high) {
+      if (!(high > low))
+	throw std::invalid_argument("Waterfall range must not be empty!");
+      offset = low;
+      scale = 255.0f / (high - low);
+    }
+
+    // One of cv::COLORMAP_*
+    void setColormap(int colormap) {
+      cv::Mat ramp(256, 1, CV_8UC1), colors;
+      for (int k = 0; k < 256; ++k) ramp.at<uchar>(k) = k;
+      cv::applyColorMap(ramp, colors, colormap);
+      for (int k = 0; k < 256; ++k) {
+	cv::Vec3b bgr = colors.at<cv::Vec3b>(k);
+	lut[k] = bgr[0] | (bgr[1] << 8) | (bgr[2] << 16);
+      }
+    }
+
+    // Columns evenly spaced in wavelength over [nm_from, nm_to] instead of in pixels;
+    // wavelengths ascending per pixel, e.g. usb4k::getWavelengths()
+    void setWavelengthAxis(const float *wavelengths, float nm_from, float nm_to) {
+      if (!(nm_to > nm_from))
+	throw std::invalid_argument("Waterfall wavelength range must not be empty!");
+      for (int c = 0; c < width; ++c) {
+	float nm = nm_from + (c + 0.5f) * (nm_to - nm_from) / width;
+	int k = std::upper_bound(wavelengths, wavelengths + usb4kPixelCount, nm) - wavelengths - 1;
+	k = std::min(std::max(k, 0), usb4kPixelCount - 2);
+	setColumn(c, k + (nm - wavelengths[k]) / (wavelengths[k + 1] - wavelengths[k]));
+      }
+    }
+
+    // now: CLOCK_MONOTONIC [ns] deciding the encoding ticks
+    void push(const float *spectrum, int64_t now) {
+      kernels::resampleLinear(spectrum, index.data(), fraction.data(), width, resampled.data());
+      bool tick = encodePeriod > 0 && now >= nextEncode;
+      {
+	// the new row overwrites one the encoder may be copying
+	std::lock_guard<std::mutex> guard(encodedLock);
+	head = head == 0 ? history - 1 : head - 1;
+	uchar *row = ring.ptr<uchar>(head);
+	kernels::colorize(resampled.data(), offset, scale, lut, row, width);
+	std::memcpy(ring.ptr<uchar>(head + history), row, 3 * width);
+	if (tick) encodeRequested = true;
+      }
+      ++lines;
+
+      if (tick) {
+	encodeWake.notify_one();
+	nextEncode += encodePeriod;
+	if (nextEncode <= now) nextEncode = now + encodePeriod;
+      }
+    }
+    void push(const float *spectrum) { push(spectrum, monotonicNow()); }
+
+    // rows x columns BGR, newest row first, sharing the ring's memory. Take a
+    // new one after a push: in an older view the next row lands at the bottom.
+    cv::Mat view(void) const { return ring.rowRange(head, head + history); }
+
+    // ext as for cv::imencode, rate 0 to stop encoding; from the pushing thread
+    void setEncoding(const std::string &ext=".png", double rate=10.0, const std::vector<int> &params=std::vector<int>()) {
+      if (rate < 0)
+	throw std::invalid_argument("Encoding rate must not be negative!");
+      {
+	std::lock_guard<std::mutex> guard(encodedLock);
+	format = ext;
+	encodeParams = params;
+      }
+      encodePeriod = rate > 0 ? int64_t(1e9 / rate) : 0;
+      nextEncode = 0;
+      if (encodePeriod > 0 && !encoder.joinable()) encoder = std::thread(&waterfallRenderer::encoderLoop, this);
+    }
+    // Waits until the ticks pushed so far are encoded
+    void waitEncoded(void) {
+      std::unique_lock<std::mutex> guard(encodedLock);
+      encodeDone.wait(guard, [this] { return !encodeRequested && !encoding; });
+    }
+    // Images encoded so far
+    uint64_t getEncodedCount(void) {
+      std::lock_guard<std::mutex> guard(encodedLock);
+      return encodedCount;
+    }
+    // The newest encoded image, NULL before the first
+    std::shared_ptr<const std::vector<uchar>> getEncoded(void) {
+      std::lock_guard<std::mutex> guard(encodedLock);
+      return encoded;
+    }
+
+    // The colormap as packed BGR entries
+    const uint32_t* getColormap(void) const { return lut; }
+    int getColumns(void) const { return width; }
+    int getRows(void) const { return history; }
+    // Rows pushed so far, of which the last getRows() are in view()
+    uint64_t size(void) const { return lines; }
+  };
+}